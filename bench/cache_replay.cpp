@@ -0,0 +1,265 @@
+/**
+ * Replays a request trace against the file cache and against a plain LRU
+ * cache of the same size, as the cache was before W-TinyLFU, and prints the
+ * hit ratio of each for several cache sizes. The file cache runs twice: with
+ * mapped storage, bounded by its policy's budget like the LRU model, and
+ * with copies in the slab allocator, whose partly used segments leave less
+ * room for files.
+ *
+ * The default trace is generated: Zipf(0.9) requests over a set of small
+ * files, interrupted at regular intervals by a crawl of large files
+ * requested once each. Every request looks its file up and stores it on a
+ * miss, as the server does. --write-trace saves the trace, --trace replays
+ * one instead, a line per request with its path and size.
+ *
+ * The cache logs through the logger, which writes to webserver.log in the
+ * working directory and to the console, so the replay runs in a scratch
+ * directory with the console pointed at /dev/null.
+ */
+
+#include "cache.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fcntl.h>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+namespace {
+struct Request {
+  string path;
+  size_t size;
+};
+
+struct TraceOptions {
+  size_t requests = 300000;
+  size_t files = 2000;
+  double skew = 0.9;
+  size_t min_file_size = 1000;
+  size_t max_file_size = 20000;
+  // A crawl of distinct large files every crawl_interval requests
+  size_t crawl_interval = 30000;
+  size_t crawl_files = 300;
+  size_t min_crawl_size = 100000;
+  size_t max_crawl_size = 300000;
+  uint64_t seed = 42;
+};
+
+vector<Request> generate_trace(const TraceOptions &options) {
+  mt19937_64 random(options.seed);
+  vector<size_t> sizes(options.files);
+  for (size_t &size : sizes)
+    size = uniform_int_distribution<size_t>(options.min_file_size,
+                                            options.max_file_size)(random);
+  // Cumulative Zipf weights, the file of rank r is requested in proportion
+  // to 1 / r^skew
+  vector<double> weights(options.files);
+  double total = 0;
+  for (size_t rank = 0; rank < options.files; rank++) {
+    total += 1 / pow(static_cast<double>(rank + 1), options.skew);
+    weights[rank] = total;
+  }
+
+  vector<Request> trace;
+  trace.reserve(options.requests + options.requests / options.crawl_interval *
+                                       options.crawl_files);
+  size_t crawled = 0;
+  for (size_t i = 0; i < options.requests; i++) {
+    if (i > 0 && i % options.crawl_interval == 0) {
+      for (size_t j = 0; j < options.crawl_files; j++)
+        trace.push_back({format("/crawl/{}.pdf", crawled++),
+                         uniform_int_distribution<size_t>(
+                             options.min_crawl_size,
+                             options.max_crawl_size)(random)});
+    }
+    const double point =
+        uniform_real_distribution<double>(0, total)(random);
+    const size_t rank =
+        min<size_t>(ranges::lower_bound(weights, point) - weights.begin(),
+                    options.files - 1);
+    trace.push_back({format("/files/{}.html", rank), sizes[rank]});
+  }
+  return trace;
+}
+
+bool read_trace(const string &file, vector<Request> &trace) {
+  ifstream in(file);
+  if (!in)
+    return false;
+  Request request;
+  while (in >> request.path >> request.size)
+    trace.push_back(request);
+  return !trace.empty();
+}
+
+bool write_trace(const string &file, const vector<Request> &trace) {
+  ofstream out(file);
+  for (const Request &request : trace)
+    out << request.path << ' ' << request.size << '\n';
+  return static_cast<bool>(out);
+}
+
+/**
+ * Least recently used files are evicted until a new one fits, every file
+ * no larger than the cache is stored
+ */
+class LruCache {
+public:
+  explicit LruCache(const size_t max_size) : max_size(max_size) {}
+
+  bool get(const string &path) {
+    const auto it = this->entries.find(path);
+    if (it == this->entries.end())
+      return false;
+    this->order.splice(this->order.begin(), this->order, it->second);
+    return true;
+  }
+
+  void set(const string &path, const size_t size) {
+    if (size > this->max_size)
+      return;
+    while (this->size + size > this->max_size) {
+      this->size -= this->order.back().second;
+      this->entries.erase(this->order.back().first);
+      this->order.pop_back();
+    }
+    this->order.emplace_front(path, size);
+    this->entries[path] = this->order.begin();
+    this->size += size;
+  }
+
+private:
+  size_t max_size;
+  size_t size = 0;
+  list<pair<string, size_t>> order;
+  unordered_map<string, list<pair<string, size_t>>::iterator> entries;
+};
+
+double replay_lru(const vector<Request> &trace, const size_t cache_size) {
+  LruCache cache(cache_size);
+  size_t hits = 0;
+  for (const Request &request : trace) {
+    if (cache.get(request.path))
+      hits++;
+    else
+      cache.set(request.path, request.size);
+  }
+  return static_cast<double>(hits) / static_cast<double>(trace.size());
+}
+
+double replay_cache(const vector<Request> &trace, const size_t cache_size,
+                    const CacheStorage storage, const string &content) {
+  Cache cache(cache_size, 1, storage);
+  const CachedHeads heads;
+  for (const Request &request : trace) {
+    if (!cache.get(request.path))
+      cache.set(request.path, string_view(content).substr(0, request.size),
+                heads, cache.generation(request.path));
+  }
+  const Cache::Stats stats = cache.stats();
+  return static_cast<double>(stats.hits) /
+         static_cast<double>(stats.hits + stats.misses);
+}
+
+void print_usage(const char *program) {
+  cerr << "Usage: " << program
+       << " [--trace <file>] [--write-trace <file>] [--seed <n>]"
+          " [--sizes <MiB,...>]\n";
+}
+} // namespace
+
+int main(const int argc, char *argv[]) {
+  TraceOptions options;
+  string trace_file;
+  string output_file;
+  vector<size_t> cache_sizes = {4, 8, 16};
+  try {
+    for (int i = 1; i < argc; i++) {
+      const string option = argv[i];
+      if (option == "--trace" && i + 1 < argc) {
+        trace_file = argv[++i];
+      } else if (option == "--write-trace" && i + 1 < argc) {
+        output_file = argv[++i];
+      } else if (option == "--seed" && i + 1 < argc) {
+        options.seed = stoull(argv[++i]);
+      } else if (option == "--sizes" && i + 1 < argc) {
+        cache_sizes.clear();
+        const string list = argv[++i];
+        for (size_t start = 0; start < list.size();) {
+          const size_t end = min(list.find(',', start), list.size());
+          cache_sizes.push_back(stoul(list.substr(start, end - start)));
+          start = end + 1;
+        }
+      } else {
+        print_usage(argv[0]);
+        return 1;
+      }
+    }
+  } catch (const exception &) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  vector<Request> trace;
+  if (trace_file.empty()) {
+    trace = generate_trace(options);
+  } else if (!read_trace(trace_file, trace)) {
+    cerr << "Cannot read a trace from " << trace_file << "\n";
+    return 1;
+  }
+  if (!output_file.empty() && !write_trace(output_file, trace)) {
+    cerr << "Cannot write the trace to " << output_file << "\n";
+    return 1;
+  }
+
+  // Results keep the real stdout, the logger's console output is discarded
+  FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+  const int null = open("/dev/null", O_WRONLY);
+  if (out == nullptr || null == -1 || dup2(null, STDOUT_FILENO) == -1) {
+    cerr << "Cannot redirect stdout\n";
+    return 1;
+  }
+  close(null);
+  char directory[] = "/tmp/webserver_cache_replay.XXXXXX";
+  if (mkdtemp(directory) == nullptr || chdir(directory) == -1) {
+    cerr << "Cannot create a scratch directory\n";
+    return 1;
+  }
+
+  size_t largest = 0;
+  for (const Request &request : trace)
+    largest = max(largest, request.size);
+  const string content(largest, 'x');
+
+  const auto percent = [](const double ratio) {
+    return format("{:.1f}%", 100 * ratio);
+  };
+  string table = format("{} requests\n\n"
+                        "cache size   LRU      W-TinyLFU   W-TinyLFU (slab)\n",
+                        trace.size());
+  for (const size_t mebibytes : cache_sizes) {
+    const size_t cache_size = mebibytes * 1024 * 1024;
+    table += format(
+        "{:<13}{:<9}{:<12}{}\n", format("{} MiB", mebibytes),
+        percent(replay_lru(trace, cache_size)),
+        percent(replay_cache(trace, cache_size, CacheStorage::MMAP, content)),
+        percent(replay_cache(trace, cache_size, CacheStorage::COPY, content)));
+  }
+  fwrite(table.data(), 1, table.size(), out);
+  fclose(out);
+
+  unlink("webserver.log");
+  if (chdir("/") == 0)
+    rmdir(directory);
+  return 0;
+}
@@ -0,0 +1,592 @@
+/**
+ * HTTP/1.1 load generator for the webserver. Every thread drives its share of
+ * keep-alive connections with epoll, one request in flight per connection,
+ * either back to back (closed loop) or at a constant rate (open loop), and
+ * reports requests per second, throughput and latency percentiles.
+ *
+ * In open loop every request is timed from when it was due rather than when
+ * it could be sent, so a stalled server is charged for the requests it held
+ * up. Closed loop latencies are corrected the way HdrHistogram does it, by
+ * adding the samples a stall kept from being taken, spaced by the median
+ * latency.
+ */
+
+#include "metrics.h"
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <format>
+#include <iostream>
+#include <memory>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+namespace {
+using Clock = chrono::steady_clock;
+
+struct Scenario {
+  string name;
+  string path;
+  // Requests ask the server to bypass its cache when false
+  bool cache;
+};
+
+// Small page and multi-megabyte media, served from the cache and not
+const vector<Scenario> SCENARIOS = {
+    {"small", "/index.html", true}, {"small-nocache", "/index.html", false},
+    {"gif", "/test.gif", true},     {"gif-nocache", "/test.gif", false},
+    {"mp3", "/test.mp3", true},     {"mp3-nocache", "/test.mp3", false},
+};
+
+struct Options {
+  string host = "127.0.0.1";
+  int port = 8080;
+  size_t connections = 64;
+  unsigned threads = 1;
+  chrono::duration<double> warmup{2};
+  chrono::duration<double> duration{10};
+  // Requests per second of all connections, closed loop if 0
+  double rate = 0;
+  string scenario = "all";
+  // Custom target instead of the scenarios
+  string path;
+  bool cache = true;
+};
+
+/**
+ * Keep-alive connection with at most one request in flight
+ */
+struct Client {
+  int fd = -1;
+  // Bytes of the request already written
+  size_t sent = 0;
+  bool busy = false;
+  // Response head received so far, and the body bytes still expected
+  string head;
+  bool in_body = false;
+  size_t body_left = 0;
+  size_t response_bytes = 0;
+  int status = 0;
+  // The response came with Connection: close
+  bool closing = false;
+  // When the request in flight started, or was due in open loop
+  Clock::time_point started;
+  // When the next request is due in open loop
+  Clock::time_point due;
+};
+
+/**
+ * Counts of one thread over the measured period
+ */
+struct Results {
+  size_t requests = 0;
+  size_t bytes = 0;
+  size_t errors = 0;
+  size_t reconnects = 0;
+  unique_ptr<Histogram> latency = make_unique<Histogram>();
+};
+
+class Worker {
+public:
+  Worker(const Options &options, const Scenario &scenario,
+         const size_t connections, const Clock::time_point start)
+      : options(options), clients(connections), start(start),
+        measure_from(start + chrono::duration_cast<Clock::duration>(
+                                 options.warmup)),
+        stop_at(this->measure_from + chrono::duration_cast<Clock::duration>(
+                                         options.duration)) {
+    this->request = std::format("GET {} HTTP/1.1\r\nHost: {}:{}\r\n"
+                                "User-Agent: webserver_bench\r\n"
+                                "Accept: */*\r\n{}\r\n",
+                                scenario.path, options.host, options.port,
+                                scenario.cache ? ""
+                                               : "Cache-Control: no-cache\r\n");
+    if (options.rate > 0)
+      this->interval = chrono::duration_cast<Clock::duration>(
+          chrono::duration<double>(static_cast<double>(connections) /
+                                   options.rate));
+  }
+
+  Worker(const Worker &) = delete;
+  Worker &operator=(const Worker &) = delete;
+
+  ~Worker() {
+    for (const Client &client : this->clients)
+      if (client.fd != -1)
+        close(client.fd);
+    if (this->poll_fd != -1)
+      close(this->poll_fd);
+  }
+
+  bool run();
+
+  Results results;
+  // Error of a failed run
+  int error = 0;
+
+private:
+  const Options &options;
+  string request;
+  vector<Client> clients;
+  int poll_fd = -1;
+  Clock::time_point start;
+  Clock::time_point measure_from;
+  Clock::time_point stop_at;
+  // Time between the requests of a connection in open loop, zero in closed
+  Clock::duration interval{};
+  // Response bytes are read here and discarded
+  vector<char> buffer = vector<char>(256 * 1024);
+
+  // Longest response head accepted
+  static constexpr size_t MAX_HEAD_SIZE = 64 * 1024;
+
+  bool connect_client(Client &client);
+  void reconnect(Client &client);
+  void send_request(Client &client, Clock::time_point started);
+  void write_request(Client &client);
+  void read_response(Client &client);
+  bool consume(Client &client, string_view data);
+  void complete(Client &client);
+  Clock::time_point next_due() const;
+};
+
+/**
+ * Value of a header, name includes the CRLF before it and the colon, with
+ * the spaces around the value dropped
+ */
+optional<string_view> header_value(const string_view head,
+                                   const string_view name) {
+  for (size_t i = 0; i + name.size() <= head.size(); i++) {
+    if (strncasecmp(head.data() + i, name.data(), name.size()) != 0)
+      continue;
+    string_view value = head.substr(i + name.size());
+    value = value.substr(0, value.find("\r\n"));
+    while (!value.empty() && value.front() == ' ')
+      value.remove_prefix(1);
+    while (!value.empty() && value.back() == ' ')
+      value.remove_suffix(1);
+    return value;
+  }
+  return nullopt;
+}
+
+bool Worker::connect_client(Client &client) {
+  client.fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (client.fd == -1)
+    return false;
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(this->options.port);
+  inet_pton(AF_INET, this->options.host.c_str(), &address.sin_addr);
+  if (connect(client.fd, reinterpret_cast<sockaddr *>(&address),
+              sizeof(address)) == -1) {
+    close(client.fd);
+    client.fd = -1;
+    return false;
+  }
+  // Requests are small and go out at once
+  constexpr int enable = 1;
+  setsockopt(client.fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+  const int flags = fcntl(client.fd, F_GETFL, 0);
+  fcntl(client.fd, F_SETFL, flags | O_NONBLOCK);
+
+  epoll_event event{};
+  event.events = EPOLLIN;
+  event.data.ptr = &client;
+  return epoll_ctl(this->poll_fd, EPOLL_CTL_ADD, client.fd, &event) == 0;
+}
+
+void Worker::reconnect(Client &client) {
+  if (client.fd != -1) {
+    epoll_ctl(this->poll_fd, EPOLL_CTL_DEL, client.fd, nullptr);
+    close(client.fd);
+    client.fd = -1;
+  }
+  client.busy = false;
+  this->results.reconnects++;
+  if (!connect_client(client))
+    this->results.errors++;
+}
+
+void Worker::send_request(Client &client, const Clock::time_point started) {
+  client.busy = true;
+  client.sent = 0;
+  client.head.clear();
+  client.in_body = false;
+  client.response_bytes = 0;
+  client.closing = false;
+  client.started = started;
+  write_request(client);
+}
+
+void Worker::write_request(Client &client) {
+  while (client.sent < this->request.size()) {
+    const ssize_t written =
+        send(client.fd, this->request.data() + client.sent,
+             this->request.size() - client.sent, MSG_NOSIGNAL);
+    if (written == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // Finished once the socket is writable again
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLOUT;
+        event.data.ptr = &client;
+        epoll_ctl(this->poll_fd, EPOLL_CTL_MOD, client.fd, &event);
+        return;
+      }
+      this->results.errors++;
+      reconnect(client);
+      return;
+    }
+    client.sent += written;
+  }
+}
+
+void Worker::read_response(Client &client) {
+  while (true) {
+    const ssize_t received =
+        recv(client.fd, this->buffer.data(), this->buffer.size(), 0);
+    if (received == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        this->results.errors++;
+        reconnect(client);
+      }
+      return;
+    }
+    if (received == 0 ||
+        !consume(client, {this->buffer.data(), static_cast<size_t>(received)})) {
+      // Closed by the server or a response that can't be framed
+      if (client.busy)
+        this->results.errors++;
+      reconnect(client);
+      return;
+    }
+    if (static_cast<size_t>(received) < this->buffer.size())
+      return;
+  }
+}
+
+bool Worker::consume(Client &client, string_view data) {
+  // Only one request is in flight, nothing may follow its response
+  if (!client.busy)
+    return false;
+  if (!client.in_body) {
+    const size_t searched =
+        client.head.size() >= 3 ? client.head.size() - 3 : 0;
+    client.head += data;
+    const size_t end = client.head.find("\r\n\r\n", searched);
+    if (end == string::npos)
+      return client.head.size() < MAX_HEAD_SIZE;
+    const size_t head_size = end + 4;
+    data.remove_prefix(data.size() - (client.head.size() - head_size));
+    client.head.resize(head_size);
+
+    // "HTTP/1.1 200 OK", every response has a Content-Length
+    const string_view head = client.head;
+    if (head.size() < 12 ||
+        from_chars(head.data() + 9, head.data() + 12, client.status).ec !=
+            errc())
+      return false;
+    const optional<string_view> length =
+        header_value(head, "\r\ncontent-length:");
+    if (!length)
+      return false;
+    client.body_left = 0;
+    from_chars(length->data(), length->data() + length->size(),
+               client.body_left);
+    const optional<string_view> connection =
+        header_value(head, "\r\nconnection:");
+    client.closing = connection && connection->size() == 5 &&
+                     strncasecmp(connection->data(), "close", 5) == 0;
+    client.response_bytes = head_size;
+    client.in_body = true;
+  }
+
+  const size_t body = min(data.size(), client.body_left);
+  client.body_left -= body;
+  client.response_bytes += body;
+  if (data.size() > body)
+    return false;
+  if (client.body_left == 0)
+    complete(client);
+  return true;
+}
+
+void Worker::complete(Client &client) {
+  if (!client.busy)
+    return;
+  client.busy = false;
+  const Clock::time_point now = Clock::now();
+  if (now >= this->measure_from && now < this->stop_at) {
+    this->results.requests++;
+    this->results.bytes += client.response_bytes;
+    if (client.status < 200 || client.status >= 400)
+      this->results.errors++;
+    this->results.latency->record(
+        chrono::duration_cast<chrono::nanoseconds>(now - client.started)
+            .count());
+  }
+  if (now >= this->stop_at)
+    return;
+  // The server closes the connection after this response: the next request
+  // goes on a new one, which is not an error
+  if (client.closing) {
+    reconnect(client);
+    if (client.fd == -1)
+      return;
+  }
+  if (this->interval == Clock::duration()) {
+    send_request(client, now);
+  } else if (now >= client.due) {
+    // Behind schedule, the next request was due already
+    send_request(client, client.due);
+    client.due += this->interval;
+  }
+}
+
+Clock::time_point Worker::next_due() const {
+  Clock::time_point next = this->stop_at;
+  for (const Client &client : this->clients)
+    if (!client.busy && client.fd != -1)
+      next = min(next, client.due);
+  return next;
+}
+
+bool Worker::run() {
+  this->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (this->poll_fd == -1) {
+    this->error = errno;
+    return false;
+  }
+  for (size_t i = 0; i < this->clients.size(); i++) {
+    Client &client = this->clients[i];
+    if (!connect_client(client)) {
+      this->error = errno;
+      return false;
+    }
+    // Open loop connections are staggered over one interval
+    client.due = this->start + this->interval * i / this->clients.size();
+    if (this->interval == Clock::duration())
+      send_request(client, Clock::now());
+  }
+
+  epoll_event events[256];
+  while (true) {
+    const Clock::time_point now = Clock::now();
+    if (now >= this->stop_at)
+      break;
+    if (this->interval != Clock::duration()) {
+      for (Client &client : this->clients) {
+        if (!client.busy && client.fd != -1 && now >= client.due) {
+          send_request(client, client.due);
+          client.due += this->interval;
+        }
+      }
+    }
+    const auto wait = chrono::ceil<chrono::milliseconds>(
+        (this->interval == Clock::duration() ? this->stop_at : next_due()) -
+        now);
+    const int count =
+        epoll_wait(this->poll_fd, events, 256,
+                   static_cast<int>(max<int64_t>(wait.count(), 0)));
+    for (int i = 0; i < count; i++) {
+      Client &client = *static_cast<Client *>(events[i].data.ptr);
+      if (events[i].events & EPOLLOUT) {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.ptr = &client;
+        epoll_ctl(this->poll_fd, EPOLL_CTL_MOD, client.fd, &event);
+        write_request(client);
+      }
+      if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        read_response(client);
+    }
+    // Closed loop connections lost to an error start over
+    if (this->interval == Clock::duration()) {
+      for (Client &client : this->clients)
+        if (!client.busy && client.fd != -1 && Clock::now() < this->stop_at)
+          send_request(client, Clock::now());
+    }
+  }
+  return true;
+}
+
+// Latencies with the samples a stall held up added back, spaced by interval
+Histogram::Snapshot corrected(const Histogram::Snapshot &snapshot,
+                              const uint64_t interval) {
+  Histogram::Snapshot result = snapshot;
+  if (interval == 0)
+    return result;
+  for (size_t i = 0; i < Histogram::BUCKETS; i++) {
+    if (snapshot.counts[i] == 0)
+      continue;
+    // Values from interval up to the measured one, in steps of interval
+    for (uint64_t missing = Histogram::value_of(i); missing >= 2 * interval;) {
+      missing -= interval;
+      result.counts[Histogram::bucket_of(missing)] += snapshot.counts[i];
+      result.count += snapshot.counts[i];
+      result.sum += missing * snapshot.counts[i];
+    }
+  }
+  return result;
+}
+
+string format_latency(const uint64_t nanoseconds) {
+  if (nanoseconds >= 1000000)
+    return std::format("{:.2f}ms", static_cast<double>(nanoseconds) / 1e6);
+  return std::format("{:.1f}us", static_cast<double>(nanoseconds) / 1e3);
+}
+
+string latency_line(const string_view label,
+                    const Histogram::Snapshot &snapshot) {
+  return std::format("  {:<10} p50 {:>10} p99 {:>10} p999 {:>10} max {:>10}\n",
+                     label, format_latency(snapshot.quantile(0.5)),
+                     format_latency(snapshot.quantile(0.99)),
+                     format_latency(snapshot.quantile(0.999)),
+                     format_latency(snapshot.quantile(1)));
+}
+
+bool run_scenario(const Options &options, const Scenario &scenario) {
+  const Clock::time_point start = Clock::now();
+  vector<unique_ptr<Worker>> workers;
+  for (unsigned i = 0; i < options.threads; i++) {
+    // Connections spread evenly, the first threads take the remainder
+    const size_t connections = options.connections / options.threads +
+                               (i < options.connections % options.threads);
+    if (connections > 0)
+      workers.push_back(
+          make_unique<Worker>(options, scenario, connections, start));
+  }
+  vector<char> succeeded(workers.size());
+  {
+    vector<jthread> threads;
+    for (size_t i = 0; i < workers.size(); i++)
+      threads.emplace_back([&, i] { succeeded[i] = workers[i]->run(); });
+  }
+
+  Results total;
+  auto latency = make_unique<Histogram::Snapshot>();
+  for (size_t i = 0; i < workers.size(); i++) {
+    if (!succeeded[i]) {
+      cerr << std::format("{}: cannot connect to {}:{}: {}\n", scenario.name,
+                          options.host, options.port,
+                          strerror(workers[i]->error));
+      return false;
+    }
+    const Results &results = workers[i]->results;
+    total.requests += results.requests;
+    total.bytes += results.bytes;
+    total.errors += results.errors;
+    total.reconnects += results.reconnects;
+    results.latency->add_to(*latency);
+  }
+
+  const double seconds = options.duration.count();
+  cout << std::format(
+      "{} ({}{}, {} connections, {})\n", scenario.name, scenario.path,
+      scenario.cache ? "" : ", no-cache", options.connections,
+      options.rate > 0 ? std::format("open loop at {} req/s", options.rate)
+                       : string("closed loop"));
+  cout << std::format("  {:.0f} req/s, {:.2f} MiB/s, {} requests, {} errors, "
+                      "{} reconnects\n",
+                      static_cast<double>(total.requests) / seconds,
+                      static_cast<double>(total.bytes) / seconds / 1048576,
+                      total.requests, total.errors, total.reconnects);
+  if (options.rate > 0) {
+    // Timed from when each request was due, corrected already
+    cout << latency_line("latency", *latency);
+  } else {
+    cout << latency_line("measured", *latency);
+    cout << latency_line("corrected",
+                         corrected(*latency, latency->quantile(0.5)));
+  }
+  return true;
+}
+
+void print_usage(const string_view program) {
+  cerr << std::format(
+      "Usage: {} [--host <ipv4>] [--port <port>] [--connections <n>]"
+      " [--threads <n>] [--duration <s>] [--warmup <s>] [--rate <req/s>]"
+      " [--scenario <all|small|small-nocache|gif|gif-nocache|mp3|"
+      "mp3-nocache>] [--path <path>] [--no-cache]\n",
+      program);
+}
+} // namespace
+
+int main(const int argc, char *argv[]) {
+  Options options;
+  try {
+    for (int i = 1; i < argc; i++) {
+      const string option = argv[i];
+      if (option == "--host" && i + 1 < argc) {
+        options.host = argv[++i];
+      } else if (option == "--port" && i + 1 < argc) {
+        options.port = stoi(argv[++i]);
+      } else if (option == "--connections" && i + 1 < argc) {
+        options.connections = max(1ul, stoul(argv[++i]));
+      } else if (option == "--threads" && i + 1 < argc) {
+        options.threads = max(1, stoi(argv[++i]));
+      } else if (option == "--duration" && i + 1 < argc) {
+        options.duration = chrono::duration<double>(stod(argv[++i]));
+      } else if (option == "--warmup" && i + 1 < argc) {
+        options.warmup = chrono::duration<double>(stod(argv[++i]));
+      } else if (option == "--rate" && i + 1 < argc) {
+        options.rate = stod(argv[++i]);
+      } else if (option == "--scenario" && i + 1 < argc) {
+        options.scenario = argv[++i];
+      } else if (option == "--path" && i + 1 < argc) {
+        options.path = argv[++i];
+      } else if (option == "--no-cache") {
+        options.cache = false;
+      } else {
+        print_usage(argv[0]);
+        return 1;
+      }
+    }
+  } catch (const exception &) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  in_addr address{};
+  if (inet_pton(AF_INET, options.host.c_str(), &address) != 1 ||
+      options.duration.count() <= 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  vector<Scenario> scenarios;
+  if (!options.path.empty()) {
+    scenarios.push_back({"custom", options.path, options.cache});
+  } else {
+    for (const Scenario &scenario : SCENARIOS)
+      if (options.scenario == "all" || options.scenario == scenario.name)
+        scenarios.push_back(scenario);
+  }
+  if (scenarios.empty()) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  for (const Scenario &scenario : scenarios)
+    if (!run_scenario(options, scenario))
+      return 1;
+  return 0;
+}
@@ -0,0 +1,469 @@
+/**
+ * Microbenchmarks of the server's hot paths: request parsing, building and
+ * queueing responses, cache lookups and insertions, and logging. Every
+ * benchmark reports the time, heap allocations and bytes allocated per
+ * operation, and the bytes it copied, as JSON on stdout so results can be
+ * compared between builds.
+ *
+ * The logger writes to webserver.log in the working directory and to the
+ * console, so the benchmarks run in a scratch directory with the console
+ * pointed at /dev/null; only the results reach the original stdout.
+ */
+
+#include "cache.h"
+#include "connection.h"
+#include "logger.h"
+#include "request_parser.h"
+#include "response.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <format>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+namespace {
+// Heap use of the benchmarking thread, other threads are not counted
+thread_local size_t allocations = 0;
+thread_local size_t allocated_bytes = 0;
+
+void *allocate(const size_t size) {
+  allocations++;
+  allocated_bytes += size;
+  if (void *pointer = malloc(size == 0 ? 1 : size))
+    return pointer;
+  throw bad_alloc();
+}
+
+void *allocate_aligned(const size_t size, const align_val_t alignment) {
+  allocations++;
+  allocated_bytes += size;
+  const auto align = static_cast<size_t>(alignment);
+  // aligned_alloc wants a multiple of the alignment
+  if (void *pointer = aligned_alloc(align, (size + align - 1) / align * align))
+    return pointer;
+  throw bad_alloc();
+}
+} // namespace
+
+void *operator new(const size_t size) { return allocate(size); }
+void *operator new[](const size_t size) { return allocate(size); }
+void *operator new(const size_t size, const align_val_t alignment) {
+  return allocate_aligned(size, alignment);
+}
+void *operator new[](const size_t size, const align_val_t alignment) {
+  return allocate_aligned(size, alignment);
+}
+void operator delete(void *pointer) noexcept { free(pointer); }
+void operator delete[](void *pointer) noexcept { free(pointer); }
+void operator delete(void *pointer, size_t) noexcept { free(pointer); }
+void operator delete[](void *pointer, size_t) noexcept { free(pointer); }
+void operator delete(void *pointer, align_val_t) noexcept { free(pointer); }
+void operator delete[](void *pointer, align_val_t) noexcept { free(pointer); }
+void operator delete(void *pointer, size_t, align_val_t) noexcept {
+  free(pointer);
+}
+void operator delete[](void *pointer, size_t, align_val_t) noexcept {
+  free(pointer);
+}
+
+namespace {
+using Clock = chrono::steady_clock;
+
+struct Result {
+  string name;
+  size_t iterations = 0;
+  double ns_per_op = 0;
+  double allocations_per_op = 0;
+  double bytes_allocated_per_op = 0;
+  double bytes_copied_per_op = 0;
+  optional<double> dropped_per_op;
+};
+
+/**
+ * Operation under test, given its iteration number and returning the bytes
+ * it copied
+ */
+using Operation = function<size_t(size_t)>;
+
+/**
+ * Totals kept by the code under test, read before and after the timed run
+ */
+struct Counters {
+  /**
+   * Bytes copied, counted instead of what the operation returns when only
+   * the code under test knows
+   */
+  function<size_t()> copied = nullptr;
+  /**
+   * Operations given up instead of done, such as log records finding their
+   * ring full
+   */
+  function<size_t()> dropped = nullptr;
+};
+
+class Runner {
+public:
+  Runner(string filter, const chrono::duration<double> min_time)
+      : filter(std::move(filter)), min_time(min_time) {}
+
+  bool selected(const string_view name) const {
+    return name.find(this->filter) != string_view::npos;
+  }
+
+  /**
+   * Time an operation, first in growing batches to estimate its cost, then
+   * once over about min_time
+   */
+  void run(const string &name, const Operation &operation,
+           const Counters &counters = {}) {
+    if (!selected(name))
+      return;
+    size_t iterations = 1;
+    while (true) {
+      const auto elapsed = time(operation, iterations).first;
+      if (elapsed >= this->min_time / 20 || iterations >= 1ul << 30) {
+        iterations = max<size_t>(
+            1, static_cast<size_t>(static_cast<double>(iterations) *
+                                   (this->min_time / elapsed)));
+        break;
+      }
+      iterations *= 2;
+    }
+
+    const size_t copied_before = counters.copied ? counters.copied() : 0;
+    const size_t dropped_before = counters.dropped ? counters.dropped() : 0;
+    allocations = 0;
+    allocated_bytes = 0;
+    auto [elapsed, copied] = time(operation, iterations);
+    const auto count = static_cast<double>(iterations);
+    if (counters.copied)
+      copied += counters.copied() - copied_before;
+    Result &result = this->results.emplace_back(
+        name, iterations,
+        chrono::duration<double, nano>(elapsed).count() / count,
+        static_cast<double>(allocations) / count,
+        static_cast<double>(allocated_bytes) / count,
+        static_cast<double>(copied) / count);
+    if (counters.dropped)
+      result.dropped_per_op =
+          static_cast<double>(counters.dropped() - dropped_before) / count;
+  }
+
+  void write_json(FILE *out) const {
+    string json = std::format(
+        "{{\n  \"context\": {{\"compiler\": \"{}\", \"min_time_s\": {}}},\n"
+        "  \"benchmarks\": [",
+        __VERSION__, this->min_time.count());
+    for (size_t i = 0; i < this->results.size(); i++) {
+      const Result &result = this->results[i];
+      json += std::format(
+          "{}\n    {{\"name\": \"{}\", \"iterations\": {}, "
+          "\"ns_per_op\": {:.2f}, \"allocations_per_op\": {:.3f}, "
+          "\"bytes_allocated_per_op\": {:.1f}, "
+          "\"bytes_copied_per_op\": {:.1f}",
+          i == 0 ? "" : ",", result.name, result.iterations, result.ns_per_op,
+          result.allocations_per_op, result.bytes_allocated_per_op,
+          result.bytes_copied_per_op);
+      if (result.dropped_per_op)
+        json += std::format(", \"dropped_per_op\": {:.3f}",
+                            *result.dropped_per_op);
+      json += "}";
+    }
+    json += "\n  ]\n}\n";
+    fwrite(json.data(), 1, json.size(), out);
+  }
+
+private:
+  string filter;
+  chrono::duration<double> min_time;
+  vector<Result> results;
+
+  static pair<chrono::duration<double>, size_t>
+  time(const Operation &operation, const size_t iterations) {
+    size_t copied = 0;
+    const auto start = Clock::now();
+    for (size_t i = 0; i < iterations; i++)
+      copied += operation(i);
+    return {Clock::now() - start, copied};
+  }
+};
+
+// What a desktop browser sends for a page
+constexpr string_view BROWSER_REQUEST =
+    "GET /index.html?utm_source=newsletter HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", "
+    "\"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"macOS\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) "
+    "AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 "
+    "Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9,ko;q=0.8\r\n"
+    "Cookie: session=3f9a2c7e8b1d4f60a5e2; theme=dark\r\n"
+    "If-None-Match: \"1b2c3-db-65f0a1b2\"\r\n"
+    "\r\n";
+
+// Requests parsed per operation: one per read, or several read at once
+void bench_request_parse(Runner &runner, const string &name,
+                         const size_t pipelined) {
+  string buffer;
+  for (size_t i = 0; i < pipelined; i++)
+    buffer += BROWSER_REQUEST;
+  RequestParser parser{RequestParser::Limits()};
+  runner.run(name, [&](size_t) {
+    if (parser.parse(buffer) != RequestParser::Result::COMPLETE)
+      abort();
+    const Request request = parser.request(buffer);
+    // What handle_request looks at
+    if (!request.keep_alive() ||
+        request.header_has_token(http::HTTPHeaders::CACHE_CONTROL,
+                                 "no-cache"))
+      abort();
+    parser.next();
+    // Start over as if the buffer was consumed and the same bytes arrived
+    if (parser.request_start() == buffer.size())
+      parser.discard(buffer.size());
+    return size_t{0};
+  });
+}
+
+// Bytes built for the response rather than referenced
+size_t owned_bytes(const Connection &connection) {
+  size_t bytes = 0;
+  for (const OutputSegment &segment : connection.output)
+    if (!segment.owner && !segment.file)
+      bytes += segment.data.size();
+  return bytes;
+}
+
+void bench_response(Runner &runner) {
+  Connection connection(-1, sockaddr_in{}, RequestParser::Limits());
+  const auto queue = [&connection](Response &response) {
+    response.serialize();
+    connection.queue_response(response);
+    const size_t copied = owned_bytes(connection);
+    connection.output.clear();
+    connection.queued_responses = 0;
+    return copied;
+  };
+
+  runner.run("response_serialize/error", [&](size_t) {
+    Response response("File not found", http::StatusCode::NOT_FOUND,
+                      {{http::HTTPHeaders::CONTENT_TYPE, "text/html"}}, true);
+    return queue(response);
+  });
+
+  // Head of a file streamed without the cache
+  const map<string, string> headers = {
+      {http::HTTPHeaders::CONTENT_TYPE, "text/html"},
+      {http::HTTPHeaders::ACCEPT_RANGES, "bytes"},
+      {http::HTTPHeaders::ETAG, "\"1b2c3-db-65f0a1b2\""},
+      {http::HTTPHeaders::LAST_MODIFIED, "Sat, 18 Oct 2025 07:14:02 GMT"}};
+  runner.run("response_serialize/file", [&](size_t) {
+    Response response("", http::StatusCode::OK, headers, true);
+    return queue(response);
+  });
+
+  // Cached head and body, referenced by the response
+  Cache cache(1024 * 1024);
+  const string body(219, 'x');
+  CachedHeads cached_heads;
+  cached_heads.ok =
+      Response(http::StatusCode::OK, headers).serialize_head(body.size());
+  const CacheHandle cached = cache.set("/index.html", body, cached_heads,
+                                       cache.generation("/index.html"));
+  if (!cached)
+    abort();
+  runner.run("response_serialize/cached", [&](size_t) {
+    Response response("", http::StatusCode::OK, {}, true);
+    response.set_head(cached->heads.ok, cached);
+    response.set_body(cached->data, cached);
+    return queue(response);
+  });
+}
+
+struct SizeDistribution {
+  string name;
+  function<size_t(mt19937_64 &)> next;
+};
+
+const vector<SizeDistribution> SIZE_DISTRIBUTIONS = {
+    // Pages, scripts and icons
+    {"small",
+     [](mt19937_64 &random) {
+       return uniform_int_distribution<size_t>(512, 16 * 1024)(random);
+     }},
+    // Many small files, a few large ones: uniform over the powers of two
+    {"mixed",
+     [](mt19937_64 &random) {
+       return static_cast<size_t>(
+           exp2(uniform_real_distribution<double>(8, 20)(random)));
+     }},
+    // Images and media
+    {"large",
+     [](mt19937_64 &random) {
+       return uniform_int_distribution<size_t>(256 * 1024, 2 * 1024 * 1024)(
+           random);
+     }},
+};
+
+void bench_cache(Runner &runner) {
+  constexpr size_t CACHE_SIZE = 64 * 1024 * 1024;
+  // Keys and sizes are prepared so the loop only measures the cache
+  constexpr size_t KEYS = 1 << 16;
+  vector<string> keys;
+  keys.reserve(KEYS);
+  for (size_t i = 0; i < KEYS; i++)
+    keys.push_back(std::format("/assets/file-{}.html", i));
+  const string content(2 * 1024 * 1024, 'x');
+  CachedHeads heads;
+  heads.ok = Response(http::StatusCode::OK,
+                      {{http::HTTPHeaders::CONTENT_TYPE, "text/html"}})
+                 .serialize_head(0);
+  // Nothing is invalidated, every path stays at its first generation
+  constexpr uint64_t GENERATION = 0;
+
+  for (const SizeDistribution &distribution : SIZE_DISTRIBUTIONS) {
+    mt19937_64 random(42);
+    vector<size_t> sizes(KEYS);
+    for (size_t &size : sizes)
+      size = distribution.next(random);
+
+    // Lookups of files that all fit
+    if (runner.selected("cache_get_hit/" + distribution.name)) {
+      Cache cache(CACHE_SIZE);
+      size_t stored = 0;
+      size_t used = 0;
+      while (stored < KEYS && used + sizes[stored] < CACHE_SIZE / 2) {
+        if (!cache.set(keys[stored],
+                       string_view(content).substr(0, sizes[stored]), heads,
+                       GENERATION))
+          abort();
+        used += sizes[stored++];
+      }
+      vector<uint32_t> order(KEYS);
+      for (uint32_t &index : order)
+        index = uniform_int_distribution<uint32_t>(0, stored - 1)(random);
+      runner.run("cache_get_hit/" + distribution.name, [&](const size_t i) {
+        if (!cache.get(keys[order[i % KEYS]]))
+          abort();
+        return size_t{0};
+      });
+    }
+
+    // New files into a full cache, each evicting older ones
+    if (runner.selected("cache_set_evict/" + distribution.name)) {
+      Cache cache(CACHE_SIZE);
+      for (size_t i = 0, used = 0; i < KEYS && used < 2 * CACHE_SIZE; i++) {
+        cache.set(keys[i], string_view(content).substr(0, sizes[i]), heads,
+                  GENERATION);
+        used += sizes[i];
+      }
+      // Keys still cached return their entry, only the files the cache
+      // stores count as copied, besides the heads copied every time
+      runner.run(
+          "cache_set_evict/" + distribution.name,
+          [&](const size_t i) {
+            const size_t size = sizes[i % KEYS];
+            cache.set(keys[i % KEYS], string_view(content).substr(0, size),
+                      heads, GENERATION);
+            return heads.ok.size();
+          },
+          {.copied = [&cache] { return cache.stats().bytes_copied; }});
+    }
+  }
+
+  Cache cache(CACHE_SIZE);
+  runner.run("cache_get_miss", [&](const size_t i) {
+    if (cache.get(keys[i % KEYS]))
+      abort();
+    return size_t{0};
+  });
+}
+
+void bench_logger(Runner &runner) {
+  // As handle_request logs every request
+  const string path = "/index.html";
+  // Logging faster than the flush thread writes fills the ring, the records
+  // dropped are reported beside the time
+  runner.run(
+      "logger_log/request",
+      [&](size_t) {
+        const string message = "Received request: " + path;
+        Logger::LOG_INFO(message);
+        return message.size();
+      },
+      {.dropped = [] { return Logger::stats().dropped; }});
+}
+} // namespace
+
+int main(const int argc, char *argv[]) {
+  string filter;
+  chrono::duration<double> min_time(0.5);
+  for (int i = 1; i < argc; i++) {
+    const string option = argv[i];
+    if (option == "--filter" && i + 1 < argc) {
+      filter = argv[++i];
+    } else if (option == "--min-time" && i + 1 < argc) {
+      min_time = chrono::duration<double>(atof(argv[++i]));
+    } else {
+      cerr << "Usage: " << argv[0]
+           << " [--filter <substring>] [--min-time <seconds>]\n";
+      return 1;
+    }
+  }
+  if (min_time.count() <= 0)
+    min_time = chrono::duration<double>(0.5);
+
+  // Results keep the real stdout, the logger's console output is discarded
+  FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+  const int null = open("/dev/null", O_WRONLY);
+  if (out == nullptr || null == -1 || dup2(null, STDOUT_FILENO) == -1) {
+    cerr << "Cannot redirect stdout\n";
+    return 1;
+  }
+  close(null);
+  char directory[] = "/tmp/webserver_microbench.XXXXXX";
+  if (mkdtemp(directory) == nullptr || chdir(directory) == -1) {
+    cerr << "Cannot create a scratch directory\n";
+    return 1;
+  }
+
+  Runner runner(filter, min_time);
+  bench_request_parse(runner, "request_parse/browser", 1);
+  bench_request_parse(runner, "request_parse/pipelined_16", 16);
+  bench_response(runner);
+  bench_cache(runner);
+  bench_logger(runner);
+  runner.write_json(out);
+  fclose(out);
+
+  unlink("webserver.log");
+  if (chdir("/") == 0)
+    rmdir(directory);
+  return 0;
+}
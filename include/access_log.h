@@ -0,0 +1,158 @@
+#ifndef WEBSERVER_ACCESS_LOG_H
+#define WEBSERVER_ACCESS_LOG_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "http_constants.h"
+#include "log_ring.h"
+
+using namespace std;
+
+/**
+ * One request as it goes to the access log, filled in while the request is
+ * parsed, handled and its response sent
+ */
+struct AccessRecord {
+  using Clock = chrono::steady_clock;
+
+  /**
+   * Wall clock second the request was handled
+   */
+  time_t time = 0;
+  in_addr address{};
+  /**
+   * Unknown if the request could not be parsed
+   */
+  optional<http::Method> method;
+  string target;
+  string version;
+  string referer;
+  string user_agent;
+  http::StatusCode status = http::StatusCode::OK;
+  /**
+   * Body bytes of the response
+   */
+  size_t bytes = 0;
+  /**
+   * First bytes of the request received
+   */
+  Clock::time_point started;
+  /**
+   * Request completely parsed
+   */
+  Clock::time_point parsed;
+  /**
+   * Time spent looking the content up in the cache
+   */
+  Clock::duration cache_lookup{};
+  /**
+   * First and last bytes of the response handed to the kernel
+   */
+  Clock::time_point first_byte;
+  Clock::time_point last_byte;
+};
+
+/**
+ * Structured log of every request, in Combined Log Format or as JSON lines,
+ * with the time spent parsing, looking up the cache, and until the first
+ * and the last byte of the response were sent. Workers append records to
+ * their own lock-free ring; a background thread formats them, appends them
+ * to the file in batches and rotates it by size, so the event loops never
+ * wait for the disk.
+ */
+class AccessLog {
+public:
+  enum class Format { COMBINED, JSON };
+
+  /**
+   * Appends the records of one thread
+   */
+  class Writer {
+  public:
+    explicit Writer(LogRing *ring) : ring(ring) {}
+    ~Writer();
+    Writer(const Writer &) = delete;
+    Writer &operator=(const Writer &) = delete;
+
+    /**
+     * Queue a record, dropped if the ring is full
+     */
+    void write(const AccessRecord &record);
+
+  private:
+    LogRing *ring;
+    // Serialized record, reused
+    string scratch;
+  };
+
+  /**
+   * @param path Log file, rotated to path.1 ... path.max_files
+   * @param format Line format
+   * @param max_size File size that triggers a rotation
+   * @param max_files Rotated files kept
+   */
+  AccessLog(string path, Format format, size_t max_size, size_t max_files = 5);
+  ~AccessLog();
+  AccessLog(const AccessLog &) = delete;
+  AccessLog &operator=(const AccessLog &) = delete;
+
+  /**
+   * Writer for the calling thread, which must be its only user
+   */
+  unique_ptr<Writer> writer();
+
+  /**
+   * Records dropped on a full ring so far
+   */
+  size_t dropped() const;
+
+private:
+  string path;
+  Format format;
+  size_t max_size;
+  size_t max_files;
+  int file = -1;
+  size_t file_size = 0;
+  // Guards rings
+  mutable mutex lock;
+  // Rings of the writers, freed once their writer is gone and they are empty
+  vector<unique_ptr<LogRing>> rings;
+  // Rings being drained, copied from the list so the lock isn't held while
+  // formatting and writing. Only the flush thread frees rings
+  vector<LogRing *> draining;
+  // Records dropped by rings already freed
+  atomic<size_t> retired_dropped{0};
+  atomic<bool> stopping{false};
+  thread flusher;
+  // Formatted records waiting to be appended
+  string batch;
+  // Timestamp of the current second, formatted once
+  time_t timestamp_time = -1;
+  string timestamp;
+
+  // Bytes of records a worker can have waiting
+  static constexpr size_t RING_CAPACITY = 1024 * 1024;
+  // Pause of the flush thread once the rings are empty
+  static constexpr auto FLUSH_INTERVAL = chrono::milliseconds(50);
+  // Batch size that is appended without waiting for the rings to empty
+  static constexpr size_t BATCH_SIZE = 64 * 1024;
+
+  void flush_loop();
+  bool drain();
+  void append(string_view serialized);
+  void flush_batch();
+  void open_file();
+  void rotate();
+};
+
+#endif // WEBSERVER_ACCESS_LOG_H
@@ -0,0 +1,41 @@
+#ifndef WEBSERVER_BYTE_RANGE_H
+#define WEBSERVER_BYTE_RANGE_H
+
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+namespace http {
+
+// Inclusive range of bytes of a representation
+struct ByteRange {
+  size_t first;
+  size_t last;
+
+  size_t length() const { return this->last - this->first + 1; }
+};
+
+// Outcome of parsing a Range header against a representation
+enum class RangeResult {
+  // No usable byte ranges, the whole representation is sent
+  IGNORED,
+  // Ranges to send in a 206 response
+  SATISFIABLE,
+  // Valid ranges that all start past the end, answered with 416
+  UNSATISFIABLE
+};
+
+// Ranges kept at most after coalescing, more are answered in full
+inline constexpr size_t MAX_BYTE_RANGES = 16;
+
+/**
+ * Parse a Range header such as "bytes=0-499, -500" for a representation of
+ * size bytes. Satisfiable ranges are clamped to the size, sorted and
+ * overlapping or adjacent ones coalesced
+ */
+RangeResult parse_ranges(std::string_view header, size_t size,
+                         std::vector<ByteRange> &ranges);
+
+} // namespace http
+
+#endif // WEBSERVER_BYTE_RANGE_H
@@ -5,36 +5,196 @@
 #ifndef CACHE_H
 #define CACHE_H
 #include <file.h>
+#include <memory>
+#include <mutex>
+#include <span>
 #include <string>
+#include <string_view>
 #include <unordered_map>
-#include <list>
+#include <vector>
+
+#include "frequency_sketch.h"
+#include "slab_allocator.h"
 
 using namespace std;
 
 /**
- * Cache class to store file data in memory with LRU eviction policy
+ * Serialized heads of the responses serving a cached file, see
+ * Response::serialize_head, and the validators choosing between them
+ */
+struct CachedHeads {
+  /**
+   * Status line and content headers of the 200 response
+   */
+  string ok;
+  /**
+   * 304 response to a conditional request the copy satisfies
+   */
+  string not_modified;
+  /**
+   * Validators of the content, the entity tag of its coding
+   */
+  string etag;
+  string last_modified;
+  time_t modified = 0;
+};
+
+/**
+ * A cached file and the response heads serving it
+ */
+struct CachedFile {
+  explicit CachedFile(shared_ptr<SlabAllocator> storage)
+      : storage(std::move(storage)) {}
+  /**
+   * Return the blocks to the storage, or unmap the file
+   */
+  ~CachedFile();
+  CachedFile(const CachedFile &) = delete;
+  CachedFile &operator=(const CachedFile &) = delete;
+
+  /**
+   * Content of the file, in storage blocks of at most a segment each, or the
+   * whole mapping
+   */
+  vector<string_view> data;
+  /**
+   * Size of the file
+   */
+  size_t size = 0;
+  CachedHeads heads;
+  /**
+   * Storage of the blocks, outlives the cache while responses hold entries.
+   * Null for a mapped file
+   */
+  shared_ptr<SlabAllocator> storage;
+  /**
+   * Read-only mapping of the file, served from the page cache
+   */
+  void *mapping = nullptr;
+  /**
+   * Bytes of a generated variant when files are mapped
+   */
+  string owned;
+  /**
+   * Identity copy of content also sent compressed, it only serves clients
+   * accepting none of the codings
+   */
+  bool encodable = false;
+};
+
+/**
+ * Where cached files are kept
+ */
+enum class CacheStorage {
+  /**
+   * Copied into the cache's own memory
+   */
+  COPY,
+  /**
+   * Mapped from the page cache, the cache size bounding the address space
+   */
+  MMAP
+};
+
+/**
+ * Pin on a cached file. Evicting the file only unlinks it from the cache,
+ * its blocks are reclaimed once the last pin is dropped
+ */
+using CacheHandle = shared_ptr<const CachedFile>;
+
+/**
+ * Cache class to store file data in memory, shared by the worker threads.
+ * Paths are spread over shards by hash, each with its own lock and a
+ * W-TinyLFU policy: new files enter a small LRU window, files leaving it are
+ * only admitted to the main LRU space if they were requested more often
+ * than the files they would evict, as estimated by a frequency sketch. One
+ * pass over many cold files thus only cycles through the window instead of
+ * flushing hot files. Files are stored in slab allocated blocks, never moved
+ * or compacted
  */
 class Cache {
 public:
+  struct Stats {
+    /**
+     * Cached files
+     */
+    size_t entries = 0;
+    /**
+     * Bytes of the cached files
+     */
+    size_t size = 0;
+    /**
+     * Lookups finding the file, and not
+     */
+    size_t hits = 0;
+    size_t misses = 0;
+    /**
+     * Entries evicted to make room so far
+     */
+    size_t evictions = 0;
+    /**
+     * Files refused by the admission policy
+     */
+    size_t rejections = 0;
+    /**
+     * Bytes copied into the cache, mapped files aside. Entries are never
+     * moved once stored
+     */
+    size_t bytes_copied = 0;
+    /**
+     * Memory use of the storage, including evicted entries still pinned
+     */
+    SlabAllocator::Stats storage;
+  };
+
+  /**
+   * Shards hold at least this many bytes, fewer shards are made for a small
+   * cache so it still takes files of a few megabytes
+   */
+  static constexpr size_t MIN_SHARD_SIZE = 4 * 1024 * 1024;
+
   /**
    * Constructor
    * @param max_size Maximum size of the cache in bytes
+   * @param shard_count Independently locked parts at most, each holding an
+   * equal share of the size and no less than MIN_SHARD_SIZE. Files larger
+   * than a share are not cached, see get_max_entry_size
+   * @param storage Where the files are kept
    */
-  explicit Cache(size_t max_size);
+  explicit Cache(size_t max_size, size_t shard_count = 1,
+                 CacheStorage storage = CacheStorage::COPY);
   ~Cache();
   /**
-   * Set a file in the cache
+   * Set a file in the cache, if the admission policy lets it in
    * @param path Path of the file
    * @param file Reference of File object
+   * @param heads Response heads stored with the file
+   * @param generation Generation of the path before the file was opened,
+   * see generation()
+   * @param encodable The file is also sent compressed, see
+   * CachedFile::encodable
+   * @return The cached file, null if it was not admitted or the path was
+   * invalidated since
+   */
+  CacheHandle set(const string &path, const File &file, CachedHeads heads,
+                  uint64_t generation, bool encodable = false);
+  /**
+   * Set generated content in the cache, such as a compressed variant
    */
-  void set(const string &path, const File &file);
+  CacheHandle set(const string &path, string_view data, CachedHeads heads,
+                  uint64_t generation);
 
   /**
-   * Get a file from the cache
+   * Get a file from the cache, counting the request for the admission policy
    * @param path Path of the file
-   * @return pair of pointer to the file data and its size
+   * @return The cached file, null if it is not cached
+   */
+  CacheHandle get(const string &path);
+  /**
+   * Get the first cached of several keys of one path, such as its variants
+   * in order of preference and then the path, counted as one request
    */
-  pair<char *, size_t> get(const string &path);
+  CacheHandle get_first(span<const string> keys);
 
   /**
    * Check if a file is in the cache
@@ -42,36 +202,200 @@ public:
   bool contains(const string &path) const;
 
   /**
-   * Get maximum size of the cache
+   * Drop a file that changed with its variants, or every file below a
+   * directory
    */
-  size_t get_max_size() const;
+  void invalidate(const string &path, bool subtree);
+  /**
+   * Count of invalidations that may have concerned a path. Read before
+   * opening its file, content opened before a change is then not stored
+   * after it
+   */
+  uint64_t generation(const string &path) const;
+
+  /**
+   * Key of another representation of a path, such as a compressed encoding.
+   * Variants are kept in the shard of their path and invalidated with it
+   */
+  static string variant_key(const string &path, string_view variant);
 
-private:
   /**
-   * Map to store file paths and their corresponding pointer and size in the
-   * cache
+   * Get maximum size of the cache
    */
-  unordered_map<string, pair<char *, size_t>> cache_map;
+  size_t get_max_size() const;
   /**
-   * Queue to store the least recently used file paths
+   * Size of the largest file a shard can take
    */
-  list<string> lru_queue;
+  size_t get_max_entry_size() const;
+
+  Stats stats() const;
+
+private:
   /**
-   * Buffer to store file data
+   * The paths of a shard and their replacement policy
    */
-  char *cache_buffer;
+  class Shard {
+  public:
+    Shard(size_t max_size, shared_ptr<SlabAllocator> storage);
+
+    /**
+     * Content of a new entry, a file or bytes in memory
+     */
+    struct Source {
+      const File *file = nullptr;
+      string_view data;
+      bool encodable = false;
+
+      size_t size() const;
+    };
+
+    CacheHandle set(const string &path, uint64_t hash, const Source &source,
+                    CachedHeads heads, uint64_t generation);
+    CacheHandle get(span<const string> keys, uint64_t hash);
+    bool contains(const string &path) const;
+    void invalidate(const string &path, bool subtree);
+    uint64_t get_generation() const;
+    size_t max_entry_size() const;
+    void add_stats(Stats &stats) const;
+
+  private:
+    enum class Region : uint8_t { WINDOW, PROBATION, PROTECTED };
+
+    /**
+     * Cached file linked into the recency list of its region
+     */
+    struct Entry {
+      CacheHandle file;
+      /**
+       * Key of the entry in cache_map
+       */
+      const string *path = nullptr;
+      uint64_t hash = 0;
+      Region region = Region::WINDOW;
+      Entry *previous = nullptr;
+      Entry *next = nullptr;
+    };
+
+    /**
+     * Intrusive recency list, most recently used first
+     */
+    struct LruList {
+      Entry *head = nullptr;
+      Entry *tail = nullptr;
+      /**
+       * Bytes of the files in the list
+       */
+      size_t size = 0;
+
+      void push_front(Entry *entry);
+      void remove(Entry *entry);
+    };
+
+    /**
+     * Guards everything below, lookups update the recency lists too
+     */
+    mutable mutex lock;
+    /**
+     * Map to store file paths and their entries. Nodes don't move, the
+     * lists link them directly
+     */
+    unordered_map<string, Entry> cache_map;
+    /**
+     * New files, about 1% of the shard
+     */
+    LruList window;
+    /**
+     * Main space: files admitted from the window wait in probation until
+     * requested again, then move to the protected list (80% of the space)
+     */
+    LruList probation;
+    LruList protected_list;
+    FrequencySketch sketch;
+    size_t max_size;
+    size_t window_capacity;
+    size_t protected_capacity;
+    /**
+     * Current size of the shard in bytes
+     */
+    size_t current_size = 0;
+    /**
+     * Bytes of admitted files being filled outside the lock, counted against
+     * the region they will enter so concurrent misses can't overshoot it
+     */
+    size_t reserved_window = 0;
+    size_t reserved_main = 0;
+    /**
+     * Invalidations of the shard so far
+     */
+    uint64_t generation = 0;
+    /**
+     * Memory the files are stored in, shared by all shards. Null when they
+     * are mapped
+     */
+    shared_ptr<SlabAllocator> storage;
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
+    size_t rejections = 0;
+    size_t bytes_copied = 0;
+    /**
+     * Variant names stored so far, tried when a path is invalidated
+     */
+    vector<string> variant_names;
+
+    LruList &list_of(Region region);
+    /**
+     * Move a requested entry up its region
+     */
+    void touch(Entry &entry);
+    /**
+     * Make room for a new file according to the policy and reserve it
+     * @return false if the file is not admitted
+     */
+    bool reserve(size_t size, uint64_t hash);
+    /**
+     * Return a reservation, the file was stored or given up
+     */
+    void release(size_t size);
+    /**
+     * Move the oldest window entry to the main space, or drop it
+     */
+    void admit_from_window();
+    /**
+     * Evict main space entries rarer than a candidate until size bytes fit
+     * @return false, evicting nothing, if the candidate is not admitted
+     */
+    bool make_room(size_t size, uint8_t frequency);
+    /**
+     * Whether the storage has room for a file of size bytes
+     */
+    bool fits(size_t size) const;
+    /**
+     * Evict the least valuable entry, false if the shard is empty
+     */
+    bool evict_any();
+    void evict(Entry &entry);
+    /**
+     * Unlink an entry from its list and the map
+     */
+    void remove(Entry &entry);
+  };
+
+  vector<unique_ptr<Shard>> shards;
   /**
    * Maximum size of the cache in bytes
    */
   size_t max_size;
   /**
-   * Current size of the cache in bytes
+   * Memory the files are stored in, null when they are mapped
    */
-  size_t current_cache_size = 0;
+  shared_ptr<SlabAllocator> storage;
+
+  Shard &shard_of(uint64_t hash) const;
   /**
-   * Evict the least recently used file from the cache
+   * Hash of a key, the same for all variants of a path
    */
-  void evict();
+  static uint64_t hash_of(const string &key);
 };
 
 #endif // CACHE_H
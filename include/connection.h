@@ -0,0 +1,352 @@
+#ifndef WEBSERVER_CONNECTION_H
+#define WEBSERVER_CONNECTION_H
+
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <netinet/in.h>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+#include "access_log.h"
+#include "file.h"
+#include "metrics.h"
+#include "request_parser.h"
+#include "response.h"
+#include "timer_wheel.h"
+
+using namespace std;
+
+/**
+ * Piece of a response waiting to be sent: either bytes in memory, owned or
+ * referenced, or a range of a file streamed without loading the whole file
+ */
+struct OutputSegment {
+  explicit OutputSegment(string data) : data(std::move(data)) {}
+  OutputSegment(const string_view view, shared_ptr<const void> owner)
+      : view(view), owner(std::move(owner)) {}
+  OutputSegment(shared_ptr<const File> file, const off_t offset,
+                const size_t length)
+      : file(std::move(file)), offset(offset), length(length) {}
+
+  /**
+   * In-memory bytes, used when file and owner are null
+   */
+  string data;
+  /**
+   * Immutable bytes held elsewhere (a cache entry), sent without copying
+   */
+  string_view view;
+  /**
+   * Keeps the memory of view alive until the segment is sent
+   */
+  shared_ptr<const void> owner;
+  /**
+   * File to stream, kept open until the segment is sent
+   */
+  shared_ptr<const File> file;
+  /**
+   * Bytes of data already sent, or current position in the file
+   */
+  off_t offset = 0;
+  /**
+   * Bytes of the file left to send
+   */
+  size_t length = 0;
+  /**
+   * Last segment of a response
+   */
+  bool end_of_response = false;
+
+  /**
+   * In-memory bytes of the segment, sent or not
+   */
+  string_view bytes() const {
+    return this->owner ? this->view : string_view(this->data);
+  }
+
+  size_t remaining() const {
+    return this->file ? this->length : this->bytes().size() - this->offset;
+  }
+
+  void consume(const size_t size) {
+    this->offset += static_cast<off_t>(size);
+    if (this->file)
+      this->length -= size;
+  }
+};
+
+/**
+ * What a connection is waiting for, each with its own time limit
+ */
+enum class Deadline : uint8_t {
+  NONE,
+  /**
+   * Next request on a kept-alive connection
+   */
+  IDLE,
+  /**
+   * Rest of a request head, counted from its first byte
+   */
+  HEADER,
+  /**
+   * Rest of a request body, counted from the end of the head
+   */
+  BODY,
+  /**
+   * Client reading the response, counted from the last progress
+   */
+  WRITE
+};
+
+/**
+ * Per-connection state, registered with the I/O backend as the event context
+ */
+struct Connection {
+  Connection(const int fd, const sockaddr_in &address,
+             const RequestParser::Limits &limits)
+      : fd(fd), address(address), parser(limits) {}
+  ~Connection() {
+    if (this->pipe_fds[0] != -1) {
+      close(this->pipe_fds[0]);
+      close(this->pipe_fds[1]);
+    }
+  }
+  Connection(const Connection &) = delete;
+  Connection &operator=(const Connection &) = delete;
+
+  /**
+   * Client socket
+   */
+  int fd;
+  /**
+   * Peer address
+   */
+  sockaddr_in address;
+  /**
+   * Set by close_session, events still queued for it are ignored
+   */
+  bool closed = false;
+  /**
+   * Received bytes not yet consumed by a request, grows as needed
+   */
+  string input;
+  /**
+   * Parsing state of the request at the front of the input
+   */
+  RequestParser parser;
+  /**
+   * Response data in send order
+   */
+  deque<OutputSegment> output;
+  /**
+   * Responses queued in the output and not completely sent
+   */
+  size_t queued_responses = 0;
+  /**
+   * Parsing stopped at the pipelining limit, resumed once responses drain
+   */
+  bool input_paused = false;
+  /**
+   * Close once the output is sent (Connection: close)
+   */
+  bool close_after_write = false;
+  /**
+   * Client shut its side down, closed once the requests it sent before are
+   * answered
+   */
+  bool peer_closed = false;
+  /**
+   * Registered for read readiness, dropped once nothing more is read
+   */
+  bool watching_readable = true;
+  /**
+   * Registered for write readiness, the socket buffer was full
+   */
+  bool watching_writable = false;
+  /**
+   * Queued for another turn in the next loop iteration
+   */
+  bool turn_pending = false;
+  /**
+   * Reading stopped short of draining the socket, continued on a turn
+   */
+  bool read_pending = false;
+  /**
+   * File bytes read for the segment at the front of the output
+   */
+  string staging;
+  /**
+   * Pipe used to splice file pages to the socket when sendfile is not
+   * supported, created on first use
+   */
+  int pipe_fds[2] = {-1, -1};
+  /**
+   * File bytes sitting in the pipe, not sent yet
+   */
+  size_t piped = 0;
+
+  // io_uring backend state
+  /**
+   * Submitted operations whose completion has not arrived yet, the
+   * connection can only be freed once this drops to zero
+   */
+  unsigned pending_operations = 0;
+  /**
+   * A send or file read is in flight, only one at a time to keep order
+   */
+  bool sending = false;
+  /**
+   * The multishot receive is armed, and being cancelled while input is
+   * paused, so the data stays in the socket as with epoll
+   */
+  bool receiving = false;
+  bool cancelling_receive = false;
+  /**
+   * Bytes of the staging buffer already sent
+   */
+  size_t staging_sent = 0;
+  /**
+   * Header of the in-flight sendmsg
+   */
+  msghdr message{};
+
+  /**
+   * Gather list of the output segments being sent
+   */
+  vector<iovec> iov;
+
+  /**
+   * Requests handled, the connection closes after the last one allowed
+   */
+  size_t requests = 0;
+  /**
+   * Bytes handed to the kernel so far
+   */
+  size_t bytes_sent = 0;
+  /**
+   * Timer of the deadline currently enforced
+   */
+  TimerWheel::Timer timer;
+  Deadline deadline = Deadline::NONE;
+  /**
+   * Requests handled, or bytes sent while writing, when the timer was
+   * armed. It is armed again once they change
+   */
+  size_t deadline_mark = 0;
+
+  // Access logging, writer is null when it is off
+  AccessLog::Writer *access_log = nullptr;
+  // Counters of the worker, null when metrics are off
+  WorkerMetrics *metrics = nullptr;
+  /**
+   * Last time bytes were received
+   */
+  AccessRecord::Clock::time_point received_at;
+  /**
+   * First bytes of the request at the front of the input arrived, unset
+   * between requests
+   */
+  AccessRecord::Clock::time_point request_started;
+  /**
+   * Request being handled, queued with its response
+   */
+  AccessRecord access;
+  /**
+   * Records of the queued responses, logged once they are sent
+   */
+  deque<AccessRecord> access_records;
+
+  /**
+   * Requests are timed for the access log or the metrics
+   */
+  bool timed() const { return this->access_log || this->metrics; }
+
+  /**
+   * Queue a serialized response: its headers, then a reference to its body,
+   * gathered into the same sendmsg without copying the body next to the
+   * headers
+   * @return Body bytes queued
+   */
+  size_t queue_response(Response &response) {
+    if (const string_view head = response.get_head(); !head.empty())
+      this->output.emplace_back(head, response.get_head_owner());
+    this->output.emplace_back(response.take_headers());
+    const size_t body_start = this->output.size();
+    for (const string_view part : response.get_body())
+      this->output.emplace_back(part, response.get_body_owner());
+    if (const auto &file = response.get_file(); file && file->size() > 0)
+      this->output.emplace_back(file, 0, file->size());
+    for (const BodyPart &part : response.get_parts()) {
+      if (part.file)
+        this->output.emplace_back(part.file, part.offset, part.length);
+      else if (part.owner)
+        this->output.emplace_back(part.view, part.owner);
+      else
+        this->output.emplace_back(part.data);
+    }
+    this->output.back().end_of_response = true;
+    this->queued_responses++;
+
+    size_t body_bytes = 0;
+    for (size_t i = body_start; i < this->output.size(); i++)
+      body_bytes += this->output[i].remaining();
+    return body_bytes;
+  }
+
+  /**
+   * Drop sent bytes from the front of the output
+   */
+  void consume_output(size_t sent) {
+    const auto now =
+        timed() ? AccessRecord::Clock::now() : AccessRecord::Clock::time_point();
+    this->bytes_sent += sent;
+    if (this->metrics)
+      this->metrics->bytes_sent.add(sent);
+    while (sent > 0 && !this->output.empty()) {
+      // Bytes of the oldest queued response are going out
+      if (!this->access_records.empty() &&
+          this->access_records.front().first_byte ==
+              AccessRecord::Clock::time_point())
+        this->access_records.front().first_byte = now;
+      OutputSegment &segment = this->output.front();
+      const size_t consumed = min(sent, segment.remaining());
+      segment.consume(consumed);
+      sent -= consumed;
+      if (segment.remaining() > 0)
+        break;
+      if (segment.end_of_response) {
+        this->queued_responses--;
+        if (!this->access_records.empty()) {
+          AccessRecord &access = this->access_records.front();
+          access.last_byte = now;
+          if (this->metrics)
+            record_metrics(access);
+          if (this->access_log)
+            this->access_log->write(access);
+          this->access_records.pop_front();
+        }
+      }
+      this->output.pop_front();
+    }
+  }
+
+  /**
+   * Count a response sent completely
+   */
+  void record_metrics(const AccessRecord &access) const {
+    const auto status = static_cast<unsigned>(access.status);
+    if (status >= 100 && status < 600)
+      this->metrics->responses[status / 100 - 1].add();
+    this->metrics->first_byte.record(
+        chrono::nanoseconds(access.first_byte - access.started).count());
+    this->metrics->duration.record(
+        chrono::nanoseconds(access.last_byte - access.started).count());
+  }
+};
+
+#endif // WEBSERVER_CONNECTION_H
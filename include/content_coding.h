@@ -0,0 +1,48 @@
+#ifndef WEBSERVER_CONTENT_CODING_H
+#define WEBSERVER_CONTENT_CODING_H
+
+#include <array>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace http {
+
+// Content codings a response can be sent in
+enum class ContentCoding { IDENTITY, GZIP, BROTLI };
+
+// Token naming the coding in Accept-Encoding and Content-Encoding
+std::string_view coding_name(ContentCoding coding);
+
+// Extension of the precompressed sidecar next to a file
+std::string_view sidecar_extension(ContentCoding coding);
+
+/**
+ * Quality the client gave a coding in its Accept-Encoding header, 0 when not
+ * acceptable. Identity is acceptable unless refused explicitly
+ */
+double coding_quality(std::string_view accept_encoding, ContentCoding coding);
+
+/**
+ * Compressed codings acceptable to the client, preferred first and brotli
+ * first on a tie as it is smaller
+ * @return Number of codings stored in codings
+ */
+std::size_t preferred_codings(std::string_view accept_encoding,
+                              std::array<ContentCoding, 2> &codings);
+
+// Whether content of the MIME type shrinks when compressed
+bool is_compressible(std::string_view mime_type);
+
+// Whether this build can compress to the coding on the fly
+bool can_compress(ContentCoding coding);
+
+/**
+ * Compress data with the coding
+ * @return false if the coding is not available or compression failed
+ */
+bool compress(ContentCoding coding, std::string_view data, std::string &out);
+
+} // namespace http
+
+#endif // WEBSERVER_CONTENT_CODING_H
@@ -0,0 +1,40 @@
+#ifndef WEBSERVER_DELIMITER_SCANNER_H
+#define WEBSERVER_DELIMITER_SCANNER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Vectorized search for the bytes that structure a request head. One pass
+ * over a buffer marks them in two bitmaps, bit i of word i / 64 standing for
+ * byte i: line feeds, and separators (':' ending a field name, '?' starting
+ * a query). The widest implementation the CPU supports (AVX2, SSE2 or
+ * scalar) is picked at runtime on first use.
+ */
+class DelimiterScanner {
+public:
+  /**
+   * Mark the delimiters of data[begin, end), the bitmaps are resized to cover
+   * end and the words from begin on are overwritten
+   * @param data Start of the buffer
+   * @param begin First byte to scan, a multiple of 64
+   * @param end End of the bytes to scan
+   */
+  static void scan(const char *data, size_t begin, size_t end,
+                   vector<uint64_t> &line_feeds, vector<uint64_t> &separators);
+
+  /**
+   * Position of the first marked byte in [from, to), npos if none
+   */
+  static size_t find(const vector<uint64_t> &bits, size_t from, size_t to);
+
+  /**
+   * Name of the implementation in use
+   */
+  static const char *implementation();
+};
+
+#endif // WEBSERVER_DELIMITER_SCANNER_H
@@ -4,6 +4,7 @@
 
 #ifndef FILE_H
 #define FILE_H
+#include <string>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -12,11 +13,20 @@ public:
     explicit File(const char* path);
     ~File();
     void read(char * buffer) const;
+    // Read up to size bytes at offset without moving the file position
+    ssize_t read_at(char * buffer, size_t size, off_t offset) const;
     size_t size() const;
+    // Time of the last modification
+    time_t modified() const;
+    // Validators of the content, formatted once when the file is opened
+    const std::string &etag() const;
+    const std::string &last_modified() const;
+    int descriptor() const;
 private:
-    const char* path;
     int fd;
     struct stat file_stat{};
+    std::string entity_tag;
+    std::string modified_date;
 };
 
 
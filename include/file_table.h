@@ -0,0 +1,88 @@
+#ifndef WEBSERVER_FILE_TABLE_H
+#define WEBSERVER_FILE_TABLE_H
+
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "cache.h"
+#include "file.h"
+
+using namespace std;
+
+/**
+ * Open files of the document root by request path, with their size and
+ * modification time, so serving a known file takes no open or fstat. On
+ * Linux a background thread watches the root with inotify: a file that is
+ * written, moved or deleted is dropped from the table and from the cache,
+ * along with its stored response head. Without inotify every lookup opens
+ * the file.
+ */
+class FileTable {
+public:
+  /**
+   * @param root Document root
+   * @param cache Cache to invalidate changed files in
+   * @param max_files Files kept open at most
+   */
+  FileTable(string root, shared_ptr<Cache> cache, size_t max_files = 1024);
+  ~FileTable();
+  FileTable(const FileTable &) = delete;
+  FileTable &operator=(const FileTable &) = delete;
+
+  /**
+   * Open file at a request path, throws like File if it can't be opened
+   */
+  shared_ptr<const File> open(const string &path);
+  /**
+   * Open file at a request path, null if it can't be opened. Failures are
+   * remembered like open files until the path changes, so looking for an
+   * optional file such as a sidecar costs no open
+   */
+  shared_ptr<const File> find(const string &path);
+
+private:
+  string root;
+  shared_ptr<Cache> cache;
+  size_t max_files;
+  shared_mutex lock;
+  /**
+   * Open files, null for paths that failed to open
+   */
+  unordered_map<string, shared_ptr<const File>> files;
+  /**
+   * Bumped by every invalidation, a file opened across one is not kept
+   */
+  uint64_t generation = 0;
+  /**
+   * Changes are noticed, files can be kept open
+   */
+  bool watching = false;
+
+#ifdef __linux__
+  int inotify_fd = -1;
+  /**
+   * Wakes the watcher up to stop
+   */
+  int wake_fd = -1;
+  /**
+   * Watched directories by watch descriptor, relative to the root. Only
+   * used by the watcher once it runs
+   */
+  unordered_map<int, string> watches;
+  thread watcher;
+
+  void watch_tree(const string &directory);
+  void watch_events();
+  void handle_event(int watch, uint32_t mask, const char *name);
+#endif
+  /**
+   * Forget a changed path, or everything below it
+   */
+  void invalidate(const string &path, bool subtree);
+};
+
+#endif // WEBSERVER_FILE_TABLE_H
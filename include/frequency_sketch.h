@@ -0,0 +1,47 @@
+#ifndef WEBSERVER_FREQUENCY_SKETCH_H
+#define WEBSERVER_FREQUENCY_SKETCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Count-min sketch estimating how often keys were seen recently, in a few
+ * bytes per tracked key. Counters saturate at 15 and are all halved once
+ * enough samples were recorded, so old popularity fades out.
+ */
+class FrequencySketch {
+public:
+  /**
+   * @param expected_keys Distinct keys expected to be tracked at once
+   */
+  explicit FrequencySketch(size_t expected_keys);
+
+  void record(uint64_t hash);
+  /**
+   * Estimated recent occurrences of the key, at most 15
+   */
+  uint8_t frequency(uint64_t hash) const;
+
+private:
+  static constexpr size_t DEPTH = 4;
+  static constexpr uint8_t MAX_COUNT = 15;
+
+  /**
+   * DEPTH rows of counters, each indexed by a different hash of the key
+   */
+  vector<uint8_t> counters;
+  size_t mask;
+  size_t samples = 0;
+  /**
+   * Samples after which the counters are halved
+   */
+  size_t sample_limit;
+
+  size_t index(uint64_t hash, size_t row) const;
+  void age();
+};
+
+#endif // WEBSERVER_FREQUENCY_SKETCH_H
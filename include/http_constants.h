@@ -6,6 +6,7 @@
 #define WEBSERVER_HTTP_CONSTANTS_H
 
 #include <string>
+#include <string_view>
 #include <unordered_map>
 
 namespace http {
@@ -225,6 +226,7 @@ struct HTTPHeaders {
   inline static const std::string CONTENT_LOCATION = "Content-Location";
   inline static const std::string CONTENT_DISPOSITION = "Content-Disposition";
   inline static const std::string CONTENT_RANGE = "Content-Range";
+  inline static const std::string VARY = "Vary";
 
   inline static const std::string DATE = "Date";
   inline static const std::string SERVER = "Server";
@@ -235,12 +237,16 @@ struct HTTPHeaders {
   inline static const std::string ETAG = "ETag";
   inline static const std::string LAST_MODIFIED = "Last-Modified";
   inline static const std::string EXPIRES = "Expires";
+  inline static const std::string IF_NONE_MATCH = "If-None-Match";
+  inline static const std::string IF_MODIFIED_SINCE = "If-Modified-Since";
 
   inline static const std::string ACCEPT = "Accept";
   inline static const std::string ACCEPT_CHARSET = "Accept-Charset";
   inline static const std::string ACCEPT_ENCODING = "Accept-Encoding";
   inline static const std::string ACCEPT_LANGUAGE = "Accept-Language";
   inline static const std::string ACCEPT_RANGES = "Accept-Ranges";
+  inline static const std::string RANGE = "Range";
+  inline static const std::string IF_RANGE = "If-Range";
 
   inline static const std::string HOST = "Host";
   inline static const std::string USER_AGENT = "User-Agent";
@@ -293,6 +299,33 @@ inline std::unordered_map<std::string, Method> STRING_TO_METHOD = {
     {"PATCH", Method::PATCH},    {"TRACE", Method::TRACE},
     {"CONNECT", Method::CONNECT}};
 
+// Look a method up by name without building a std::string key
+inline bool parse_method(const std::string_view name, Method &method) {
+  for (const auto &[value, text] : METHOD_MAP) {
+    if (text == name) {
+      method = value;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Case-insensitive comparison, header field names and most tokens are
+// case-insensitive ASCII
+inline bool equals_ignore_case(const std::string_view a,
+                               const std::string_view b) {
+  if (a.size() != b.size())
+    return false;
+  const auto lower = [](const unsigned char c) {
+    return c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+  };
+  for (size_t i = 0; i < a.size(); i++) {
+    if (lower(a[i]) != lower(b[i]))
+      return false;
+  }
+  return true;
+}
+
 
 } // namespace http
 
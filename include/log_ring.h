@@ -0,0 +1,107 @@
+#ifndef WEBSERVER_LOG_RING_H
+#define WEBSERVER_LOG_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string_view>
+
+using namespace std;
+
+/**
+ * Single producer, single consumer ring of log records. The producing thread
+ * copies a record in and publishes it with one release store, the consumer
+ * reads records in place and frees their space once written out. Records are
+ * never split across the end of the buffer, the producer pads to the end and
+ * starts over instead.
+ */
+class LogRing {
+public:
+  /**
+   * Record as read by the consumer, text points into the ring
+   */
+  struct Record {
+    time_t time;
+    uint8_t level;
+    string_view text;
+  };
+
+  /**
+   * @param capacity Bytes of records, a power of two
+   */
+  explicit LogRing(size_t capacity);
+
+  /**
+   * Append a record, text longer than a quarter of the ring is cut
+   * @return false if the ring is full and the record was dropped
+   */
+  bool push(time_t time, uint8_t level, string_view text);
+
+  /**
+   * Pass every published record to visit, without freeing them
+   * @return Position after the last record, for release
+   */
+  template <typename Visitor> size_t peek(Visitor &&visit) const;
+
+  /**
+   * Free the space of the records before position
+   */
+  void release(size_t position);
+
+  bool empty() const;
+
+  /**
+   * Records the producer dropped on a full ring
+   */
+  atomic<size_t> dropped{0};
+
+  /**
+   * Set once the producing thread exited, the consumer frees the ring after
+   * draining it
+   */
+  atomic<bool> retired{false};
+
+private:
+  struct Header {
+    uint32_t length;
+    uint8_t level;
+    time_t time;
+  };
+  // Level of the header filling the end of the buffer
+  static constexpr uint8_t PADDING = 0xff;
+
+  size_t capacity;
+  unique_ptr<char[]> buffer;
+  // Consumer position, written by the consumer only
+  alignas(64) atomic<size_t> head{0};
+  // Producer position, written by the producer only
+  alignas(64) atomic<size_t> tail{0};
+  // Last head seen by the producer, saves reading the consumer's cache line
+  size_t cached_head = 0;
+
+  static size_t record_size(size_t length);
+};
+
+template <typename Visitor> size_t LogRing::peek(Visitor &&visit) const {
+  size_t position = this->head.load(memory_order_relaxed);
+  const size_t end = this->tail.load(memory_order_acquire);
+  while (position != end) {
+    const size_t offset = position & (this->capacity - 1);
+    Header header;
+    memcpy(&header, this->buffer.get() + offset, sizeof(header));
+    if (header.level == PADDING) {
+      position += this->capacity - offset;
+      continue;
+    }
+    visit(Record{header.time, header.level,
+                 {this->buffer.get() + offset + sizeof(Header),
+                  header.length}});
+    position += record_size(header.length);
+  }
+  return position;
+}
+
+#endif // WEBSERVER_LOG_RING_H
@@ -5,11 +5,26 @@
 #ifndef LOGGER_H
 #define LOGGER_H
 
-#include <fstream>
+#include <atomic>
+#include <chrono>
+#include <memory>
 #include <mutex>
+#include <string>
+#include <string_view>
+#include <sys/uio.h>
+#include <thread>
+#include <vector>
+
+#include "log_ring.h"
 
 using namespace std;
 
+/**
+ * Asynchronous logger. Each thread appends records to its own lock-free ring,
+ * a background thread formats them and writes them in batches with writev to
+ * the log file and the console. Logging never blocks: records that find
+ * their ring full are dropped and counted.
+ */
 class Logger {
 public:
   // Logging by levels
@@ -21,8 +36,17 @@ public:
 
   // Get the singleton instance
   static Logger *getInstance();
+  // Guards the list of rings, taken when a thread logs for the first time.
+  // Never held while writing
   static mutex instanceMutex;
 
+  // Counters of the records logged so far
+  struct Stats {
+    size_t written;
+    size_t dropped;
+  };
+  static Stats stats();
+
   // Delete copy constructor and assignment operator
   Logger(const Logger &) = delete;
   Logger &operator=(const Logger &) = delete;
@@ -36,25 +60,51 @@ private:
   ~Logger();
   // Logging method
   void log(const string &message, LogLevel level);
+  // Ring of the calling thread, registered on first use
+  LogRing &local_ring();
+  // Background thread: drain the rings until stopped, then once more
+  void flush_loop();
+  // Write out every record queued so far
+  bool drain();
+  // Queue a record for writing, flushing the batch when it is full
+  void append(const LogRing::Record &record);
+  // Write the batch to the log file and the console
+  void flush_batch(int console);
+
+  // Log file descriptor
+  int log_file = -1;
+  // Rings of the threads that logged, freed by the flush thread once their
+  // thread exited and they are empty
+  vector<unique_ptr<LogRing>> rings;
+  // Rings being drained, copied from the list so the lock isn't held while
+  // writing. Only the flush thread frees rings, they stay valid
+  vector<LogRing *> draining;
+  // Records dropped by rings already freed
+  atomic<size_t> retired_dropped{0};
+  atomic<size_t> written{0};
+  atomic<bool> stopping{false};
+  thread flusher;
+
+  // Pending writes of the flush thread: per record the timestamp, the level
+  // tag, the message in its ring and a line feed
+  vector<iovec> batch;
+  // Timestamp of the records in the batch, formatted once per second
+  time_t timestamp_time = -1;
+  string timestamp;
 
-  // Singleton instance
-  static Logger *instance;
-  // Log file stream
-  ofstream log_file;
-  // Predefined log level strings
-  static constexpr string log_level_strings[4] = {"[INFO]", "[WARNING]",
-                                                  "[ERROR]", "[DEBUG]"};
-  // Predefined log level colors
-  static constexpr string log_level_colors[4] = {
-      "\033[0;32m", // Green
-      "\033[0;33m", // Yellow
-      "\033[0;31m", // Red
-      "\033[0;34m"  // Blue
+  // Bytes of records a thread can have waiting
+  static constexpr size_t RING_CAPACITY = 1024 * 1024;
+  // Pause of the flush thread once the rings are empty
+  static constexpr auto FLUSH_INTERVAL = chrono::milliseconds(10);
+  // Records written by a single writev
+  static constexpr size_t BATCH_RECORDS = 256;
+  // Predefined level tags: color, level name, color reset
+  static constexpr string_view log_level_tags[4] = {
+      " \033[0;32m[INFO]\033[0m ",    // Green
+      " \033[0;33m[WARNING]\033[0m ", // Yellow
+      " \033[0;31m[ERROR]\033[0m ",   // Red
+      " \033[0;34m[DEBUG]\033[0m "    // Blue
   };
-  // Predefined log level reset color
-  static constexpr string log_level_reset = "\033[0m";
-  // Predefined log format
-  static constexpr auto const *log_format = "{0} {1}{2}{3} {4}\n";
 };
 
 #endif // LOGGER_H
@@ -0,0 +1,156 @@
+#ifndef WEBSERVER_METRICS_H
+#define WEBSERVER_METRICS_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Counter written by a single thread and read by any. Adding is a relaxed
+ * load and store instead of a locked read-modify-write
+ */
+class Counter {
+public:
+  void add(const uint64_t amount = 1) {
+    this->value.store(this->value.load(memory_order_relaxed) + amount,
+                      memory_order_relaxed);
+  }
+
+  uint64_t get() const { return this->value.load(memory_order_relaxed); }
+
+private:
+  atomic<uint64_t> value{0};
+};
+
+/**
+ * Histogram of durations in nanoseconds, bucketed like HdrHistogram: values
+ * below 2 * SUB_BUCKETS are counted exactly, larger ones in SUB_BUCKETS
+ * buckets per power of two, so every bucket is within about 3% of its
+ * values. Written by a single thread like Counter
+ */
+class Histogram {
+public:
+  static constexpr unsigned SUB_BUCKET_BITS = 5;
+  static constexpr uint64_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+  /**
+   * Largest shift of a bucket, larger values (about 18 minutes) are clamped
+   */
+  static constexpr unsigned MAX_SHIFT = 34;
+  static constexpr size_t BUCKETS = (MAX_SHIFT + 2) * SUB_BUCKETS;
+
+  /**
+   * Counts of the histograms of all threads, merged for a scrape
+   */
+  struct Snapshot {
+    array<uint64_t, BUCKETS> counts{};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+
+    /**
+     * Value below which the given share of the values fall
+     */
+    uint64_t quantile(double share) const;
+    /**
+     * Values up to the given one, from the buckets whose values all are.
+     * A bucket straddling it isn't counted, as its values may be larger
+     */
+    uint64_t count_up_to(uint64_t value) const;
+  };
+
+  void record(uint64_t value);
+  void add_to(Snapshot &snapshot) const;
+
+  static size_t bucket_of(uint64_t value);
+  /**
+   * Value standing for the values of a bucket, the middle of its range
+   */
+  static uint64_t value_of(size_t bucket);
+  /**
+   * Largest value of a bucket
+   */
+  static uint64_t highest_of(size_t bucket);
+
+private:
+  array<atomic<uint64_t>, BUCKETS> counts{};
+  atomic<uint64_t> sum{0};
+};
+
+/**
+ * Counters of one worker, only ever updated by its thread
+ */
+struct WorkerMetrics {
+  Counter connections_accepted;
+  Counter connections_closed;
+  /**
+   * Requests parsed or rejected
+   */
+  Counter requests;
+  /**
+   * Responses sent completely, by status class 1xx to 5xx
+   */
+  array<Counter, 5> responses;
+  /**
+   * Bytes handed to the kernel, headers included
+   */
+  Counter bytes_sent;
+  /**
+   * Connections closed on a timeout, by what they waited for: the next
+   * request, a request head, a request body, the client reading
+   */
+  array<Counter, 4> timeouts;
+  /**
+   * Connections closed after the last request allowed on one
+   */
+  Counter request_limit_closes;
+  /**
+   * From the first bytes of a request until the first and the last bytes
+   * of its response were sent
+   */
+  Histogram first_byte;
+  Histogram duration;
+};
+
+/**
+ * Metrics of all workers, merged when scraped and written in the Prometheus
+ * text format. Workers count into their own WorkerMetrics, so recording
+ * never contends; the scrape reads the counters while they change
+ */
+class Metrics {
+public:
+  /**
+   * Metrics for the calling thread, which must be their only writer. They
+   * live as long as this object
+   */
+  WorkerMetrics &worker();
+
+  /**
+   * Append the merged worker metrics
+   */
+  void write(string &out) const;
+
+  static void write_counter(string &out, string_view name, string_view help,
+                            uint64_t value);
+  static void write_gauge(string &out, string_view name, string_view help,
+                          double value);
+
+private:
+  // Guards workers
+  mutable mutex lock;
+  vector<unique_ptr<WorkerMetrics>> workers;
+
+  static void write_histogram(string &out, string_view name,
+                              string_view help,
+                              const Histogram::Snapshot &snapshot);
+  static void write_summary(string &out, string_view name, string_view help,
+                            const Histogram::Snapshot &snapshot);
+};
+
+#endif // WEBSERVER_METRICS_H
@@ -0,0 +1,115 @@
+#ifndef WEBSERVER_POLLER_H
+#define WEBSERVER_POLLER_H
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+using namespace std;
+
+/**
+ * Readiness notification backend used by the server event loop.
+ * Every registered descriptor carries an opaque context pointer which is
+ * handed back by wait(), so the loop never has to look descriptors up.
+ */
+class Poller {
+public:
+  // Interest / readiness flags
+  static constexpr uint32_t READABLE = 1 << 0;
+  static constexpr uint32_t WRITABLE = 1 << 1;
+  static constexpr uint32_t HANGUP = 1 << 2;
+
+  /**
+   * Ready descriptor reported by wait()
+   */
+  struct Event {
+    void *context;
+    uint32_t events;
+  };
+
+  virtual ~Poller() = default;
+
+  /**
+   * Register a descriptor
+   * @param fd Descriptor to watch
+   * @param events Combination of READABLE / WRITABLE
+   * @param context Pointer returned with every event of this descriptor
+   */
+  virtual bool add(int fd, uint32_t events, void *context) = 0;
+
+  /**
+   * Change the interest set of a registered descriptor
+   */
+  virtual bool modify(int fd, uint32_t events, void *context) = 0;
+
+  /**
+   * Deregister a descriptor (must be called before closing it)
+   */
+  virtual void remove(int fd) = 0;
+
+  /**
+   * Wait for readiness
+   * @param events Output vector, cleared and filled with ready descriptors
+   * @param timeout_ms Timeout in milliseconds, -1 to wait forever
+   * @return Number of ready descriptors, -1 on error
+   */
+  virtual int wait(vector<Event> &events, int timeout_ms) = 0;
+
+  /**
+   * Name of the backend, for logging
+   */
+  virtual const char *name() const = 0;
+
+  /**
+   * Create the best backend available on this platform
+   */
+  static unique_ptr<Poller> create();
+};
+
+#ifdef __linux__
+/**
+ * Edge-triggered epoll backend. Callers must drain a descriptor until
+ * EAGAIN after every notification.
+ */
+class EpollPoller final : public Poller {
+public:
+  EpollPoller();
+  ~EpollPoller() override;
+  bool add(int fd, uint32_t events, void *context) override;
+  bool modify(int fd, uint32_t events, void *context) override;
+  void remove(int fd) override;
+  int wait(vector<Event> &events, int timeout_ms) override;
+  const char *name() const override { return "epoll"; }
+
+private:
+  int epoll_fd;
+  vector<epoll_event> ready;
+  static constexpr int MAX_EVENTS = 256;
+  static uint32_t to_epoll(uint32_t events);
+};
+#endif
+
+/**
+ * Portable select() backend, limited to FD_SETSIZE descriptors
+ */
+class SelectPoller final : public Poller {
+public:
+  bool add(int fd, uint32_t events, void *context) override;
+  bool modify(int fd, uint32_t events, void *context) override;
+  void remove(int fd) override;
+  int wait(vector<Event> &events, int timeout_ms) override;
+  const char *name() const override { return "select"; }
+
+private:
+  /**
+   * Registered descriptors and their interest set / context
+   */
+  unordered_map<int, Event> registered;
+};
+
+#endif // WEBSERVER_POLLER_H
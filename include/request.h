@@ -5,22 +5,62 @@
 #ifndef WEBSERVER_REQUEST_H
 #define WEBSERVER_REQUEST_H
 
-#include <map>
+#include <array>
+#include <cstddef>
 #include <string>
+#include <string_view>
 #include "http_constants.h"
 
 using namespace std;
 
+/**
+ * Parsed HTTP request. Every view points into the connection's read buffer,
+ * so a request is only valid until that buffer is modified.
+ */
 class Request {
 public:
-    explicit Request(string& buffer);
-    ~Request();
-    http::Method method;
-    string path;
-    string query;
-    map<string, string> headers;
-    map<string, string> params;
-    string body;
+    struct Header {
+        string_view name;
+        string_view value;
+    };
+    // Size of the flat header table, requests with more fields are refused
+    static constexpr size_t MAX_HEADERS = 64;
+
+    http::Method method = http::Method::GET;
+    string_view path;
+    string_view query;
+    string_view version;
+    string_view body;
+
+    /**
+     * Value of the first field with this name (case-insensitive), empty if absent
+     */
+    string_view header(string_view name) const;
+    bool has_header(string_view name) const;
+    /**
+     * Whether a comma-separated field contains token (case-insensitive)
+     */
+    bool header_has_token(string_view name, string_view token) const;
+    /**
+     * Whether the connection stays open, from the version and Connection field
+     */
+    bool keep_alive() const;
+    /**
+     * Path without empty or dot segments, so one file has one key. A ".."
+     * never leaves the root
+     */
+    string normalized_path() const;
+
+    /**
+     * Append a field, false once the table is full
+     */
+    bool add_header(string_view name, string_view value);
+    const Header *begin() const;
+    const Header *end() const;
+
+private:
+    array<Header, MAX_HEADERS> headers;
+    size_t headers_size = 0;
 };
 
 
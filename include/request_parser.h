@@ -0,0 +1,156 @@
+#ifndef WEBSERVER_REQUEST_PARSER_H
+#define WEBSERVER_REQUEST_PARSER_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "http_constants.h"
+#include "request.h"
+
+using namespace std;
+
+/**
+ * Resumable HTTP/1.x request parser working on a connection's read buffer.
+ * Newly received bytes are searched for delimiters in one vectorized pass
+ * (see DelimiterScanner), lines and fields are then cut at the positions
+ * marked, so parsing resumes without examining bytes again however many
+ * reads a request arrives in. The parts of the
+ * request are recorded as offsets instead of pointers because the buffer may
+ * be reallocated as it grows; request() turns them into views at the end.
+ */
+class RequestParser {
+public:
+  /**
+   * Size limits, exceeding one answers the request with an error status
+   */
+  struct Limits {
+    /**
+     * Longest request line, 414 URI Too Long beyond
+     */
+    size_t max_request_line = 8 * 1024;
+    /**
+     * Largest header section, 431 Request Header Fields Too Large beyond
+     */
+    size_t max_header_size = 16 * 1024;
+    /**
+     * Largest Content-Length accepted, 413 Payload Too Large beyond
+     */
+    size_t max_body_size = 1024 * 1024;
+
+    /**
+     * Most bytes a request within the limits takes, the parser has
+     * rejected one once this much of it is buffered
+     */
+    size_t max_request_size() const {
+      return this->max_request_line + this->max_header_size +
+             this->max_body_size;
+    }
+  };
+
+  enum class Result { INCOMPLETE, COMPLETE, ERROR };
+
+  explicit RequestParser(const Limits &limits);
+
+  /**
+   * Continue parsing the current request
+   * @param buffer Read buffer, only appended to since the previous call
+   * @return COMPLETE once the head and body of the request are buffered
+   */
+  Result parse(const string &buffer);
+
+  /**
+   * Status to answer with after parse() returned ERROR
+   */
+  http::StatusCode error() const;
+  /**
+   * Human readable reason of the error
+   */
+  string_view error_reason() const;
+
+  /**
+   * The completed request, viewing into buffer
+   */
+  Request request(const string &buffer) const;
+
+  /**
+   * Offset of the current request in the buffer
+   */
+  size_t request_start() const;
+  /**
+   * Offset right after the blank line ending the request head
+   */
+  size_t head_end() const;
+  /**
+   * Offset right after the request body
+   */
+  size_t request_end() const;
+
+  /**
+   * Whether the head of the current request is complete and its body is
+   * still arriving
+   */
+  bool reading_body() const;
+
+  /**
+   * Move on to the next (pipelined) request after a completed one
+   */
+  void next();
+
+  /**
+   * The first count bytes of the buffer were dropped, they must not belong
+   * to the current request
+   */
+  void discard(size_t count);
+
+private:
+  enum class State { REQUEST_LINE, HEADERS, BODY, COMPLETE, ERROR };
+
+  /**
+   * Part of the current request, relative to its start
+   */
+  struct Span {
+    uint32_t offset = 0;
+    uint32_t length = 0;
+  };
+  struct Field {
+    Span name;
+    Span value;
+  };
+
+  Limits limits;
+  State state = State::REQUEST_LINE;
+  /**
+   * Delimiter bitmaps of the buffer, see DelimiterScanner
+   */
+  vector<uint64_t> line_feeds;
+  vector<uint64_t> separators;
+  /**
+   * Bytes of the buffer already searched for delimiters
+   */
+  size_t scanned = 0;
+  size_t start = 0;
+  size_t line_start = 0;
+  size_t headers_start = 0;
+  size_t body_start = 0;
+  size_t content_length = 0;
+  http::StatusCode error_status = http::StatusCode::BAD_REQUEST;
+  string_view reason;
+
+  http::Method method = http::Method::GET;
+  Span path;
+  Span query;
+  Span version;
+  array<Field, Request::MAX_HEADERS> fields;
+  size_t field_count = 0;
+
+  Span span(string_view part, const char *data) const;
+  bool parse_request_line(string_view line, const char *data);
+  bool parse_header(string_view line, size_t colon, const char *data);
+  Result fail(http::StatusCode status, string_view message);
+};
+
+#endif // WEBSERVER_REQUEST_PARSER_H
@@ -5,41 +5,100 @@
 #ifndef WEBSERVER_RESPONSE_H
 #define WEBSERVER_RESPONSE_H
 
+#include "file.h"
 #include "http_constants.h"
+#include <chrono>
 #include <map>
+#include <memory>
+#include <span>
 #include <string>
+#include <string_view>
+#include <vector>
 
 using namespace std;
 
+// Piece of a ranged body: owned bytes, bytes held by owner, or a range of
+// file
+struct BodyPart {
+  string data;
+  string_view view;
+  shared_ptr<const void> owner;
+  shared_ptr<const File> file;
+  off_t offset = 0;
+  size_t length = 0;
+
+  size_t size() const;
+};
+
 class Response {
 public:
-  Response(const string &data, http::StatusCode status_code,
+  // Keep-Alive parameters advertised to clients, and enforced by the server:
+  // idle connections close after the timeout, any after max requests
+  static constexpr auto KEEP_ALIVE_TIMEOUT = chrono::seconds(5);
+  static constexpr size_t KEEP_ALIVE_MAX = 200;
+
+  Response(string data, http::StatusCode status_code,
            const map<string, string> &headers, bool keep_alive);
   Response(http::StatusCode status_code, const map<string, string> &headers);
   void serialize();
-  string get_headers();
-  string get_body();
-  string get_chunk(size_t offset, size_t size) const;
+  // Status line and the headers that only depend on the content, without the
+  // blank line. The same for every response sending this content, so it can
+  // be precomputed and stored with the body (see set_head)
+  string serialize_head(size_t content_length) const;
+  // Use a precomputed head held elsewhere (a cache entry), owner keeps it
+  // alive. serialize() then only adds the per-request headers
+  void set_head(string_view head, shared_ptr<const void> owner);
+  string_view get_head() const;
+  const shared_ptr<const void> &get_head_owner() const;
+  // Header block moved out of the response: the whole head, or only the
+  // per-request headers (Connection, Date) when it was precomputed
+  string take_headers();
+  // Body bytes in order, valid while the owner is held
+  span<const string_view> get_body() const;
+  const shared_ptr<const void> &get_body_owner() const;
   string get_metadata() const;
+  http::StatusCode get_status() const;
+  // Send immutable buffers held elsewhere (a cache entry) as the body, in
+  // order, referenced instead of copied. owner keeps them alive
+  void set_body(span<const string_view> body, shared_ptr<const void> owner);
+  // Stream the body from a file after the headers instead of from memory
+  void set_file(shared_ptr<const File> file);
+  const shared_ptr<const File> &get_file() const;
+  // Append to a body sent in pieces, such as the ranges of a 206 response.
+  // Sent after any other body
+  void add_part(string data);
+  void add_part(string_view view, shared_ptr<const void> owner);
+  void add_part(shared_ptr<const File> file, off_t offset, size_t length);
+  const vector<BodyPart> &get_parts() const;
 
 private:
   string data;
-  string body;
+  shared_ptr<const File> file;
+  span<const string_view> body;
+  shared_ptr<const void> body_owner;
+  vector<BodyPart> parts;
+  string_view head;
+  shared_ptr<const void> head_owner;
   map<string, string> headers;
+  bool keep_alive = false;
   string serialized_headers;
-  string serialized_body;
+  inline static const string keep_alive_parameters =
+      "timeout=" + to_string(KEEP_ALIVE_TIMEOUT.count()) +
+      ", max=" + to_string(KEEP_ALIVE_MAX);
   inline static const map<string, string> default_headers = {
       {"Server", "WebServer/1.0"},
       {"Host", "localhost"},
       {"Accept", "*/*"},
       {"Accept-Language", "en-US,en;q=0.5"}};
   http::StatusCode status_code;
+  // Date header of the current second
+  static string_view current_date();
   // Template for HTTP headers
   static constexpr auto const *HTTP_HEADER_TEMPLATE = "{0}: {1}\r\n";
 
-  // Template for HTTP responses
+  // Template for the head of HTTP responses, serialize() ends it
   static constexpr auto const *HTTP_RESPONSE_TEMPLATE =
-      "HTTP/1.1 {0} {1}\r\n{2}\r\n";
+      "HTTP/1.1 {0} {1}\r\n{2}";
 
   // Common error page templates
   static constexpr auto const *ERROR_PAGE_TEMPLATE =
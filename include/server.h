@@ -5,48 +5,206 @@
 #ifndef WEBSERVER_SERVER_H
 #define WEBSERVER_SERVER_H
 
+#include <chrono>
+#include <memory>
 #include <netinet/in.h>
-#include <sys/select.h>
+#include <unordered_map>
+#include <vector>
 
+#include "access_log.h"
+#include "byte_range.h"
 #include "cache.h"
+#include "connection.h"
+#include "file_table.h"
+#include "metrics.h"
+#include "poller.h"
 #include "request.h"
+#include "request_parser.h"
 #include "response.h"
+#include "timer_wheel.h"
+#include "uring.h"
 
 using namespace std;
 
+// I/O backend driving the event loop
+enum class IoBackend { SELECT, EPOLL, IO_URING };
+
+// Time limits of slow clients, a kept-alive connection idles for
+// Response::KEEP_ALIVE_TIMEOUT as announced in its Keep-Alive header
+struct Timeouts {
+    // From the first byte of a request until the end of its head
+    chrono::seconds header{10};
+    // From the end of a request head until the end of its body
+    chrono::seconds body{30};
+    // Without any progress sending a response
+    chrono::seconds write{30};
+};
+
+struct ServerConfig {
+    int port = 8080;
+    size_t max_cache_size = 1024 * 1024 * 3;
+    // Map cached files instead of copying them, within an address space budget
+    CacheStorage cache_storage = CacheStorage::COPY;
+    size_t max_mapped_size = 1024ul * 1024 * 1024;
+    // io_uring falls back to epoll (select off Linux) when unavailable
+    IoBackend io_backend = IoBackend::EPOLL;
+    RequestParser::Limits request_limits;
+    // Pipelined requests answered ahead of the client reading the responses
+    size_t max_pipelined_requests = 32;
+    Timeouts timeouts;
+    // File cache shared by the workers, the server creates its own if null
+    shared_ptr<Cache> cache;
+    // Open files of the document root, shared likewise
+    shared_ptr<FileTable> files;
+    // Structured log of every request, off if null
+    shared_ptr<AccessLog> access_log;
+    // Counters of the workers, served in Prometheus format on metrics_path,
+    // off if null
+    shared_ptr<Metrics> metrics;
+    string metrics_path = "/metrics";
+};
+
 class Server {
 public:
-    explicit Server(int port, size_t max_cache_size = 1024 * 1024 * 3);
+    explicit Server(const ServerConfig &config);
     ~Server();
     bool init();
     void run();
-    static constexpr size_t DEFAULT_BUFFER_SIZE = 8096;
+    // Cache as configured, split into the given number of shards
+    static shared_ptr<Cache> make_cache(const ServerConfig &config, size_t shards);
+    // Size of the file chunks read while streaming a response body
+    static constexpr size_t FILE_CHUNK_SIZE = 64 * 1024;
+    // Free space made in the read buffer for every recv
+    static constexpr size_t READ_SIZE = 16 * 1024;
+    static constexpr string DEFAULT_ROOT = "resources";
 private:
     int port;
-    fd_set master{};
-    int max_fd{};
+    IoBackend io_backend;
+    RequestParser::Limits request_limits;
+    size_t max_pipelined_requests;
+    Timeouts timeouts;
+    // Deadline of every open connection
+    TimerWheel timers;
     int server_socket{};
+    unique_ptr<Poller> poller;
+#ifdef __linux__
+    unique_ptr<IoUring> ring;
+    static constexpr unsigned ring_entries = 1024;
+    static constexpr uint16_t recv_buffer_group = 0;
+    static constexpr unsigned recv_buffer_count = 256;
+    static constexpr unsigned recv_buffer_size = 8192;
+    // Delay before re-arming a failed multishot accept, doubled while it
+    // keeps failing
+    chrono::milliseconds accept_backoff{0};
+    static constexpr chrono::milliseconds MIN_ACCEPT_BACKOFF{10};
+    static constexpr chrono::milliseconds MAX_ACCEPT_BACKOFF{1000};
+    __kernel_timespec accept_timeout{};
+    // Relative timeout of the ring's pending timer operation, read when
+    // submitted
+    __kernel_timespec timer_timeout{};
+    // Expiry of the earliest timer operation pending, max when none is
+    TimerWheel::Clock::time_point timer_expiry =
+        TimerWheel::Clock::time_point::max();
+#endif
+    // Open connections by descriptor, owned here and handed to the poller as context
+    unordered_map<int, unique_ptr<Connection>> connections;
+    // Connections closed during the current batch of events, freed after it
+    vector<unique_ptr<Connection>> closed_connections;
+    // Connections to resume in the next loop iteration: out of write budget,
+    // or parsing paused at the pipelining limit
+    vector<Connection *> turns;
     sockaddr_in server_address{};
-    Cache* cache;
-    static constexpr string DEFAULT_ROOT = "resources";
+    shared_ptr<Cache> cache;
+    shared_ptr<FileTable> files;
+    shared_ptr<AccessLog> access_log;
+    // Appends this worker's records to the access log, null when it is off
+    unique_ptr<AccessLog::Writer> access_writer;
+    shared_ptr<Metrics> metrics;
+    // This worker's counters, null when metrics are off
+    WorkerMetrics *worker_metrics = nullptr;
+    string metrics_path;
+    // Compressed responses the cache declined, by variant key and entity
+    // tag, so a file isn't compressed again on every request
+    array<pair<string, CacheHandle>, 8> encoded_responses;
+    size_t next_encoded_response = 0;
     static constexpr string DEFAULT_INDEX = "index.html";
-    static constexpr short max_retries = 5;
     static constexpr string end_of_chunk = "0\r\n\r\n";
     #ifdef __APPLE__
         static constexpr int send_option = 0;
     #else
         static constexpr int send_option = MSG_NOSIGNAL;
     #endif
-    timeval timeout{1, 0}; // 1s timeout
+    // Bytes sent to one connection before the others get their turn
+    static constexpr size_t WRITE_BUDGET = 256 * 1024;
+    // Bytes received from one connection before the others get their turn
+    static constexpr size_t READ_BUDGET = 256 * 1024;
+    // Most in-memory segments gathered into a single sendmsg
+    static constexpr size_t MAX_IOV = 64;
+    // Files compressed on the fly when a client accepts it, smaller ones
+    // gain nothing and larger ones take too long to compress
+    static constexpr size_t MIN_COMPRESS_SIZE = 256;
+    static constexpr size_t MAX_COMPRESS_SIZE = 1024 * 1024;
 
+    void run_reactor();
     void handle_new_connection();
-    void handle_client(int client_socket);
-    void handle_request(const Request& request, int client_socket);
-    void handle_get_request(const Request& request, int client_socket, bool keep_alive);
-    void send_response(Response &response, int client_socket, bool keep_alive);
+    void handle_client(Connection &connection);
+    void process_input(Connection &connection);
+    void reject_request(Connection &connection);
+    void begin_access(Connection &connection, const Request *request);
+    void handle_request(const Request& request, Connection &connection);
+    void handle_get_request(const Request& request, const string &request_path,
+                            Connection &connection, bool keep_alive);
+    static string content_type(string_view path);
+    bool send_encoded(const Request& request, const string &request_path,
+                      Connection &connection, bool keep_alive, const File &file,
+                      const map<string, string> &identity_headers, bool looked_up,
+                      uint64_t generation);
+    // Whether a compressed variant of the file can be sent, made or precompressed
+    bool has_variants(const string &request_path, const File &file);
+    CacheHandle cache_lookup(Connection &connection, span<const string> keys);
+    // Heads of the 200 and 304 responses stored with content sent with these headers
+    static CachedHeads cached_heads(const map<string, string> &headers, size_t content_length,
+                                    const File &file);
+    // Send a cached file, or its 304 head if the client's copy is current
+    void send_cached(const Request& request, const CacheHandle &cached, Connection &connection,
+                     bool keep_alive);
+    void send_metrics(Connection &connection, bool keep_alive);
+    static bool if_range_matches(const Request& request, const File &file);
+    static bool is_not_modified(const Request& request, string_view etag,
+                                string_view last_modified, time_t modified);
+    static map<string, string> not_modified_headers(map<string, string> headers);
+    void send_not_modified(Connection &connection, bool keep_alive, map<string, string> headers);
+    void send_ranges(Connection &connection, bool keep_alive, map<string, string> headers,
+                     const vector<http::ByteRange> &ranges, const CacheHandle &cached,
+                     const shared_ptr<const File> &file);
+    void send_response(Response &response, Connection &connection, bool keep_alive);
+    void flush_output(Connection &connection);
+    void watch_readable(Connection &connection, bool enable);
+    void watch_writable(Connection &connection, bool enable);
+    void watch(Connection &connection, bool readable, bool writable);
     void close_session(int fd);
-    void wait_for_socket_ready(int client_socket);
-    ssize_t send_with_retry(int client_socket, const string& data);
+    void release_connection(Connection &connection);
+    ssize_t send_gathered(Connection &connection);
+    void schedule_turn(Connection &connection);
+    void refresh_deadline(Connection &connection);
+    void expire_deadlines();
+    void handle_timeout(Connection &connection);
+    void resume_input(Connection &connection);
+    ssize_t send_file(Connection &connection, const OutputSegment &segment);
+#ifdef __linux__
+    ssize_t splice_file(Connection &connection, const OutputSegment &segment);
+    bool init_uring();
+    void run_uring();
+    void handle_completion(const io_uring_cqe &cqe);
+    void handle_accept_completion(const io_uring_cqe &cqe);
+    void handle_recv_completion(Connection &connection, const io_uring_cqe &cqe);
+    void handle_send_completion(Connection &connection, const io_uring_cqe &cqe);
+    void handle_file_send_completion(Connection &connection, const io_uring_cqe &cqe);
+    void handle_read_completion(Connection &connection, const io_uring_cqe &cqe);
+    void submit_output(Connection &connection);
+    void update_receive(Connection &connection);
+    void arm_timer_operation();
+#endif
 };
 
 
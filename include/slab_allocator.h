@@ -0,0 +1,136 @@
+#ifndef WEBSERVER_SLAB_ALLOCATOR_H
+#define WEBSERVER_SLAB_ALLOCATOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Fixed memory pool carved into segments of SEGMENT_SIZE bytes. A block
+ * larger than the biggest size class takes a whole segment, a smaller one a
+ * slot of the smallest fitting class, cut from a segment owned by that
+ * class. Blocks never move: allocating and releasing only update free lists,
+ * and a class segment whose slots are all free goes back to the pool.
+ * Thread-safe, blocks may be released by any thread.
+ */
+class SlabAllocator {
+public:
+  static constexpr size_t SEGMENT_SIZE = 64 * 1024;
+  static constexpr size_t MIN_SLOT_SIZE = 64;
+
+  struct Stats {
+    /**
+     * Bytes of all segments
+     */
+    size_t capacity = 0;
+    /**
+     * Segments given out whole or to a size class
+     */
+    size_t segments_used = 0;
+    /**
+     * Bytes asked for by the live blocks
+     */
+    size_t bytes_requested = 0;
+    /**
+     * Bytes of the segments and slots backing the live blocks
+     */
+    size_t bytes_allocated = 0;
+    /**
+     * Free slots in class segments, only usable by blocks of their class
+     */
+    size_t bytes_stranded = 0;
+
+    /**
+     * Share of the allocated bytes lost to rounding blocks up to slot sizes
+     */
+    double internal_fragmentation() const;
+    /**
+     * Share of the used segments' bytes sitting in stranded slots
+     */
+    double external_fragmentation() const;
+  };
+
+  explicit SlabAllocator(size_t capacity);
+
+  /**
+   * Allocate a block
+   * @param size At most SEGMENT_SIZE bytes
+   * @return The block, null when no segment is left
+   */
+  char *allocate(size_t size);
+  /**
+   * Return a block, size is the one it was allocated with
+   */
+  void release(char *block, size_t size);
+  /**
+   * Free segments taken by allocating a block of size bytes: none when a
+   * slot of its class is free
+   */
+  size_t segments_needed(size_t size) const;
+  /**
+   * Segments left in the pool
+   */
+  size_t free_segments() const;
+
+  Stats stats() const;
+
+private:
+  static constexpr uint32_t NONE = UINT32_MAX;
+  static constexpr int32_t WHOLE = -1;
+
+  struct Segment {
+    /**
+     * Size class cut into slots, or WHOLE
+     */
+    int32_t size_class = WHOLE;
+    /**
+     * Slots given out
+     */
+    uint32_t used = 0;
+    /**
+     * Slots cut so far, the rest of the segment is untouched
+     */
+    uint32_t carved = 0;
+    /**
+     * Released slots, each holding the next one in its first bytes
+     */
+    char *free_slots = nullptr;
+    /**
+     * Neighbours in the class list of segments with free slots
+     */
+    uint32_t previous = NONE;
+    uint32_t next = NONE;
+  };
+
+  struct SizeClass {
+    size_t slot_size;
+    uint32_t slots_per_segment;
+    /**
+     * First segment with a free slot
+     */
+    uint32_t partial = NONE;
+  };
+
+  mutable mutex lock;
+  unique_ptr<char[]> memory;
+  vector<Segment> segments;
+  vector<uint32_t> free_list;
+  vector<SizeClass> classes;
+  size_t bytes_requested = 0;
+  size_t bytes_allocated = 0;
+
+  /**
+   * Smallest class holding size bytes, classes.size() if none does
+   */
+  size_t class_of(size_t size) const;
+  char *allocate_slot(size_t size_class);
+  void release_slot(uint32_t index, char *slot);
+  void link(SizeClass &size_class, uint32_t index);
+  void unlink(SizeClass &size_class, uint32_t index);
+};
+
+#endif // WEBSERVER_SLAB_ALLOCATOR_H
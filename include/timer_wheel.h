@@ -0,0 +1,127 @@
+#ifndef WEBSERVER_TIMER_WHEEL_H
+#define WEBSERVER_TIMER_WHEEL_H
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+using namespace std;
+
+/**
+ * Hierarchical timer wheel: LEVELS wheels of SLOTS lists each, every level
+ * ticking SLOTS times slower than the one below. A timer is linked into the
+ * slot of the level whose range covers its deadline and moves down a level
+ * each time that slot comes round, until it expires from the lowest level.
+ * Arming and cancelling unlink or link one node, whatever the number of
+ * timers. Deadlines are rounded up to whole ticks.
+ */
+class TimerWheel {
+public:
+  using Clock = chrono::steady_clock;
+
+  /**
+   * Node linked into a slot, embedded in the object it times
+   */
+  struct Timer {
+    Timer *previous = nullptr;
+    Timer *next = nullptr;
+    /**
+     * Tick the timer expires at
+     */
+    uint64_t expires = 0;
+    /**
+     * Handed back on expiry, like a poller's event context
+     */
+    void *context = nullptr;
+
+    bool armed() const { return this->next != nullptr; }
+  };
+
+  static constexpr auto TICK = chrono::milliseconds(10);
+  static constexpr unsigned SLOT_BITS = 6;
+  static constexpr uint64_t SLOTS = 1 << SLOT_BITS;
+  /**
+   * Four levels span about 46 hours, later deadlines wait in the top level
+   */
+  static constexpr unsigned LEVELS = 4;
+
+  TimerWheel();
+  TimerWheel(const TimerWheel &) = delete;
+  TimerWheel &operator=(const TimerWheel &) = delete;
+
+  /**
+   * Arm a timer, or move it if it is armed already
+   */
+  void arm(Timer &timer, Clock::time_point deadline);
+  /**
+   * Disarm a timer, nothing happens if it isn't armed
+   */
+  void cancel(Timer &timer);
+
+  /**
+   * Expire the timers due by now, in tick order. They are disarmed before
+   * expire is called, which may arm or cancel any timer
+   */
+  template <typename Expire>
+  void advance(Clock::time_point now, Expire &&expire);
+
+  /**
+   * Time from which advance has work to do, max without timers
+   */
+  Clock::time_point next_expiry() const;
+  /**
+   * Milliseconds until next_expiry, -1 without timers
+   */
+  int timeout_ms(Clock::time_point now) const;
+
+  size_t size() const { return this->count; }
+
+private:
+  Clock::time_point origin;
+  /**
+   * Last tick processed
+   */
+  uint64_t current = 0;
+  size_t count = 0;
+  /**
+   * Slot lists, circular around their sentinel node
+   */
+  array<array<Timer, SLOTS>, LEVELS> slots;
+
+  void place(Timer &timer);
+  /**
+   * Process the next tick: move the timers of the higher level slots coming
+   * round down, then return the expired ones of the lowest level in list
+   */
+  void tick(Timer &expired);
+
+  static void link(Timer &list, Timer &timer);
+  static void unlink(Timer &timer);
+  static void splice(Timer &from, Timer &to);
+};
+
+template <typename Expire>
+void TimerWheel::advance(const Clock::time_point now, Expire &&expire) {
+  const auto target = static_cast<uint64_t>((now - this->origin) / TICK);
+  if (this->count == 0) {
+    // Nothing to expire, skip the idle ticks at once
+    this->current = max(this->current, target);
+    return;
+  }
+  Timer expired;
+  expired.previous = expired.next = &expired;
+  while (this->current < target && this->count > 0) {
+    tick(expired);
+    // Unlinked one at a time, expire may cancel the ones still waiting
+    while (expired.next != &expired) {
+      Timer &timer = *expired.next;
+      unlink(timer);
+      this->count--;
+      expire(timer);
+    }
+  }
+  this->current = max(this->current, target);
+}
+
+#endif // WEBSERVER_TIMER_WHEEL_H
@@ -0,0 +1,175 @@
+#ifndef WEBSERVER_URING_H
+#define WEBSERVER_URING_H
+
+#ifdef __linux__
+
+#include <cstdint>
+#include <deque>
+#include <initializer_list>
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+using namespace std;
+
+/**
+ * Minimal io_uring wrapper on top of the raw kernel interface.
+ * Submissions are batched: prep_*() only fill SQEs, they reach the kernel on
+ * the next submit_and_wait() (or earlier if the submission queue is full).
+ */
+class IoUring {
+public:
+  /**
+   * Constructor
+   * @param entries Submission queue size, the completion queue is twice that
+   */
+  explicit IoUring(unsigned entries);
+  ~IoUring();
+
+  IoUring(const IoUring &) = delete;
+  IoUring &operator=(const IoUring &) = delete;
+
+  /**
+   * Whether the ring was created, false if io_uring is unavailable
+   */
+  bool ready() const;
+
+  /**
+   * IORING_FEAT_* flags of the kernel
+   */
+  unsigned features() const { return this->kernel_features; }
+
+  /**
+   * Whether the kernel supports all the given opcodes, per
+   * IORING_REGISTER_PROBE. Flags of an opcode (multishot) aren't reported
+   */
+  bool supports(initializer_list<uint8_t> opcodes) const;
+
+  /**
+   * Hand a pool of provided buffers to the kernel for buffer-select receives
+   * @param group Buffer group id
+   * @param count Number of buffers
+   * @param size Size of each buffer in bytes
+   */
+  void setup_buffers(uint16_t group, unsigned count, unsigned size);
+
+  /**
+   * Get a provided buffer by id
+   */
+  char *buffer(uint16_t id) const;
+
+  /**
+   * Give a provided buffer back to the kernel once its data was consumed
+   */
+  void recycle_buffer(uint16_t id);
+
+  void prep_multishot_accept(int fd, uint64_t user_data);
+  void prep_multishot_recv(int fd, uint16_t group, uint64_t user_data);
+  void prep_sendmsg(int fd, const msghdr *message, uint64_t user_data);
+  void prep_send(int fd, const void *buffer, size_t size, uint64_t user_data);
+  void prep_read(int fd, void *buffer, unsigned size, off_t offset,
+                 uint64_t user_data);
+  /**
+   * Complete with -ETIME once the relative timeout elapses, read by the
+   * kernel when submitted
+   */
+  void prep_timeout(const __kernel_timespec *timeout, uint64_t user_data);
+  /**
+   * Cancel the operation submitted with the given user data, which then
+   * completes with -ECANCELED. The cancel's own completion is skipped
+   */
+  void prep_cancel(uint64_t target);
+
+  /**
+   * Submit all prepared SQEs and wait for at least wait_count completions
+   * @return Number of SQEs submitted, -1 on error
+   */
+  int submit_and_wait(unsigned wait_count);
+
+  /**
+   * Invoke handler for every available completion, except the ones of the
+   * ring's own bookkeeping operations
+   * @return Number of completions handled
+   */
+  template <typename Handler> unsigned for_each_completion(Handler &&handler);
+
+private:
+  int ring_fd = -1;
+  unsigned entries = 0;
+  unsigned kernel_features = 0;
+
+  // Submission queue
+  void *sq_ring = nullptr;
+  size_t sq_ring_size = 0;
+  unsigned *sq_head = nullptr;
+  unsigned *sq_tail = nullptr;
+  unsigned sq_mask = 0;
+  io_uring_sqe *sqes = nullptr;
+  size_t sqes_size = 0;
+  /**
+   * Local tail, published to the kernel on submit
+   */
+  unsigned sqe_tail = 0;
+  /**
+   * Prepared SQEs not yet submitted
+   */
+  unsigned to_submit = 0;
+
+  // Completion queue
+  void *cq_ring = nullptr;
+  size_t cq_ring_size = 0;
+  unsigned *cq_head = nullptr;
+  unsigned *cq_tail = nullptr;
+  unsigned cq_mask = 0;
+  io_uring_cqe *cqes = nullptr;
+  /**
+   * Completions reaped to make room while the submission queue was full,
+   * handled ahead of the completion queue
+   */
+  deque<io_uring_cqe> deferred;
+
+  // Provided buffers
+  char *buffer_memory = nullptr;
+  uint16_t buffer_group = 0;
+  unsigned buffer_size = 0;
+  /**
+   * User data of the ring's own operations, their completions are skipped
+   */
+  static constexpr uint64_t INTERNAL = ~0ULL;
+
+  /**
+   * Get a zeroed SQE, submitting pending ones first if the queue is full.
+   * The kernel refuses them while completions back up, those are then
+   * reaped into deferred until it takes them
+   */
+  io_uring_sqe *get_sqe();
+  /**
+   * Pop the next completion, copied out so the slot can be reused
+   */
+  bool pop_completion(io_uring_cqe &cqe);
+  void prep_provide_buffers(uint16_t id, unsigned count);
+};
+
+template <typename Handler>
+unsigned IoUring::for_each_completion(Handler &&handler) {
+  unsigned count = 0;
+  io_uring_cqe cqe{};
+  while (true) {
+    // Deferred completions came off the queue first, keep their order
+    if (!this->deferred.empty()) {
+      cqe = this->deferred.front();
+      this->deferred.pop_front();
+    } else if (!pop_completion(cqe)) {
+      break;
+    }
+    if (cqe.user_data == INTERNAL)
+      continue;
+    handler(cqe);
+    count++;
+  }
+  return count;
+}
+
+#endif // __linux__
+
+#endif // WEBSERVER_URING_H
@@ -0,0 +1,40 @@
+#ifndef WEBSERVER_VALIDATORS_H
+#define WEBSERVER_VALIDATORS_H
+
+#include <ctime>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+
+namespace http {
+
+// Date in the format of HTTP headers, such as Last-Modified
+std::string format_http_date(time_t time);
+
+/**
+ * Parse a date in the format of HTTP headers
+ * @return false if it is not a valid IMF-fixdate
+ */
+bool parse_http_date(std::string_view date, time_t &time);
+
+/**
+ * Strong entity tag of a file from its inode, size and modification time,
+ * quoted as sent in ETag
+ */
+std::string entity_tag(const struct stat &file_stat);
+
+/**
+ * Entity tag of an encoded representation, derived from the tag of the
+ * identity one
+ */
+std::string entity_tag(std::string_view identity_tag, std::string_view coding);
+
+/**
+ * Whether a list of entity tags such as If-None-Match holds the tag, compared
+ * weakly. "*" matches any tag
+ */
+bool tag_list_matches(std::string_view tags, std::string_view tag);
+
+} // namespace http
+
+#endif // WEBSERVER_VALIDATORS_H
@@ -0,0 +1,311 @@
+#include "access_log.h"
+
+#include "logger.h"
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <format>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+// Fixed part of a record in a ring, followed by its strings
+struct Packed {
+  uint32_t address;
+  uint16_t status;
+  uint8_t method;
+  uint64_t bytes;
+  // Microseconds from the first bytes of the request
+  uint64_t parsed;
+  uint64_t first_byte;
+  uint64_t last_byte;
+  uint64_t cache_lookup;
+  // Lengths of the target, version, referer and user agent
+  uint16_t lengths[4];
+};
+
+// Method of a request that could not be parsed
+constexpr uint8_t UNKNOWN_METHOD = 0xff;
+
+uint64_t microseconds(const AccessRecord::Clock::duration duration) {
+  const auto count =
+      chrono::duration_cast<chrono::microseconds>(duration).count();
+  return count > 0 ? count : 0;
+}
+
+uint64_t since_start(const AccessRecord &record,
+                     const AccessRecord::Clock::time_point time) {
+  return time == AccessRecord::Clock::time_point()
+             ? 0
+             : microseconds(time - record.started);
+}
+
+// Append a string as Apache escapes request fields
+void append_escaped(string &out, const string_view text) {
+  for (const char c : text) {
+    const auto byte = static_cast<unsigned char>(c);
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (byte < 0x20 || byte == 0x7f) {
+      format_to(back_inserter(out), "\\x{:02x}",
+                static_cast<unsigned>(byte));
+    } else {
+      out += c;
+    }
+  }
+}
+
+// Append a JSON string, quoted
+void append_json(string &out, const string_view text) {
+  out += '"';
+  for (const char c : text) {
+    const auto byte = static_cast<unsigned char>(c);
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (byte < 0x20) {
+      format_to(back_inserter(out), "\\u{:04x}",
+                static_cast<unsigned>(byte));
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+}
+} // namespace
+
+AccessLog::Writer::~Writer() {
+  this->ring->retired.store(true, memory_order_release);
+}
+
+void AccessLog::Writer::write(const AccessRecord &record) {
+  const string_view strings[4] = {record.target, record.version, record.referer,
+                                  record.user_agent};
+  Packed packed{};
+  packed.address = record.address.s_addr;
+  packed.status = static_cast<uint16_t>(record.status);
+  packed.method = record.method ? static_cast<uint8_t>(*record.method)
+                                : UNKNOWN_METHOD;
+  packed.bytes = record.bytes;
+  packed.parsed = since_start(record, record.parsed);
+  packed.first_byte = since_start(record, record.first_byte);
+  packed.last_byte = since_start(record, record.last_byte);
+  packed.cache_lookup = microseconds(record.cache_lookup);
+
+  this->scratch.assign(sizeof(packed), '\0');
+  for (size_t i = 0; i < 4; i++) {
+    const string_view text = strings[i].substr(0, UINT16_MAX);
+    packed.lengths[i] = static_cast<uint16_t>(text.size());
+    this->scratch += text;
+  }
+  memcpy(this->scratch.data(), &packed, sizeof(packed));
+  this->ring->push(record.time, 0, this->scratch);
+}
+
+AccessLog::AccessLog(string path, const Format format, const size_t max_size,
+                     const size_t max_files)
+    : path(std::move(path)), format(format), max_size(max_size),
+      max_files(max(max_files, size_t{1})) {
+  this->open_file();
+  this->flusher = thread([this] { this->flush_loop(); });
+}
+
+AccessLog::~AccessLog() {
+  // The flush thread appends what is left before it stops
+  this->stopping.store(true);
+  this->flusher.join();
+  if (this->file != -1)
+    close(this->file);
+}
+
+unique_ptr<AccessLog::Writer> AccessLog::writer() {
+  auto ring = make_unique<LogRing>(RING_CAPACITY);
+  auto writer = make_unique<Writer>(ring.get());
+  const lock_guard guard(this->lock);
+  this->rings.push_back(std::move(ring));
+  return writer;
+}
+
+size_t AccessLog::dropped() const {
+  // Only the list of rings is locked, the counters are atomic
+  const lock_guard guard(this->lock);
+  size_t dropped = this->retired_dropped.load(memory_order_relaxed);
+  for (const auto &ring : this->rings)
+    dropped += ring->dropped.load(memory_order_relaxed);
+  return dropped;
+}
+
+void AccessLog::flush_loop() {
+  while (!this->stopping.load()) {
+    if (!drain())
+      this_thread::sleep_for(FLUSH_INTERVAL);
+  }
+  drain();
+}
+
+bool AccessLog::drain() {
+  {
+    const lock_guard guard(this->lock);
+    this->draining.clear();
+    for (const auto &ring : this->rings)
+      this->draining.push_back(ring.get());
+  }
+
+  bool drained = false;
+  bool retiring = false;
+  for (LogRing *ring : this->draining) {
+    // Read retired before the records, none follow once it is set
+    const bool retired = ring->retired.load(memory_order_acquire);
+    if (!ring->empty()) {
+      const size_t position = ring->peek([this](const LogRing::Record &record) {
+        // Timestamps are formatted once per second. JSON takes RFC 3339 in
+        // UTC, the common log format local time with its offset
+        if (record.time != this->timestamp_time) {
+          const bool json = this->format == Format::JSON;
+          tm time{};
+          if (json)
+            gmtime_r(&record.time, &time);
+          else
+            localtime_r(&record.time, &time);
+          char formatted[64];
+          this->timestamp.assign(
+              formatted, strftime(formatted, sizeof(formatted),
+                                  json ? "%Y-%m-%dT%H:%M:%SZ"
+                                       : "%d/%b/%Y:%H:%M:%S %z",
+                                  &time));
+          this->timestamp_time = record.time;
+        }
+        append(record.text);
+      });
+      ring->release(position);
+      drained = true;
+    }
+    retiring |= retired && ring->empty();
+  }
+  flush_batch();
+
+  // Free the rings of finished writers once they are empty
+  if (retiring) {
+    const lock_guard guard(this->lock);
+    erase_if(this->rings, [this](const unique_ptr<LogRing> &ring) {
+      if (!ring->retired.load(memory_order_acquire) || !ring->empty())
+        return false;
+      this->retired_dropped.fetch_add(ring->dropped.load(memory_order_relaxed),
+                                      memory_order_relaxed);
+      return true;
+    });
+  }
+  return drained;
+}
+
+void AccessLog::append(const string_view serialized) {
+  Packed packed;
+  memcpy(&packed, serialized.data(), sizeof(packed));
+  string_view strings[4];
+  size_t offset = sizeof(packed);
+  for (size_t i = 0; i < 4; i++) {
+    strings[i] = serialized.substr(offset, packed.lengths[i]);
+    offset += packed.lengths[i];
+  }
+  const auto &[target, version, referer, user_agent] = strings;
+
+  char address[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &packed.address, address, sizeof(address));
+  const auto found =
+      http::METHOD_MAP.find(static_cast<http::Method>(packed.method));
+  const string_view method =
+      found != http::METHOD_MAP.end() ? string_view(found->second) : "-";
+  string &out = this->batch;
+
+  if (this->format == Format::JSON) {
+    format_to(back_inserter(out),
+              R"({{"time":"{}","client":"{}","method":"{}","target":)",
+              this->timestamp, address, method);
+    append_json(out, target);
+    out += R"(,"protocol":)";
+    append_json(out, version);
+    format_to(back_inserter(out), R"(,"status":{},"bytes":{},"referer":)",
+              packed.status, packed.bytes);
+    append_json(out, referer);
+    out += R"(,"user_agent":)";
+    append_json(out, user_agent);
+    format_to(back_inserter(out),
+              R"(,"parse_us":{},"cache_us":{},"first_byte_us":{},)"
+              R"("last_byte_us":{}}})"
+              "\n",
+              packed.parsed, packed.cache_lookup, packed.first_byte,
+              packed.last_byte);
+  } else {
+    // Combined Log Format, with the timings appended
+    format_to(back_inserter(out), "{} - - [{}] \"{} ", address,
+              this->timestamp, method);
+    append_escaped(out, target);
+    out += ' ';
+    append_escaped(out, version);
+    out += "\" ";
+    if (packed.bytes == 0)
+      format_to(back_inserter(out), "{} - \"", packed.status);
+    else
+      format_to(back_inserter(out), "{} {} \"", packed.status, packed.bytes);
+    append_escaped(out, referer.empty() ? "-" : referer);
+    out += "\" \"";
+    append_escaped(out, user_agent.empty() ? "-" : user_agent);
+    format_to(back_inserter(out),
+              "\" parse_us={} cache_us={} first_byte_us={} last_byte_us={}\n",
+              packed.parsed, packed.cache_lookup, packed.first_byte,
+              packed.last_byte);
+  }
+
+  if (out.size() >= BATCH_SIZE)
+    flush_batch();
+}
+
+void AccessLog::flush_batch() {
+  if (this->batch.empty())
+    return;
+  if (this->file != -1) {
+    string_view pending = this->batch;
+    while (!pending.empty()) {
+      const ssize_t written =
+          ::write(this->file, pending.data(), pending.size());
+      if (written == -1) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+      pending.remove_prefix(written);
+      this->file_size += written;
+    }
+    if (this->file_size >= this->max_size)
+      rotate();
+  }
+  this->batch.clear();
+}
+
+void AccessLog::open_file() {
+  this->file = open(this->path.c_str(),
+                    O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (this->file == -1) {
+    Logger::LOG_ERROR("Cannot open access log " + this->path + ": " +
+                      strerror(errno));
+    return;
+  }
+  struct stat file_stat{};
+  fstat(this->file, &file_stat);
+  this->file_size = file_stat.st_size;
+}
+
+void AccessLog::rotate() {
+  close(this->file);
+  // path.1 is the newest rotated file, the oldest is overwritten
+  for (size_t i = this->max_files; i > 1; i--) {
+    rename(std::format("{}.{}", this->path, i - 1).c_str(),
+           std::format("{}.{}", this->path, i).c_str());
+  }
+  rename(this->path.c_str(), (this->path + ".1").c_str());
+  this->open_file();
+}
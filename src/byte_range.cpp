@@ -0,0 +1,99 @@
+#include "byte_range.h"
+
+#include "http_constants.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+
+namespace http {
+
+static std::string_view trim(std::string_view value) {
+  while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+    value.remove_prefix(1);
+  while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+    value.remove_suffix(1);
+  return value;
+}
+
+// Whole digits only, "" and values that overflow are refused
+static bool parse_position(const std::string_view text, size_t &value) {
+  if (text.empty())
+    return false;
+  const auto [end, error] =
+      std::from_chars(text.data(), text.data() + text.size(), value);
+  return error == std::errc() && end == text.data() + text.size();
+}
+
+RangeResult parse_ranges(std::string_view header, const size_t size,
+                         std::vector<ByteRange> &ranges) {
+  ranges.clear();
+  constexpr std::string_view unit = "bytes=";
+  if (header.size() < unit.size() ||
+      !equals_ignore_case(header.substr(0, unit.size()), unit))
+    return RangeResult::IGNORED;
+  header.remove_prefix(unit.size());
+
+  bool valid = false;
+  while (!header.empty()) {
+    const size_t comma = header.find(',');
+    const std::string_view element = trim(header.substr(0, comma));
+    header = comma == std::string_view::npos ? std::string_view()
+                                             : header.substr(comma + 1);
+    // Empty elements are allowed in a list
+    if (element.empty())
+      continue;
+    const size_t dash = element.find('-');
+    if (dash == std::string_view::npos)
+      return RangeResult::IGNORED;
+
+    size_t first;
+    size_t last;
+    if (dash == 0) {
+      // Suffix range, the last bytes of the representation
+      size_t suffix;
+      if (!parse_position(element.substr(1), suffix))
+        return RangeResult::IGNORED;
+      valid = true;
+      if (suffix == 0 || size == 0)
+        continue;
+      first = size - std::min(suffix, size);
+      last = size - 1;
+    } else {
+      if (!parse_position(element.substr(0, dash), first))
+        return RangeResult::IGNORED;
+      // Without a last position the range runs to the end
+      last = SIZE_MAX;
+      if (dash + 1 < element.size() &&
+          (!parse_position(element.substr(dash + 1), last) || last < first))
+        return RangeResult::IGNORED;
+      valid = true;
+      if (first >= size)
+        continue;
+      last = std::min(last, size - 1);
+    }
+    // Many tiny ranges cost more than the whole file, refuse them early
+    if (ranges.size() == MAX_BYTE_RANGES * 4)
+      return RangeResult::IGNORED;
+    ranges.push_back({first, last});
+  }
+  if (!valid)
+    return RangeResult::IGNORED;
+  if (ranges.empty())
+    return RangeResult::UNSATISFIABLE;
+
+  // Overlapping ranges would send the same bytes again
+  std::ranges::sort(ranges, {}, &ByteRange::first);
+  size_t merged = 0;
+  for (size_t i = 1; i < ranges.size(); i++) {
+    if (ranges[i].first <= ranges[merged].last + 1)
+      ranges[merged].last = std::max(ranges[merged].last, ranges[i].last);
+    else
+      ranges[++merged] = ranges[i];
+  }
+  ranges.resize(merged + 1);
+  return ranges.size() <= MAX_BYTE_RANGES ? RangeResult::SATISFIABLE
+                                          : RangeResult::IGNORED;
+}
+
+} // namespace http
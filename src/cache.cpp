@@ -4,109 +4,537 @@
 
 #include "cache.h"
 #include "logger.h"
+#include <algorithm>
+#include <cerrno>
 #include <cstring>
 #include <file.h>
+#include <sys/mman.h>
 
-Cache::Cache(const size_t max_size) {
-  this->cache_buffer = new char[max_size];
+// Assumed average file size when sizing the frequency sketch
+static constexpr size_t AVERAGE_FILE_SIZE = 4096;
+// Separates a path from the variant name in a variant key, paths can't
+// contain line feeds
+static constexpr char VARIANT_SEPARATOR = '\n';
+
+Cache::Cache(const size_t max_size, const size_t shard_count,
+             const CacheStorage storage) {
   this->max_size = max_size;
-  this->current_cache_size = 0;
-  this->lru_queue = list<string>();
+  if (storage == CacheStorage::COPY) {
+    this->storage = make_shared<SlabAllocator>(max_size);
+  }
+  // Fewer, larger shards when the cache is small, so the largest file it
+  // takes doesn't shrink with the number of workers
+  const size_t count =
+      clamp<size_t>(max_size / MIN_SHARD_SIZE, 1, max<size_t>(shard_count, 1));
+  for (size_t i = 0; i < count; i++) {
+    this->shards.push_back(make_unique<Shard>(max_size / count, this->storage));
+  }
   Logger::LOG_DEBUG("Cache initialized with size: " + std::to_string(max_size) +
-                    " bytes");
+                    " bytes in " + std::to_string(this->shards.size()) +
+                    " shards");
 }
 
 Cache::~Cache() {
-  delete[] this->cache_buffer;
   Logger::LOG_DEBUG("Cache destroyed");
 }
 
-void Cache::set(const string &path, const File &file) {
-  // Check if the file is already in the cache
-  if (this->cache_map.contains(path)) {
+Cache::Shard &Cache::shard_of(const uint64_t hash) const {
+  return *this->shards[hash % this->shards.size()];
+}
+
+uint64_t Cache::hash_of(const string &key) {
+  const string_view path =
+      string_view(key).substr(0, key.find(VARIANT_SEPARATOR));
+  return std::hash<string_view>{}(path);
+}
+
+string Cache::variant_key(const string &path, const string_view variant) {
+  string key = path;
+  key += VARIANT_SEPARATOR;
+  key += variant;
+  return key;
+}
+
+CacheHandle Cache::set(const string &path, const File &file,
+                       CachedHeads heads, const uint64_t generation,
+                       const bool encodable) {
+  const uint64_t hash = hash_of(path);
+  return this->shard_of(hash).set(path, hash, {&file, {}, encodable},
+                                  std::move(heads), generation);
+}
+
+CacheHandle Cache::set(const string &path, const string_view data,
+                       CachedHeads heads, const uint64_t generation) {
+  const uint64_t hash = hash_of(path);
+  return this->shard_of(hash).set(path, hash, {nullptr, data, false},
+                                  std::move(heads), generation);
+}
+
+CacheHandle Cache::get(const string &path) {
+  return this->get_first(span(&path, 1));
+}
+
+CacheHandle Cache::get_first(const span<const string> keys) {
+  const uint64_t hash = hash_of(keys.front());
+  CacheHandle cached = this->shard_of(hash).get(keys, hash);
+  if (cached) {
+    Logger::LOG_DEBUG("CACHE_HIT: " + keys.front());
+  }
+  return cached;
+}
+
+bool Cache::contains(const string &path) const {
+  return this->shard_of(hash_of(path)).contains(path);
+}
+
+void Cache::invalidate(const string &path, const bool subtree) {
+  if (!subtree) {
+    this->shard_of(hash_of(path)).invalidate(path, false);
     return;
   }
+  for (const auto &shard : this->shards) {
+    shard->invalidate(path, true);
+  }
+}
+
+uint64_t Cache::generation(const string &path) const {
+  return this->shard_of(hash_of(path)).get_generation();
+}
+
+size_t Cache::get_max_size() const { return this->max_size; }
+
+size_t Cache::get_max_entry_size() const {
+  return this->shards.front()->max_entry_size();
+}
+
+Cache::Stats Cache::stats() const {
+  Stats stats;
+  for (const auto &shard : this->shards) {
+    shard->add_stats(stats);
+  }
+  if (this->storage) {
+    stats.storage = this->storage->stats();
+  }
+  return stats;
+}
 
-  // Get the size of the file
-  const size_t file_size = file.size();
+Cache::Shard::Shard(const size_t max_size, shared_ptr<SlabAllocator> storage)
+    : sketch(max_size / AVERAGE_FILE_SIZE) {
+  this->max_size = max_size;
+  this->window_capacity = max_size / 100;
+  this->protected_capacity = (max_size - this->window_capacity) * 8 / 10;
+  this->storage = std::move(storage);
+}
+
+// Files up to this size are read ahead as a whole when mapped
+static constexpr size_t READ_AHEAD_SIZE = 256 * 1024;
 
-  // Check if there is enough space in the cache
-  if (this->current_cache_size + file_size > this->max_size) {
-    this->evict();
+static bool read_file(const CachedFile &cached, const File &file) {
+  off_t offset = 0;
+  for (const string_view block : cached.data) {
+    for (size_t filled = 0; filled < block.size();) {
+      const ssize_t bytes_read =
+          file.read_at(const_cast<char *>(block.data()) + filled,
+                       block.size() - filled, offset + filled);
+      if (bytes_read <= 0) {
+        return false;
+      }
+      filled += bytes_read;
+    }
+    offset += static_cast<off_t>(block.size());
   }
+  return true;
+}
 
-  // Buffer position pointer
-  char *buffer_pos = this->cache_buffer + this->current_cache_size;
-  // Read the file into the cache buffer
-  file.read(buffer_pos);
+static void fill(CachedFile &cached, string_view data) {
+  if (cached.data.empty()) {
+    // Mapped storage, the cache keeps its own copy
+    cached.owned = data;
+    cached.data.emplace_back(cached.owned);
+    cached.size = data.size();
+    return;
+  }
+  for (const string_view block : cached.data) {
+    memcpy(const_cast<char *>(block.data()), data.data(), block.size());
+    data.remove_prefix(block.size());
+  }
+}
 
-  // Store the file in the cache map
-  this->cache_map[path] =
-      make_pair(this->cache_buffer + this->current_cache_size, file_size);
-  this->current_cache_size += file_size;
+static bool map_file(CachedFile &cached, const File &file) {
+  const size_t size = file.size();
+  void *data =
+      mmap(nullptr, size, PROT_READ, MAP_SHARED, file.descriptor(), 0);
+  if (data == MAP_FAILED) {
+    Logger::LOG_WARNING("Failed to map file: " + string(strerror(errno)));
+    return false;
+  }
+  // Small files are fetched at once, large media is read on in order
+  madvise(data, size,
+          size <= READ_AHEAD_SIZE ? MADV_WILLNEED : MADV_SEQUENTIAL);
+  cached.mapping = data;
+  cached.data.emplace_back(static_cast<const char *>(data), size);
+  cached.size = size;
+  return true;
 }
 
-pair<char *, size_t> Cache::get(const string &path) {
-  Logger::LOG_DEBUG("CACHE_HIT: " + path);
-  // Remove the file from the LRU queue
-  this->lru_queue.remove(path);
+size_t Cache::Shard::Source::size() const {
+  return this->file ? this->file->size() : this->data.size();
+}
 
-  // Check if the file is in the cache map
-  if (const auto it = this->cache_map.find(path); it != this->cache_map.end()) {
-    // Move the file to the front of the queue
-    this->lru_queue.emplace_back(path);
-    return it->second;
+CacheHandle Cache::Shard::set(const string &path, const uint64_t hash,
+                              const Source &source, CachedHeads heads,
+                              const uint64_t generation) {
+  const size_t file_size = source.size();
+  const auto cached = make_shared<CachedFile>(this->storage);
+  cached->heads = std::move(heads);
+  cached->encodable = source.encodable;
+  {
+    const lock_guard guard(this->lock);
+    // Content opened before an invalidation may be stale
+    if (generation != this->generation) {
+      return nullptr;
+    }
+    // Check if the file is already in the cache
+    if (const auto it = this->cache_map.find(path);
+        it != this->cache_map.end()) {
+      return it->second.file;
+    }
+    if (!this->reserve(file_size, hash)) {
+      return nullptr;
+    }
+    // Blocks of the file, the last one sized to the remainder
+    for (size_t offset = 0; this->storage && offset < file_size;
+         offset += SlabAllocator::SEGMENT_SIZE) {
+      const size_t size = min(file_size - offset, SlabAllocator::SEGMENT_SIZE);
+      char *block = this->storage->allocate(size);
+      if (block == nullptr) {
+        this->release(file_size);
+        return nullptr;
+      }
+      cached->data.emplace_back(block, size);
+      cached->size += size;
+    }
+  }
+
+  // Fill the entry without holding up lookups of the shard
+  if (!source.file) {
+    fill(*cached, source.data);
+  } else if (this->storage ? !read_file(*cached, *source.file)
+                           : !map_file(*cached, *source.file)) {
+    const lock_guard guard(this->lock);
+    this->release(file_size);
+    return nullptr;
+  }
+
+  // Store the file in the cache map, unless another thread was faster or
+  // the path changed meanwhile
+  const lock_guard guard(this->lock);
+  this->release(file_size);
+  if (generation != this->generation) {
+    return nullptr;
+  }
+  const auto [it, inserted] = this->cache_map.try_emplace(path);
+  Entry &entry = it->second;
+  if (!inserted) {
+    return entry.file;
+  }
+  entry.file = cached;
+  entry.path = &it->first;
+  entry.hash = hash;
+  entry.region = file_size <= this->window_capacity ? Region::WINDOW
+                                                    : Region::PROBATION;
+  if (const size_t separator = path.find(VARIANT_SEPARATOR);
+      separator != string::npos &&
+      ranges::find(this->variant_names, path.substr(separator + 1)) ==
+          this->variant_names.end()) {
+    this->variant_names.push_back(path.substr(separator + 1));
+  }
+  this->list_of(entry.region).push_front(&entry);
+  this->current_size += file_size;
+  if (cached->mapping == nullptr) {
+    this->bytes_copied += file_size;
+  }
+  return cached;
+}
+
+bool Cache::Shard::reserve(const size_t size, const uint64_t hash) {
+  if (size > this->max_size) {
+    return false;
+  }
+  if (size <= this->window_capacity) {
+    // New files start in the window, its oldest ones compete for the main
+    // space in turn
+    while (this->window.size + this->reserved_window + size >
+               this->window_capacity &&
+           this->window.tail != nullptr) {
+      this->admit_from_window();
+    }
+    // Still full of files being filled by other threads
+    if (this->reserved_window + size > this->window_capacity) {
+      return false;
+    }
+  } else if (!this->make_room(size, this->sketch.frequency(hash))) {
+    // Too large for the window, the file competes for the main space at once
+    this->rejections++;
+    return false;
+  }
+  // Evicted entries still pinned keep their blocks, and the storage is
+  // shared, so it may need more room than the policy made
+  while (!this->fits(size) && this->evict_any()) {
+  }
+  if (!this->fits(size)) {
+    return false;
   }
+  (size <= this->window_capacity ? this->reserved_window
+                                 : this->reserved_main) += size;
+  return true;
+}
+
+void Cache::Shard::release(const size_t size) {
+  (size <= this->window_capacity ? this->reserved_window
+                                 : this->reserved_main) -= size;
+}
 
+CacheHandle Cache::Shard::get(const span<const string> keys,
+                              const uint64_t hash) {
+  const lock_guard guard(this->lock);
+  this->sketch.record(hash);
+
+  // Check if the file is in the cache map, under any of the keys
+  for (const string &key : keys) {
+    if (const auto it = this->cache_map.find(key);
+        it != this->cache_map.end()) {
+      this->hits++;
+      this->touch(it->second);
+      return it->second.file;
+    }
+  }
   // File not found in cache
-  return make_pair(nullptr, 0);
+  this->misses++;
+  return nullptr;
 }
 
-bool Cache::contains(const string &path) const {
+bool Cache::Shard::contains(const string &path) const {
+  const lock_guard guard(this->lock);
   // Check if the file is in the cache map
   return this->cache_map.contains(path);
 }
 
-void Cache::evict() {
-  // if the cache is empty, do nothing
-  if (this->lru_queue.empty()) {
+void Cache::Shard::invalidate(const string &path, const bool subtree) {
+  const lock_guard guard(this->lock);
+  this->generation++;
+  if (!subtree) {
+    const auto erase = [this](const string &key) {
+      if (const auto it = this->cache_map.find(key);
+          it != this->cache_map.end()) {
+        this->remove(it->second);
+      }
+    };
+    erase(path);
+    for (const string &variant : this->variant_names) {
+      erase(variant_key(path, variant));
+    }
     return;
   }
-  // Get the path of the least recently used file
-  const string oldest_path = this->lru_queue.front();
-
-  // Evict the least recently used file from the cache
-  if (const auto it = this->cache_map.find(oldest_path);
-      it != this->cache_map.end()) {
-    // Get the file data and size
-    char *remove_start = it->second.first;
-    const size_t remove_size = it->second.second;
-
-    // Move the remaining data in the cache buffer
-    char *move_dest = remove_start;
-    const char *move_src = remove_start + remove_size;
-    if (const size_t move_size =
-            this->current_cache_size - (move_src - this->cache_buffer);
-        move_size > 0) {
-      memmove(move_dest, move_src, move_size);
-
-      // Update the cache map with the new positions
-      for (auto &[fst, snd] : this->cache_map) {
-        // Update the positions of the remaining files after the evicted file
-        if (snd.first > remove_start) {
-          snd.first -= remove_size;
-        }
-      }
+  const string prefix = path + "/";
+  for (auto it = this->cache_map.begin(); it != this->cache_map.end();) {
+    Entry &entry = (it++)->second;
+    if (entry.path->starts_with(prefix)) {
+      this->remove(entry);
     }
-    // Update cache size
-    this->current_cache_size -= it->second.second;
-    // Remove the file from the cache map
-    this->cache_map.erase(it);
-    // Remove the file from the LRU queue
-    this->lru_queue.pop_front();
+  }
+}
+
+size_t Cache::Shard::max_entry_size() const {
+  return this->max_size - this->window_capacity;
+}
+
+uint64_t Cache::Shard::get_generation() const {
+  const lock_guard guard(this->lock);
+  return this->generation;
+}
 
-    Logger::LOG_DEBUG("CACHE_EVICTED: " + oldest_path);
+void Cache::Shard::add_stats(Stats &stats) const {
+  const lock_guard guard(this->lock);
+  stats.entries += this->cache_map.size();
+  stats.size += this->current_size;
+  stats.hits += this->hits;
+  stats.misses += this->misses;
+  stats.evictions += this->evictions;
+  stats.rejections += this->rejections;
+  stats.bytes_copied += this->bytes_copied;
+}
+
+Cache::Shard::LruList &Cache::Shard::list_of(const Region region) {
+  switch (region) {
+  case Region::WINDOW:
+    return this->window;
+  case Region::PROBATION:
+    return this->probation;
+  default:
+    return this->protected_list;
   }
 }
 
-size_t Cache::get_max_size() const { return this->max_size; }
+void Cache::Shard::touch(Entry &entry) {
+  LruList &list = this->list_of(entry.region);
+  list.remove(&entry);
+  if (entry.region != Region::PROBATION) {
+    list.push_front(&entry);
+    return;
+  }
+
+  // Requested again while on probation, protect it and demote the oldest
+  // protected files in exchange
+  entry.region = Region::PROTECTED;
+  this->protected_list.push_front(&entry);
+  while (this->protected_list.size > this->protected_capacity &&
+         this->protected_list.tail != &entry) {
+    Entry *demoted = this->protected_list.tail;
+    this->protected_list.remove(demoted);
+    demoted->region = Region::PROBATION;
+    this->probation.push_front(demoted);
+  }
+}
+
+void Cache::Shard::admit_from_window() {
+  Entry &candidate = *this->window.tail;
+  if (!this->make_room(candidate.file->size,
+                       this->sketch.frequency(candidate.hash))) {
+    this->rejections++;
+    this->evict(candidate);
+    return;
+  }
+  this->window.remove(&candidate);
+  candidate.region = Region::PROBATION;
+  this->probation.push_front(&candidate);
+}
+
+bool Cache::Shard::make_room(const size_t size, const uint8_t frequency) {
+  const size_t main_capacity = this->max_size - this->window_capacity;
+  const size_t main_size =
+      this->probation.size + this->protected_list.size + this->reserved_main;
+  if (main_size + size <= main_capacity) {
+    return true;
+  }
+  if (size > main_capacity) {
+    return false;
+  }
+
+  // The candidate must be more frequent than every victim, the oldest files
+  // on probation come first, then the oldest protected ones
+  const size_t needed = main_size + size - main_capacity;
+  size_t freed = 0;
+  Entry *last = nullptr;
+  for (Entry *victim = this->probation.tail != nullptr
+                           ? this->probation.tail
+                           : this->protected_list.tail;
+       freed < needed && victim != nullptr;) {
+    if (frequency <= this->sketch.frequency(victim->hash)) {
+      return false;
+    }
+    freed += victim->file->size;
+    last = victim;
+    if (victim->previous != nullptr) {
+      victim = victim->previous;
+    } else {
+      victim = victim->region == Region::PROBATION ? this->protected_list.tail
+                                                   : nullptr;
+    }
+  }
+  // Not even evicting everything makes room next to the files being filled
+  if (freed < needed) {
+    return false;
+  }
+
+  // Evict the victims, oldest first, up to the last one checked
+  while (true) {
+    Entry &victim = this->probation.tail != nullptr
+                        ? *this->probation.tail
+                        : *this->protected_list.tail;
+    const bool done = &victim == last;
+    this->evict(victim);
+    if (done) {
+      return true;
+    }
+  }
+}
+
+bool Cache::Shard::fits(const size_t size) const {
+  // Mappings are only limited by the policy's budget
+  if (!this->storage) {
+    return true;
+  }
+  // Whole segments for the bulk of the file, then a block for the remainder
+  size_t segments = size / SlabAllocator::SEGMENT_SIZE;
+  if (const size_t remainder = size % SlabAllocator::SEGMENT_SIZE;
+      remainder > 0) {
+    segments += this->storage->segments_needed(remainder);
+  }
+  return segments <= this->storage->free_segments();
+}
+
+bool Cache::Shard::evict_any() {
+  for (const LruList *list :
+       {&this->probation, &this->window, &this->protected_list}) {
+    if (list->tail != nullptr) {
+      this->evict(*list->tail);
+      return true;
+    }
+  }
+  return false;
+}
+
+void Cache::Shard::evict(Entry &entry) {
+  this->evictions++;
+  Logger::LOG_DEBUG("CACHE_EVICTED: " + *entry.path);
+  this->remove(entry);
+}
+
+void Cache::Shard::remove(Entry &entry) {
+  this->list_of(entry.region).remove(&entry);
+  // Update cache size, the blocks are freed once no response holds them
+  this->current_size -= entry.file->size;
+  this->cache_map.erase(this->cache_map.find(*entry.path));
+}
+
+void Cache::Shard::LruList::push_front(Entry *entry) {
+  entry->previous = nullptr;
+  entry->next = this->head;
+  if (this->head != nullptr) {
+    this->head->previous = entry;
+  } else {
+    this->tail = entry;
+  }
+  this->head = entry;
+  this->size += entry->file->size;
+}
+
+void Cache::Shard::LruList::remove(Entry *entry) {
+  if (entry->previous != nullptr) {
+    entry->previous->next = entry->next;
+  } else {
+    this->head = entry->next;
+  }
+  if (entry->next != nullptr) {
+    entry->next->previous = entry->previous;
+  } else {
+    this->tail = entry->previous;
+  }
+  entry->previous = entry->next = nullptr;
+  this->size -= entry->file->size;
+}
+
+CachedFile::~CachedFile() {
+  if (this->mapping != nullptr) {
+    munmap(this->mapping, this->size);
+    return;
+  }
+  // Generated variants of mapped files own their bytes
+  if (!this->storage) {
+    return;
+  }
+  for (const string_view block : this->data) {
+    this->storage->release(const_cast<char *>(block.data()), block.size());
+  }
+}
@@ -0,0 +1,168 @@
+#include "content_coding.h"
+
+#include "http_constants.h"
+
+#include <charconv>
+
+#ifdef WEBSERVER_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef WEBSERVER_HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+namespace http {
+
+static std::string_view trim(std::string_view value) {
+  while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+    value.remove_prefix(1);
+  while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+    value.remove_suffix(1);
+  return value;
+}
+
+std::string_view coding_name(const ContentCoding coding) {
+  switch (coding) {
+  case ContentCoding::GZIP:
+    return "gzip";
+  case ContentCoding::BROTLI:
+    return "br";
+  default:
+    return "identity";
+  }
+}
+
+std::string_view sidecar_extension(const ContentCoding coding) {
+  switch (coding) {
+  case ContentCoding::GZIP:
+    return ".gz";
+  case ContentCoding::BROTLI:
+    return ".br";
+  default:
+    return "";
+  }
+}
+
+double coding_quality(std::string_view accept_encoding,
+                      const ContentCoding coding) {
+  const std::string_view name = coding_name(coding);
+  double quality = -1;
+  double wildcard = -1;
+  while (!accept_encoding.empty()) {
+    // Elements look like "gzip;q=0.8"
+    const size_t comma = accept_encoding.find(',');
+    std::string_view element = accept_encoding.substr(0, comma);
+    accept_encoding = comma == std::string_view::npos
+                          ? std::string_view()
+                          : accept_encoding.substr(comma + 1);
+
+    double value = 1;
+    if (const size_t semicolon = element.find(';');
+        semicolon != std::string_view::npos) {
+      std::string_view parameter = trim(element.substr(semicolon + 1));
+      if (parameter.size() > 2 && (parameter[0] == 'q' || parameter[0] == 'Q') &&
+          parameter[1] == '=') {
+        parameter.remove_prefix(2);
+        std::from_chars(parameter.data(), parameter.data() + parameter.size(),
+                        value);
+      }
+      element = element.substr(0, semicolon);
+    }
+    element = trim(element);
+    if (equals_ignore_case(element, name) ||
+        (coding == ContentCoding::GZIP &&
+         equals_ignore_case(element, "x-gzip")))
+      quality = value;
+    else if (element == "*")
+      wildcard = value;
+  }
+
+  if (quality >= 0)
+    return quality;
+  if (wildcard >= 0)
+    return wildcard;
+  return coding == ContentCoding::IDENTITY ? 1 : 0;
+}
+
+bool is_compressible(const std::string_view mime_type) {
+  return mime_type.starts_with("text/") || mime_type == "application/json" ||
+         mime_type == "application/javascript" ||
+         mime_type == "application/xml" || mime_type == "image/svg+xml";
+}
+
+std::size_t preferred_codings(const std::string_view accept_encoding,
+                              std::array<ContentCoding, 2> &codings) {
+  if (accept_encoding.empty())
+    return 0;
+  const double brotli = coding_quality(accept_encoding, ContentCoding::BROTLI);
+  const double gzip = coding_quality(accept_encoding, ContentCoding::GZIP);
+  std::size_t count = 0;
+  if (brotli > 0 && brotli >= gzip)
+    codings[count++] = ContentCoding::BROTLI;
+  if (gzip > 0)
+    codings[count++] = ContentCoding::GZIP;
+  if (brotli > 0 && brotli < gzip)
+    codings[count++] = ContentCoding::BROTLI;
+  return count;
+}
+
+bool can_compress(const ContentCoding coding) {
+  switch (coding) {
+#ifdef WEBSERVER_HAVE_ZLIB
+  case ContentCoding::GZIP:
+    return true;
+#endif
+#ifdef WEBSERVER_HAVE_BROTLI
+  case ContentCoding::BROTLI:
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+bool compress(const ContentCoding coding,
+              [[maybe_unused]] const std::string_view data,
+              [[maybe_unused]] std::string &out) {
+  switch (coding) {
+#ifdef WEBSERVER_HAVE_ZLIB
+  case ContentCoding::GZIP: {
+    z_stream stream{};
+    // 16 added to the window bits writes a gzip header and trailer. Level 6
+    // is zlib's default, higher ones take much longer for little gain
+    if (deflateInit2(&stream, 6, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+      return false;
+    out.resize(deflateBound(&stream, data.size()));
+    stream.next_in =
+        reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    stream.avail_in = static_cast<uInt>(data.size());
+    stream.next_out = reinterpret_cast<Bytef *>(out.data());
+    stream.avail_out = static_cast<uInt>(out.size());
+    const int result = deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    return result == Z_STREAM_END;
+  }
+#endif
+#ifdef WEBSERVER_HAVE_BROTLI
+  case ContentCoding::BROTLI: {
+    size_t size = BrotliEncoderMaxCompressedSize(data.size());
+    out.resize(size);
+    // Quality 5 compresses better than gzip in about the same time, the
+    // event loop waits for it
+    if (!BrotliEncoderCompress(5, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                               data.size(),
+                               reinterpret_cast<const uint8_t *>(data.data()),
+                               &size, reinterpret_cast<uint8_t *>(out.data())))
+      return false;
+    out.resize(size);
+    return true;
+  }
+#endif
+  default:
+    return false;
+  }
+}
+
+} // namespace http
@@ -0,0 +1,165 @@
+#include "delimiter_scanner.h"
+
+#include <cstring>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WEBSERVER_SCANNER_X86
+#endif
+
+using ScanFunction = size_t (*)(const char *, size_t, size_t, uint64_t *,
+                                uint64_t *);
+
+// Whether any byte of word equals byte (SWAR, no false positives)
+static bool has_byte(const uint64_t word, const char byte) {
+  constexpr uint64_t ones = 0x0101010101010101ULL;
+  const uint64_t x = word ^ (ones * static_cast<unsigned char>(byte));
+  return ((x - ones) & ~x & (ones << 7)) != 0;
+}
+
+/**
+ * Mark the delimiters of the bytes in [begin, end) that fit in whole 64-byte
+ * words
+ * @return Position of the first byte not scanned
+ */
+static size_t scan_scalar(const char *data, size_t begin, const size_t end,
+                          uint64_t *line_feeds, uint64_t *separators) {
+  for (; begin + 64 <= end; begin += 64) {
+    uint64_t line_feed_bits = 0;
+    uint64_t separator_bits = 0;
+    // Test eight bytes at a time, delimiters are sparse
+    for (size_t i = 0; i < 64; i += 8) {
+      uint64_t word;
+      memcpy(&word, data + begin + i, sizeof(word));
+      if (!has_byte(word, '\n') && !has_byte(word, ':') &&
+          !has_byte(word, '?'))
+        continue;
+      for (size_t j = i; j < i + 8; j++) {
+        const char c = data[begin + j];
+        if (c == '\n')
+          line_feed_bits |= uint64_t{1} << j;
+        else if (c == ':' || c == '?')
+          separator_bits |= uint64_t{1} << j;
+      }
+    }
+    line_feeds[begin / 64] = line_feed_bits;
+    separators[begin / 64] = separator_bits;
+  }
+  return begin;
+}
+
+#ifdef WEBSERVER_SCANNER_X86
+__attribute__((target("sse2"))) static size_t
+scan_sse2(const char *data, size_t begin, const size_t end,
+          uint64_t *line_feeds, uint64_t *separators) {
+  const __m128i line_feed = _mm_set1_epi8('\n');
+  const __m128i colon = _mm_set1_epi8(':');
+  const __m128i question = _mm_set1_epi8('?');
+  for (; begin + 64 <= end; begin += 64) {
+    uint64_t line_feed_bits = 0;
+    uint64_t separator_bits = 0;
+    for (size_t i = 0; i < 64; i += 16) {
+      const __m128i block =
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + begin + i));
+      const auto line_feed_mask = static_cast<uint16_t>(
+          _mm_movemask_epi8(_mm_cmpeq_epi8(block, line_feed)));
+      const auto separator_mask = static_cast<uint16_t>(_mm_movemask_epi8(
+          _mm_or_si128(_mm_cmpeq_epi8(block, colon),
+                       _mm_cmpeq_epi8(block, question))));
+      line_feed_bits |= static_cast<uint64_t>(line_feed_mask) << i;
+      separator_bits |= static_cast<uint64_t>(separator_mask) << i;
+    }
+    line_feeds[begin / 64] = line_feed_bits;
+    separators[begin / 64] = separator_bits;
+  }
+  return begin;
+}
+
+__attribute__((target("avx2"))) static uint64_t
+match_avx2(const __m256i block, const __m256i value) {
+  return static_cast<uint32_t>(
+      _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, value)));
+}
+
+__attribute__((target("avx2"))) static size_t
+scan_avx2(const char *data, size_t begin, const size_t end,
+          uint64_t *line_feeds, uint64_t *separators) {
+  const __m256i line_feed = _mm256_set1_epi8('\n');
+  const __m256i colon = _mm256_set1_epi8(':');
+  const __m256i question = _mm256_set1_epi8('?');
+  for (; begin + 64 <= end; begin += 64) {
+    const __m256i low =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + begin));
+    const __m256i high = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(data + begin + 32));
+    line_feeds[begin / 64] =
+        match_avx2(low, line_feed) | match_avx2(high, line_feed) << 32;
+    separators[begin / 64] =
+        match_avx2(low, colon) | match_avx2(low, question) |
+        (match_avx2(high, colon) | match_avx2(high, question)) << 32;
+  }
+  return begin;
+}
+#endif
+
+struct Implementation {
+  ScanFunction scan;
+  const char *name;
+};
+
+static Implementation select_implementation() {
+#ifdef WEBSERVER_SCANNER_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return {scan_avx2, "avx2"};
+  if (__builtin_cpu_supports("sse2"))
+    return {scan_sse2, "sse2"};
+#endif
+  return {scan_scalar, "scalar"};
+}
+
+static const Implementation &selected() {
+  static const Implementation implementation = select_implementation();
+  return implementation;
+}
+
+void DelimiterScanner::scan(const char *data, const size_t begin,
+                            const size_t end, vector<uint64_t> &line_feeds,
+                            vector<uint64_t> &separators) {
+  const size_t words = (end + 63) / 64;
+  line_feeds.resize(words);
+  separators.resize(words);
+
+  size_t position = selected().scan(data, begin, end, line_feeds.data(),
+                                    separators.data());
+  // Partial last word, rescanned whole once more bytes arrive
+  if (position < end) {
+    uint64_t line_feed_bits = 0;
+    uint64_t separator_bits = 0;
+    for (size_t i = 0; position + i < end; i++) {
+      const char c = data[position + i];
+      line_feed_bits |= static_cast<uint64_t>(c == '\n') << i;
+      separator_bits |= static_cast<uint64_t>(c == ':' || c == '?') << i;
+    }
+    line_feeds[position / 64] = line_feed_bits;
+    separators[position / 64] = separator_bits;
+  }
+}
+
+size_t DelimiterScanner::find(const vector<uint64_t> &bits, const size_t from,
+                              const size_t to) {
+  if (from >= to)
+    return string::npos;
+  size_t word = from / 64;
+  uint64_t mask = bits[word] & (~0ULL << (from % 64));
+  while (mask == 0) {
+    if (++word * 64 >= to)
+      return string::npos;
+    mask = bits[word];
+  }
+  const size_t position = word * 64 + __builtin_ctzll(mask);
+  return position < to ? position : string::npos;
+}
+
+const char *DelimiterScanner::implementation() { return selected().name; }
@@ -3,6 +3,7 @@
 //
 
 #include "file.h"
+#include "validators.h"
 
 #include <fcntl.h>
 #include <stdexcept>
@@ -11,7 +12,6 @@
 
 
 File::File(const char *path) {
-    this->path = path;
     this->fd = open(path, O_RDONLY);
     if (this->fd == -1) {
         throw std::runtime_error("File not found");
@@ -28,6 +28,8 @@ File::File(const char *path) {
         close(this->fd);
         throw std::runtime_error("File is empty");
     }
+    this->entity_tag = http::entity_tag(this->file_stat);
+    this->modified_date = http::format_http_date(this->file_stat.st_mtime);
 }
 
 void File::read(char * buffer) const {
@@ -56,10 +58,34 @@ void File::read(char * buffer) const {
     }
 }
 
+ssize_t File::read_at(char *buffer, const size_t size, const off_t offset) const {
+    ssize_t bytes_read;
+    do {
+        bytes_read = pread(this->fd, buffer, size, offset);
+    } while (bytes_read < 0 && errno == EINTR);
+    return bytes_read;
+}
+
 size_t File::size() const {
     return this->file_stat.st_size;
 }
 
+time_t File::modified() const {
+    return this->file_stat.st_mtime;
+}
+
+const std::string &File::etag() const {
+    return this->entity_tag;
+}
+
+const std::string &File::last_modified() const {
+    return this->modified_date;
+}
+
+int File::descriptor() const {
+    return this->fd;
+}
+
 File::~File() {
     close(this->fd);
 };
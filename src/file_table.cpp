@@ -0,0 +1,190 @@
+#include "file_table.h"
+
+#include "content_coding.h"
+#include "logger.h"
+
+#include <mutex>
+
+#ifdef __linux__
+#include <cerrno>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+// Changes that make an open file or its cached copy stale
+static constexpr uint32_t WATCH_MASK =
+    IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+#endif
+
+FileTable::FileTable(string root, shared_ptr<Cache> cache,
+                     const size_t max_files)
+    : root(std::move(root)), cache(std::move(cache)), max_files(max_files) {
+#ifdef __linux__
+  this->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  this->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (this->inotify_fd == -1 || this->wake_fd == -1) {
+    Logger::LOG_WARNING("inotify unavailable, files are opened per request");
+    return;
+  }
+  this->watch_tree("");
+  this->watching = true;
+  this->watcher = thread([this] { this->watch_events(); });
+#endif
+}
+
+FileTable::~FileTable() {
+#ifdef __linux__
+  if (this->watcher.joinable()) {
+    constexpr uint64_t stop = 1;
+    (void)write(this->wake_fd, &stop, sizeof(stop));
+    this->watcher.join();
+  }
+  if (this->inotify_fd != -1)
+    close(this->inotify_fd);
+  if (this->wake_fd != -1)
+    close(this->wake_fd);
+#endif
+}
+
+shared_ptr<const File> FileTable::open(const string &path) {
+  if (auto file = this->find(path))
+    return file;
+  // Opened again for the reason of the failure
+  return make_shared<const File>((this->root + path).c_str());
+}
+
+shared_ptr<const File> FileTable::find(const string &path) {
+  const auto open_file = [this, &path]() -> shared_ptr<const File> {
+    try {
+      return make_shared<const File>((this->root + path).c_str());
+    } catch (const std::exception &) {
+      return nullptr;
+    }
+  };
+  if (!this->watching)
+    return open_file();
+
+  uint64_t generation;
+  {
+    const shared_lock guard(this->lock);
+    if (const auto it = this->files.find(path); it != this->files.end())
+      return it->second;
+    generation = this->generation;
+  }
+
+  auto file = open_file();
+  const unique_lock guard(this->lock);
+  // A change noticed meanwhile may be older than what was opened
+  if (generation != this->generation)
+    return file;
+  // Files in use stay open until their responses are sent
+  if (this->files.size() >= this->max_files)
+    this->files.erase(this->files.begin());
+  this->files.emplace(path, file);
+  return file;
+}
+
+void FileTable::invalidate(const string &path, const bool subtree) {
+  {
+    const unique_lock guard(this->lock);
+    this->generation++;
+    if (subtree) {
+      erase_if(this->files, [&path](const auto &entry) {
+        return entry.first.starts_with(path + "/");
+      });
+    } else {
+      this->files.erase(path);
+    }
+  }
+  this->cache->invalidate(path, subtree);
+  // Compressed variants of a file may come from its sidecars
+  for (const auto coding : {http::ContentCoding::GZIP,
+                            http::ContentCoding::BROTLI}) {
+    if (!subtree && path.ends_with(http::sidecar_extension(coding)))
+      this->cache->invalidate(
+          path.substr(0, path.size() - http::sidecar_extension(coding).size()),
+          false);
+  }
+  Logger::LOG_DEBUG("FILE_CHANGED: " + path);
+}
+
+#ifdef __linux__
+void FileTable::watch_tree(const string &directory) {
+  const string full_path = this->root + directory;
+  const int watch =
+      inotify_add_watch(this->inotify_fd, full_path.c_str(), WATCH_MASK);
+  if (watch == -1) {
+    Logger::LOG_WARNING("Cannot watch " + full_path);
+    return;
+  }
+  this->watches[watch] = directory;
+
+  DIR *entries = opendir(full_path.c_str());
+  if (entries == nullptr)
+    return;
+  while (const dirent *entry = readdir(entries)) {
+    const string name = entry->d_name;
+    if (entry->d_type == DT_DIR && name != "." && name != "..")
+      this->watch_tree(directory + "/" + name);
+  }
+  closedir(entries);
+}
+
+void FileTable::watch_events() {
+  pollfd fds[2] = {{this->inotify_fd, POLLIN, 0}, {this->wake_fd, POLLIN, 0}};
+  alignas(inotify_event) char buffer[16 * 1024];
+  while (true) {
+    if (poll(fds, 2, -1) == -1 && errno != EINTR)
+      return;
+    if (fds[1].revents != 0)
+      return;
+
+    ssize_t length;
+    while ((length = read(this->inotify_fd, buffer, sizeof(buffer))) > 0) {
+      for (ssize_t offset = 0; offset < length;) {
+        const auto *event = reinterpret_cast<inotify_event *>(buffer + offset);
+        this->handle_event(event->wd, event->mask,
+                           event->len > 0 ? event->name : "");
+        offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+      }
+    }
+  }
+}
+
+void FileTable::handle_event(const int watch, const uint32_t mask,
+                             const char *name) {
+  // Events were dropped, anything may have changed
+  if (mask & IN_Q_OVERFLOW) {
+    this->invalidate("", true);
+    return;
+  }
+  const auto it = this->watches.find(watch);
+  if (it == this->watches.end())
+    return;
+  if (mask & IN_IGNORED) {
+    this->watches.erase(it);
+    return;
+  }
+
+  const string directory = it->second;
+  if (*name == '\0') {
+    // The watched directory itself was moved or deleted
+    if (mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+      this->invalidate(directory, true);
+    return;
+  }
+
+  const string path = directory + "/" + name;
+  if (mask & IN_ISDIR) {
+    // A new directory may already hold files
+    if (mask & (IN_CREATE | IN_MOVED_TO))
+      this->watch_tree(path);
+    this->invalidate(path, true);
+    return;
+  }
+  this->invalidate(path, false);
+}
+#endif
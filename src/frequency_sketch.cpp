@@ -0,0 +1,47 @@
+#include "frequency_sketch.h"
+
+#include <algorithm>
+#include <bit>
+
+// Odd multipliers deriving the row hashes from the key's hash
+static constexpr uint64_t SEEDS[] = {0x9E3779B97F4A7C15, 0xC2B2AE3D27D4EB4F,
+                                     0x165667B19E3779F9, 0xD6E8FEB86659FD93};
+
+FrequencySketch::FrequencySketch(const size_t expected_keys) {
+  const size_t width = bit_ceil(max<size_t>(expected_keys, 64));
+  this->counters.resize(DEPTH * width);
+  this->mask = width - 1;
+  this->sample_limit = 10 * width;
+}
+
+size_t FrequencySketch::index(const uint64_t hash, const size_t row) const {
+  const uint64_t mixed = (hash + SEEDS[row]) * SEEDS[row];
+  return row * (this->mask + 1) + ((mixed >> 32) & this->mask);
+}
+
+void FrequencySketch::record(const uint64_t hash) {
+  // Only the smallest counters are raised, the others already overestimate
+  const uint8_t current = frequency(hash);
+  if (current < MAX_COUNT) {
+    for (size_t row = 0; row < DEPTH; row++) {
+      uint8_t &counter = this->counters[index(hash, row)];
+      if (counter == current)
+        counter++;
+    }
+  }
+  if (++this->samples == this->sample_limit)
+    age();
+}
+
+uint8_t FrequencySketch::frequency(const uint64_t hash) const {
+  uint8_t count = MAX_COUNT;
+  for (size_t row = 0; row < DEPTH; row++)
+    count = min(count, this->counters[index(hash, row)]);
+  return count;
+}
+
+void FrequencySketch::age() {
+  for (uint8_t &counter : this->counters)
+    counter >>= 1;
+  this->samples /= 2;
+}
@@ -0,0 +1,49 @@
+#include "log_ring.h"
+
+LogRing::LogRing(const size_t capacity)
+    : capacity(capacity), buffer(make_unique<char[]>(capacity)) {}
+
+size_t LogRing::record_size(const size_t length) {
+  // Whole headers fit wherever a record ends, even the padding at the end
+  return (sizeof(Header) + length + sizeof(Header) - 1) / sizeof(Header) *
+         sizeof(Header);
+}
+
+bool LogRing::push(const time_t time, const uint8_t level, string_view text) {
+  text = text.substr(0, this->capacity / 4 - sizeof(Header));
+  const size_t size = record_size(text.size());
+  const size_t position = this->tail.load(memory_order_relaxed);
+  const size_t offset = position & (this->capacity - 1);
+  // A record that doesn't fit before the end starts over at the beginning
+  const size_t padding = offset + size > this->capacity
+                             ? this->capacity - offset
+                             : 0;
+
+  if (position + padding + size - this->cached_head > this->capacity) {
+    this->cached_head = this->head.load(memory_order_acquire);
+    if (position + padding + size - this->cached_head > this->capacity) {
+      this->dropped.fetch_add(1, memory_order_relaxed);
+      return false;
+    }
+  }
+
+  if (padding != 0) {
+    const Header filler{0, PADDING, 0};
+    memcpy(this->buffer.get() + offset, &filler, sizeof(filler));
+  }
+  char *record = this->buffer.get() + (position + padding) % this->capacity;
+  const Header header{static_cast<uint32_t>(text.size()), level, time};
+  memcpy(record, &header, sizeof(header));
+  memcpy(record + sizeof(header), text.data(), text.size());
+  this->tail.store(position + padding + size, memory_order_release);
+  return true;
+}
+
+void LogRing::release(const size_t position) {
+  this->head.store(position, memory_order_release);
+}
+
+bool LogRing::empty() const {
+  return this->head.load(memory_order_relaxed) ==
+         this->tail.load(memory_order_acquire);
+}
@@ -5,17 +5,51 @@
 #include "logger.h"
 
 #include <cerrno>
-#include <chrono>
+#include <climits>
+#include <cstring>
 #include <ctime>
-#include <format>
-#include <iomanip>
+#include <fcntl.h>
 #include <iostream>
-#include <mutex>
-#include <sstream>
-#include <string>
+#include <system_error>
+#include <unistd.h>
 
 mutex Logger::instanceMutex;
 
+namespace {
+// Ring of the current thread, handed back to the flush thread when it exits
+struct LocalRing {
+  LogRing *ring = nullptr;
+
+  ~LocalRing() {
+    if (this->ring != nullptr)
+      this->ring->retired.store(true, memory_order_release);
+  }
+};
+thread_local LocalRing local;
+
+// Write all of iov, resuming after partial writes
+void write_all(const int fd, iovec *iov, int count) {
+  while (count > 0) {
+    const ssize_t written = writev(fd, iov, min(count, IOV_MAX));
+    if (written == -1) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    size_t left = written;
+    while (count > 0 && left >= iov->iov_len) {
+      left -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + left;
+      iov->iov_len -= left;
+    }
+  }
+}
+} // namespace
+
 Logger *Logger::getInstance() {
   static Logger instance;
   return &instance;
@@ -23,45 +57,134 @@ Logger *Logger::getInstance() {
 
 Logger::Logger() {
   // Open log file
-  this->log_file.open("webserver.log", ios::app);
-  if (!this->log_file.is_open()) {
+  this->log_file =
+      open("webserver.log", O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (this->log_file == -1) {
     cerr << "Error opening log file: "
          << std::system_error(errno, std::system_category()).what() << endl;
     exit(EXIT_FAILURE);
   }
+  this->batch.reserve(BATCH_RECORDS * 4);
+  this->flusher = thread([this] { this->flush_loop(); });
 }
 
 Logger::~Logger() {
-  if (this->log_file.is_open()) {
-    this->log_file.close();
-  }
+  // The flush thread drains what is left before it stops
+  this->stopping.store(true);
+  this->flusher.join();
+  close(this->log_file);
 }
 
 void Logger::log(const string &message, const LogLevel level) {
-  // Get current time
-  const auto now = chrono::system_clock::now();
-  const auto time_t_now = chrono::system_clock::to_time_t(now);
-  tm local_time{};
-  localtime_r(&time_t_now, &local_time);
-
-  // Format time
-  stringstream time_stream;
-  time_stream << put_time(&local_time, "%Y-%m-%d %H:%M:%S");
-
-  // Log message
-  string level_str = log_level_strings[static_cast<int>(level)];
-
-  // Construct the log message
-  string log_message = format(log_format, time_stream.str(),
-                              log_level_colors[static_cast<int>(level)],
-                              level_str, log_level_reset, message);
-
-  // Lock the mutex to ensure thread safety
-  lock_guard lock(instanceMutex);
-
-  // Write to log file and console
-  this->log_file << log_message;
-  level == LogLevel::ERROR ? cerr << log_message : cout << log_message;
+  // Formatting is left to the flush thread, only the second is taken here
+  local_ring().push(time(nullptr), static_cast<uint8_t>(level), message);
+}
+
+LogRing &Logger::local_ring() {
+  if (local.ring == nullptr) {
+    auto ring = make_unique<LogRing>(RING_CAPACITY);
+    local.ring = ring.get();
+    const lock_guard lock(instanceMutex);
+    this->rings.push_back(std::move(ring));
+  }
+  return *local.ring;
+}
+
+void Logger::flush_loop() {
+  while (!this->stopping.load()) {
+    if (!drain())
+      this_thread::sleep_for(FLUSH_INTERVAL);
+  }
+  drain();
+}
+
+bool Logger::drain() {
+  {
+    const lock_guard lock(instanceMutex);
+    this->draining.clear();
+    for (const auto &ring : this->rings)
+      this->draining.push_back(ring.get());
+  }
+
+  bool drained = false;
+  bool retiring = false;
+  for (LogRing *ring : this->draining) {
+    // Read retired before the records, none follow once it is set
+    const bool retired = ring->retired.load(memory_order_acquire);
+    if (!ring->empty()) {
+      const size_t position =
+          ring->peek([this](const LogRing::Record &record) { append(record); });
+      // The batch points into the ring until it is written
+      flush_batch(STDOUT_FILENO);
+      ring->release(position);
+      drained = true;
+    }
+    retiring |= retired && ring->empty();
+  }
+
+  // Free the rings of exited threads once they are empty
+  if (retiring) {
+    const lock_guard lock(instanceMutex);
+    erase_if(this->rings, [this](const unique_ptr<LogRing> &ring) {
+      if (!ring->retired.load(memory_order_acquire) || !ring->empty())
+        return false;
+      this->retired_dropped.fetch_add(ring->dropped.load(memory_order_relaxed),
+                                      memory_order_relaxed);
+      return true;
+    });
+  }
+  return drained;
+}
+
+void Logger::append(const LogRing::Record &record) {
+  // The batch points at the timestamp, write it before it changes
+  if (record.time != this->timestamp_time) {
+    flush_batch(STDOUT_FILENO);
+    tm local_time{};
+    localtime_r(&record.time, &local_time);
+    char formatted[32];
+    this->timestamp.assign(formatted, strftime(formatted, sizeof(formatted),
+                                               "%Y-%m-%d %H:%M:%S",
+                                               &local_time));
+    this->timestamp_time = record.time;
+  }
+
+  const auto level = static_cast<LogLevel>(record.level);
+  const string_view tag = log_level_tags[record.level];
+  // Errors go to stderr instead of stdout, on their own
+  if (level == LogLevel::ERROR)
+    flush_batch(STDOUT_FILENO);
+  this->batch.push_back({this->timestamp.data(), this->timestamp.size()});
+  this->batch.push_back({const_cast<char *>(tag.data()), tag.size()});
+  this->batch.push_back(
+      {const_cast<char *>(record.text.data()), record.text.size()});
+  this->batch.push_back({const_cast<char *>("\n"), 1});
+  this->written.fetch_add(1, memory_order_relaxed);
+  if (level == LogLevel::ERROR)
+    flush_batch(STDERR_FILENO);
+  else if (this->batch.size() >= BATCH_RECORDS * 4)
+    flush_batch(STDOUT_FILENO);
+}
+
+void Logger::flush_batch(const int console) {
+  if (this->batch.empty())
+    return;
+  // writev advances through a copy, the batch is written twice
+  vector<iovec> pending = this->batch;
+  write_all(this->log_file, pending.data(), static_cast<int>(pending.size()));
+  pending = this->batch;
+  write_all(console, pending.data(), static_cast<int>(pending.size()));
+  this->batch.clear();
+}
+
+Logger::Stats Logger::stats() {
+  Logger *logger = getInstance();
+  // Only the list of rings is locked, the counters are atomic
+  const lock_guard lock(instanceMutex);
+  size_t dropped = logger->retired_dropped.load(memory_order_relaxed);
+  for (const auto &ring : logger->rings)
+    dropped += ring->dropped.load(memory_order_relaxed);
+  return {logger->written.load(memory_order_relaxed), dropped};
 }
 
 void Logger::LOG_INFO(const string &message) {
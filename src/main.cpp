@@ -1,16 +1,151 @@
 #include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#endif
 #include "server.h"
 #include "logger.h"
 
+// Pin the calling thread to a single core so a worker keeps its caches warm
+static void pin_to_core(const unsigned core) {
+#ifdef __linux__
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(core % CPU_SETSIZE, &cpu_set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) != 0)
+        Logger::LOG_WARNING("Failed to pin worker to core " + std::to_string(core));
+#else
+    (void) core;
+#endif
+}
+
+// Each worker owns a listening socket, an event loop and its connections
+static void run_worker(const ServerConfig &config) {
+    Server server(config);
+    server.init();
+    server.run();
+}
+
 int main(const int argc, char *argv[]) {
-    if (argc != 2) {
-        Logger::LOG_ERROR("Usage: " + std::string(argv[0]) + " <port>");
+    const std::string usage = "Usage: " + std::string(argv[0]) +
+                              " <port> [--workers <n>] [--io-backend <uring|epoll|select>]"
+                              " [--max-request-line <bytes>] [--max-header-size <bytes>]"
+                              " [--max-pipelined <n>] [--cache-mode <copy|mmap>]"
+                              " [--mmap-budget <bytes>] [--access-log <path>]"
+                              " [--access-log-format <combined|json>]"
+                              " [--access-log-max-size <bytes>]"
+                              " [--metrics-path <path>] [--no-metrics]"
+                              " [--header-timeout <seconds>] [--body-timeout <seconds>]"
+                              " [--write-timeout <seconds>]";
+    if (argc < 2) {
+        Logger::LOG_ERROR(usage);
         return 1;
     }
-    const int port = stoi(argv[1]);
-    Server server(port);
-    server.init();
-    server.run();
+    ServerConfig config;
+    config.port = stoi(argv[1]);
+
+    // Number of event-loop workers, 0 means one per core
+    unsigned workers = 1;
+    // Access log, off unless a path is given
+    std::string access_log_path;
+    auto access_log_format = AccessLog::Format::COMBINED;
+    size_t access_log_max_size = 64ul * 1024 * 1024;
+    bool metrics = true;
+    for (int i = 2; i < argc; i++) {
+        const std::string option = argv[i];
+        if (option == "--workers" && i + 1 < argc) {
+            workers = std::stoul(argv[++i]);
+        } else if (option == "--io-backend" && i + 1 < argc) {
+            const std::string backend = argv[++i];
+            if (backend == "uring") {
+                config.io_backend = IoBackend::IO_URING;
+            } else if (backend == "epoll") {
+                config.io_backend = IoBackend::EPOLL;
+            } else if (backend == "select") {
+                config.io_backend = IoBackend::SELECT;
+            } else {
+                Logger::LOG_ERROR(usage);
+                return 1;
+            }
+        } else if (option == "--max-request-line" && i + 1 < argc) {
+            config.request_limits.max_request_line = std::stoul(argv[++i]);
+        } else if (option == "--max-header-size" && i + 1 < argc) {
+            config.request_limits.max_header_size = std::stoul(argv[++i]);
+        } else if (option == "--max-pipelined" && i + 1 < argc) {
+            config.max_pipelined_requests = std::max(1ul, std::stoul(argv[++i]));
+        } else if (option == "--cache-mode" && i + 1 < argc) {
+            const std::string mode = argv[++i];
+            if (mode == "copy") {
+                config.cache_storage = CacheStorage::COPY;
+            } else if (mode == "mmap") {
+                config.cache_storage = CacheStorage::MMAP;
+            } else {
+                Logger::LOG_ERROR(usage);
+                return 1;
+            }
+        } else if (option == "--mmap-budget" && i + 1 < argc) {
+            config.max_mapped_size = std::stoul(argv[++i]);
+        } else if (option == "--access-log" && i + 1 < argc) {
+            access_log_path = argv[++i];
+        } else if (option == "--access-log-format" && i + 1 < argc) {
+            const std::string format = argv[++i];
+            if (format == "combined") {
+                access_log_format = AccessLog::Format::COMBINED;
+            } else if (format == "json") {
+                access_log_format = AccessLog::Format::JSON;
+            } else {
+                Logger::LOG_ERROR(usage);
+                return 1;
+            }
+        } else if (option == "--access-log-max-size" && i + 1 < argc) {
+            access_log_max_size = std::stoul(argv[++i]);
+        } else if (option == "--metrics-path" && i + 1 < argc) {
+            config.metrics_path = argv[++i];
+        } else if (option == "--no-metrics") {
+            metrics = false;
+        } else if (option == "--header-timeout" && i + 1 < argc) {
+            config.timeouts.header = std::chrono::seconds(std::stoul(argv[++i]));
+        } else if (option == "--body-timeout" && i + 1 < argc) {
+            config.timeouts.body = std::chrono::seconds(std::stoul(argv[++i]));
+        } else if (option == "--write-timeout" && i + 1 < argc) {
+            config.timeouts.write = std::chrono::seconds(std::stoul(argv[++i]));
+        } else {
+            Logger::LOG_ERROR(usage);
+            return 1;
+        }
+    }
+    const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    if (workers == 0)
+        workers = cores;
+
+    // Shared by the workers, each appends through its own ring
+    if (!access_log_path.empty())
+        config.access_log = std::make_shared<AccessLog>(access_log_path, access_log_format,
+                                                        access_log_max_size);
+    // Counted by every worker, merged by whichever serves the scrape
+    if (metrics)
+        config.metrics = std::make_shared<Metrics>();
+
+    if (workers == 1) {
+        run_worker(config);
+        return 0;
+    }
+
+    // One warm cache for all workers, a shard per worker keeps lock
+    // contention low
+    config.cache = Server::make_cache(config, workers);
+    config.files = std::make_shared<FileTable>(Server::DEFAULT_ROOT, config.cache);
+    Logger::LOG_INFO("Starting " + std::to_string(workers) + " workers");
+    std::vector<std::jthread> threads;
+    threads.reserve(workers);
+    for (unsigned i = 0; i < workers; i++) {
+        threads.emplace_back([config, core = i % cores] {
+            pin_to_core(core);
+            run_worker(config);
+        });
+    }
 
     return 0;
 }
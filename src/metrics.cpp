@@ -0,0 +1,193 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <bit>
+#include <format>
+
+// Bucket bounds of the exported histograms, in seconds
+static constexpr double HISTOGRAM_BOUNDS[] = {
+    0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005,
+    0.01,    0.025,  0.05,    0.1,    0.25,  0.5,    1,
+    2.5,     5,      10};
+
+// Quantiles of the exported summaries
+static constexpr double QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+
+static constexpr double NANOSECONDS = 1e9;
+
+// Label values of the timeout counters
+static constexpr const char *TIMEOUT_NAMES[] = {"idle", "header", "body",
+                                                "write"};
+
+size_t Histogram::bucket_of(uint64_t value) {
+  constexpr uint64_t max_value = (2 * SUB_BUCKETS << MAX_SHIFT) - 1;
+  value = min(value, max_value);
+  // Values below 2 * SUB_BUCKETS have a shift of 0 and their own bucket
+  const unsigned shift =
+      max<unsigned>(bit_width(value), SUB_BUCKET_BITS + 1) -
+      (SUB_BUCKET_BITS + 1);
+  return shift * SUB_BUCKETS + (value >> shift);
+}
+
+uint64_t Histogram::value_of(const size_t bucket) {
+  if (bucket < 2 * SUB_BUCKETS)
+    return bucket;
+  const unsigned shift = bucket / SUB_BUCKETS - 1;
+  const uint64_t lowest = (bucket - shift * SUB_BUCKETS) << shift;
+  return lowest + (uint64_t{1} << shift) / 2;
+}
+
+uint64_t Histogram::highest_of(const size_t bucket) {
+  if (bucket < 2 * SUB_BUCKETS)
+    return bucket;
+  const unsigned shift = bucket / SUB_BUCKETS - 1;
+  const uint64_t lowest = (bucket - shift * SUB_BUCKETS) << shift;
+  return lowest + (uint64_t{1} << shift) - 1;
+}
+
+void Histogram::record(const uint64_t value) {
+  atomic<uint64_t> &count = this->counts[bucket_of(value)];
+  count.store(count.load(memory_order_relaxed) + 1, memory_order_relaxed);
+  this->sum.store(this->sum.load(memory_order_relaxed) + value,
+                  memory_order_relaxed);
+}
+
+void Histogram::add_to(Snapshot &snapshot) const {
+  for (size_t i = 0; i < BUCKETS; i++) {
+    const uint64_t count = this->counts[i].load(memory_order_relaxed);
+    snapshot.counts[i] += count;
+    snapshot.count += count;
+  }
+  snapshot.sum += this->sum.load(memory_order_relaxed);
+}
+
+uint64_t Histogram::Snapshot::quantile(const double share) const {
+  if (this->count == 0)
+    return 0;
+  // Rank of the value, counted from 1
+  const auto rank = max<uint64_t>(
+      1, static_cast<uint64_t>(share * static_cast<double>(this->count) + 0.5));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < BUCKETS; i++) {
+    seen += this->counts[i];
+    if (seen >= rank)
+      return value_of(i);
+  }
+  return value_of(BUCKETS - 1);
+}
+
+uint64_t Histogram::Snapshot::count_up_to(const uint64_t value) const {
+  uint64_t count = 0;
+  for (size_t i = 0; i < BUCKETS && highest_of(i) <= value; i++)
+    count += this->counts[i];
+  return count;
+}
+
+WorkerMetrics &Metrics::worker() {
+  const lock_guard guard(this->lock);
+  return *this->workers.emplace_back(make_unique<WorkerMetrics>());
+}
+
+void Metrics::write(string &out) const {
+  uint64_t accepted = 0;
+  uint64_t closed = 0;
+  uint64_t requests = 0;
+  array<uint64_t, 5> responses{};
+  uint64_t bytes_sent = 0;
+  array<uint64_t, 4> timeouts{};
+  uint64_t request_limit_closes = 0;
+  // Too large for the stack of a worker
+  const auto first_byte = make_unique<Histogram::Snapshot>();
+  const auto duration = make_unique<Histogram::Snapshot>();
+  {
+    const lock_guard guard(this->lock);
+    for (const auto &worker : this->workers) {
+      accepted += worker->connections_accepted.get();
+      closed += worker->connections_closed.get();
+      requests += worker->requests.get();
+      for (size_t i = 0; i < responses.size(); i++)
+        responses[i] += worker->responses[i].get();
+      bytes_sent += worker->bytes_sent.get();
+      for (size_t i = 0; i < timeouts.size(); i++)
+        timeouts[i] += worker->timeouts[i].get();
+      request_limit_closes += worker->request_limit_closes.get();
+      worker->first_byte.add_to(*first_byte);
+      worker->duration.add_to(*duration);
+    }
+  }
+
+  write_counter(out, "webserver_connections_accepted_total",
+                "Connections accepted", accepted);
+  // Read one after the other, a connection may close in between
+  write_gauge(out, "webserver_connections_open", "Connections currently open",
+              static_cast<double>(accepted - min(closed, accepted)));
+  write_counter(out, "webserver_requests_total", "Requests parsed or rejected",
+                requests);
+  out += "# HELP webserver_responses_total Responses sent, by status class\n"
+         "# TYPE webserver_responses_total counter\n";
+  for (size_t i = 0; i < responses.size(); i++)
+    format_to(back_inserter(out),
+              "webserver_responses_total{{code=\"{}xx\"}} {}\n", i + 1,
+              responses[i]);
+  write_counter(out, "webserver_sent_bytes_total",
+                "Bytes sent, headers included", bytes_sent);
+  out += "# HELP webserver_timeouts_total Connections closed on a timeout, by "
+         "what they waited for\n"
+         "# TYPE webserver_timeouts_total counter\n";
+  for (size_t i = 0; i < timeouts.size(); i++)
+    format_to(back_inserter(out),
+              "webserver_timeouts_total{{deadline=\"{}\"}} {}\n",
+              TIMEOUT_NAMES[i], timeouts[i]);
+  write_counter(out, "webserver_request_limit_closes_total",
+                "Connections closed after the last request allowed on one",
+                request_limit_closes);
+  write_histogram(out, "webserver_response_first_byte_seconds",
+                  "Time from the first bytes of a request until the first "
+                  "bytes of its response were sent",
+                  *first_byte);
+  write_histogram(out, "webserver_request_duration_seconds",
+                  "Time from the first bytes of a request until the last "
+                  "bytes of its response were sent",
+                  *duration);
+  write_summary(out, "webserver_request_latency_seconds",
+                "Quantiles of webserver_request_duration_seconds", *duration);
+}
+
+void Metrics::write_counter(string &out, const string_view name,
+                            const string_view help, const uint64_t value) {
+  format_to(back_inserter(out), "# HELP {0} {1}\n# TYPE {0} counter\n{0} {2}\n",
+            name, help, value);
+}
+
+void Metrics::write_gauge(string &out, const string_view name,
+                          const string_view help, const double value) {
+  format_to(back_inserter(out), "# HELP {0} {1}\n# TYPE {0} gauge\n{0} {2}\n",
+            name, help, value);
+}
+
+void Metrics::write_histogram(string &out, const string_view name,
+                              const string_view help,
+                              const Histogram::Snapshot &snapshot) {
+  format_to(back_inserter(out), "# HELP {0} {1}\n# TYPE {0} histogram\n", name,
+            help);
+  for (const double bound : HISTOGRAM_BOUNDS)
+    format_to(back_inserter(out), "{}_bucket{{le=\"{}\"}} {}\n", name, bound,
+              snapshot.count_up_to(
+                  static_cast<uint64_t>(bound * NANOSECONDS)));
+  format_to(back_inserter(out),
+            "{0}_bucket{{le=\"+Inf\"}} {1}\n{0}_sum {2}\n{0}_count {1}\n",
+            name, snapshot.count,
+            static_cast<double>(snapshot.sum) / NANOSECONDS);
+}
+
+void Metrics::write_summary(string &out, const string_view name,
+                            const string_view help,
+                            const Histogram::Snapshot &snapshot) {
+  format_to(back_inserter(out), "# HELP {0} {1}\n# TYPE {0} summary\n", name,
+            help);
+  for (const double quantile : QUANTILES)
+    format_to(back_inserter(out), "{}{{quantile=\"{}\"}} {}\n", name, quantile,
+              static_cast<double>(snapshot.quantile(quantile)) / NANOSECONDS);
+  format_to(back_inserter(out), "{0}_sum {1}\n{0}_count {2}\n", name,
+            static_cast<double>(snapshot.sum) / NANOSECONDS, snapshot.count);
+}
@@ -0,0 +1,129 @@
+#include "poller.h"
+#include "logger.h"
+
+#include <cerrno>
+#include <sys/select.h>
+#include <system_error>
+#include <unistd.h>
+
+unique_ptr<Poller> Poller::create() {
+#ifdef __linux__
+  return make_unique<EpollPoller>();
+#else
+  return make_unique<SelectPoller>();
+#endif
+}
+
+#ifdef __linux__
+EpollPoller::EpollPoller() : ready(MAX_EVENTS) {
+  this->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (this->epoll_fd == -1) {
+    Logger::LOG_ERROR("Error creating epoll instance: " +
+                      string(system_error(errno, system_category()).what()));
+    exit(1);
+  }
+}
+
+EpollPoller::~EpollPoller() { close(this->epoll_fd); }
+
+uint32_t EpollPoller::to_epoll(const uint32_t events) {
+  uint32_t result = EPOLLET;
+  if (events & READABLE)
+    result |= EPOLLIN | EPOLLRDHUP;
+  if (events & WRITABLE)
+    result |= EPOLLOUT;
+  return result;
+}
+
+bool EpollPoller::add(const int fd, const uint32_t events, void *context) {
+  epoll_event event{};
+  event.events = to_epoll(events);
+  event.data.ptr = context;
+  return epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+bool EpollPoller::modify(const int fd, const uint32_t events, void *context) {
+  epoll_event event{};
+  event.events = to_epoll(events);
+  event.data.ptr = context;
+  return epoll_ctl(this->epoll_fd, EPOLL_CTL_MOD, fd, &event) == 0;
+}
+
+void EpollPoller::remove(const int fd) {
+  epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+int EpollPoller::wait(vector<Event> &events, const int timeout_ms) {
+  events.clear();
+  const int count = epoll_wait(this->epoll_fd, this->ready.data(),
+                               static_cast<int>(this->ready.size()),
+                               timeout_ms);
+  if (count == -1)
+    return errno == EINTR ? 0 : -1;
+
+  for (int i = 0; i < count; i++) {
+    const uint32_t flags = this->ready[i].events;
+    uint32_t result = 0;
+    if (flags & EPOLLIN)
+      result |= READABLE;
+    if (flags & EPOLLOUT)
+      result |= WRITABLE;
+    if (flags & (EPOLLHUP | EPOLLERR | EPOLLRDHUP))
+      result |= HANGUP | READABLE; // let the reader observe EOF / error
+    events.push_back({this->ready[i].data.ptr, result});
+  }
+  return count;
+}
+#endif
+
+bool SelectPoller::add(const int fd, const uint32_t events, void *context) {
+  if (fd >= FD_SETSIZE) {
+    Logger::LOG_WARNING("Descriptor exceeds FD_SETSIZE: " + to_string(fd));
+    return false;
+  }
+  this->registered[fd] = {context, events};
+  return true;
+}
+
+bool SelectPoller::modify(const int fd, const uint32_t events, void *context) {
+  const auto it = this->registered.find(fd);
+  if (it == this->registered.end())
+    return false;
+  it->second = {context, events};
+  return true;
+}
+
+void SelectPoller::remove(const int fd) { this->registered.erase(fd); }
+
+int SelectPoller::wait(vector<Event> &events, const int timeout_ms) {
+  events.clear();
+  fd_set read_fds;
+  fd_set write_fds;
+  FD_ZERO(&read_fds);
+  FD_ZERO(&write_fds);
+  int max_fd = -1;
+  for (const auto &[fd, event] : this->registered) {
+    if (event.events & READABLE)
+      FD_SET(fd, &read_fds);
+    if (event.events & WRITABLE)
+      FD_SET(fd, &write_fds);
+    max_fd = max(max_fd, fd);
+  }
+
+  timeval timeout{timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+  const int count = select(max_fd + 1, &read_fds, &write_fds, nullptr,
+                           timeout_ms < 0 ? nullptr : &timeout);
+  if (count == -1)
+    return errno == EINTR ? 0 : -1;
+
+  for (const auto &[fd, event] : this->registered) {
+    uint32_t result = 0;
+    if (FD_ISSET(fd, &read_fds))
+      result |= READABLE;
+    if (FD_ISSET(fd, &write_fds))
+      result |= WRITABLE;
+    if (result)
+      events.push_back({event.context, result});
+  }
+  return static_cast<int>(events.size());
+}
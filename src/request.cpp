@@ -2,51 +2,86 @@
 // Created by Seongyun Jang on 3/23/25.
 //
 
-#include <sstream>
 #include "request.h"
 
-Request::Request(string& buffer) {
-    // Parse request
-    istringstream iss(buffer);
-
-    // Parse first line
-    string line;
-    getline(iss, line);
-    istringstream first_line(line);
-    string method_str;
-
-    // Parse method
-    first_line >> method_str;
-    this->method = http::STRING_TO_METHOD.find(method_str)->second;
-
-    // Parse path and query
-    first_line >> this->path;
-    if (size_t pos = this->path.find('?'); pos != string::npos) {
-        this->query = this->path.substr(pos + 1);
-        this->path = this->path.substr(0, pos);
+string_view Request::header(const string_view name) const {
+    for (const auto &[key, value] : *this) {
+        if (http::equals_ignore_case(key, name))
+            return value;
     }
+    return {};
+}
 
-    // Parse headers
-    while (getline(iss, line)) {
-        // Check for end of headers
-        if (line == "\r") {
-            break;
-        }
+bool Request::has_header(const string_view name) const {
+    for (const auto &header : *this) {
+        if (http::equals_ignore_case(header.name, name))
+            return true;
+    }
+    return false;
+}
 
-        // Parse header
-        size_t colon_pos = line.find(':');
-        string key = line.substr(0, colon_pos);
-        string value = line.substr(colon_pos + 2);
-        this->headers[key] = value;
+bool Request::header_has_token(const string_view name, const string_view token) const {
+    string_view list = header(name);
+    while (!list.empty()) {
+        // Take the next element and trim optional whitespace around it
+        const size_t comma = list.find(',');
+        string_view element = list.substr(0, comma);
+        list = comma == string_view::npos ? string_view() : list.substr(comma + 1);
+        while (!element.empty() && (element.front() == ' ' || element.front() == '\t'))
+            element.remove_prefix(1);
+        while (!element.empty() && (element.back() == ' ' || element.back() == '\t'))
+            element.remove_suffix(1);
+        if (http::equals_ignore_case(element, token))
+            return true;
     }
+    return false;
+}
+
+bool Request::keep_alive() const {
+    if (header_has_token(http::HTTPHeaders::CONNECTION, "close"))
+        return false;
+    // HTTP/1.0 connections are closed unless the client asks otherwise
+    if (this->version == "HTTP/1.0")
+        return header_has_token(http::HTTPHeaders::CONNECTION, "keep-alive");
+    return true;
+}
 
-    // Parse body
-    if (this->method == http::Method::POST) {
-        this->body = iss.str();
+string Request::normalized_path() const {
+    // Most paths have nothing to remove
+    if (this->path.find("//") == string_view::npos && this->path.find("/.") == string_view::npos)
+        return string(this->path);
+
+    string normalized;
+    normalized.reserve(this->path.size());
+    size_t start = 0;
+    while (start < this->path.size()) {
+        size_t end = this->path.find('/', start);
+        if (end == string_view::npos)
+            end = this->path.size();
+        const string_view segment = this->path.substr(start, end - start);
+        if (segment == "..") {
+            const size_t parent = normalized.rfind('/');
+            normalized.resize(parent == string::npos ? 0 : parent);
+        } else if (!segment.empty() && segment != ".") {
+            normalized += '/';
+            normalized += segment;
+        }
+        start = end + 1;
     }
+    return normalized.empty() ? "/" : normalized;
+}
+
+bool Request::add_header(const string_view name, const string_view value) {
+    if (this->headers_size == MAX_HEADERS)
+        return false;
+    this->headers[this->headers_size++] = {name, value};
+    return true;
 }
 
-Request::~Request() {
-    // Destructor
-    this->headers.clear();
-}
\ No newline at end of file
+const Request::Header *Request::begin() const {
+    return this->headers.data();
+}
+
+const Request::Header *Request::end() const {
+    return this->headers.data() + this->headers_size;
+}
@@ -0,0 +1,259 @@
+#include "request_parser.h"
+
+#include "delimiter_scanner.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+
+static string_view trim(string_view value) {
+  while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+    value.remove_prefix(1);
+  while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+    value.remove_suffix(1);
+  return value;
+}
+
+RequestParser::RequestParser(const Limits &limits) : limits(limits) {
+  // Enough for a typical browser request
+  this->line_feeds.reserve(32);
+  this->separators.reserve(32);
+}
+
+RequestParser::Result RequestParser::parse(const string &buffer) {
+  // Mark the delimiters of the bytes received since the last call, starting
+  // over at the beginning of the partially scanned word
+  if (this->scanned < buffer.size()) {
+    DelimiterScanner::scan(buffer.data(), this->scanned & ~size_t{63},
+                           buffer.size(), this->line_feeds, this->separators);
+    this->scanned = buffer.size();
+  }
+
+  const char *data = buffer.data();
+  while (true) {
+    switch (this->state) {
+    case State::COMPLETE:
+      return Result::COMPLETE;
+    case State::ERROR:
+      return Result::ERROR;
+    case State::BODY:
+      // The body is not parsed, only waited for
+      if (buffer.size() - this->body_start < this->content_length)
+        return Result::INCOMPLETE;
+      this->line_start = this->body_start + this->content_length;
+      this->state = State::COMPLETE;
+      continue;
+    default:
+      break;
+    }
+
+    const size_t line_end = DelimiterScanner::find(
+        this->line_feeds, this->line_start, buffer.size());
+    if (line_end == string::npos) {
+      if (this->state == State::REQUEST_LINE &&
+          buffer.size() - this->line_start > this->limits.max_request_line)
+        return fail(http::StatusCode::URI_TOO_LONG, "Request line too long");
+      if (this->state == State::HEADERS &&
+          buffer.size() - this->headers_start > this->limits.max_header_size)
+        return fail(http::StatusCode::REQUEST_HEADER_FIELDS_TOO_LARGE,
+                    "Request header fields too large");
+      return Result::INCOMPLETE;
+    }
+
+    string_view line(data + this->line_start, line_end - this->line_start);
+    if (!line.empty() && line.back() == '\r')
+      line.remove_suffix(1);
+    const size_t line_begin = this->line_start;
+    this->line_start = line_end + 1;
+
+    if (this->state == State::REQUEST_LINE) {
+      // Empty lines before a request line are ignored (RFC 9112 section 2.2)
+      if (line.empty()) {
+        this->start = this->line_start;
+        continue;
+      }
+      if (line.size() > this->limits.max_request_line)
+        return fail(http::StatusCode::URI_TOO_LONG, "Request line too long");
+      if (!parse_request_line(line, data))
+        return Result::ERROR;
+      this->state = State::HEADERS;
+      this->headers_start = this->line_start;
+      continue;
+    }
+
+    if (this->line_start - this->headers_start > this->limits.max_header_size)
+      return fail(http::StatusCode::REQUEST_HEADER_FIELDS_TOO_LARGE,
+                  "Request header fields too large");
+
+    // A blank line ends the head
+    if (line.empty()) {
+      this->body_start = this->line_start;
+      this->state = this->content_length > 0 ? State::BODY : State::COMPLETE;
+      continue;
+    }
+    // A field name ends at the first separator, which must be a colon
+    const size_t colon = DelimiterScanner::find(this->separators, line_begin,
+                                                line_begin + line.size());
+    if (!parse_header(line, colon == string::npos ? colon : colon - line_begin,
+                      data))
+      return Result::ERROR;
+  }
+}
+
+RequestParser::Span RequestParser::span(const string_view part,
+                                        const char *data) const {
+  return {static_cast<uint32_t>(part.data() - data - this->start),
+          static_cast<uint32_t>(part.size())};
+}
+
+bool RequestParser::parse_request_line(const string_view line,
+                                       const char *data) {
+  const size_t method_end = line.find(' ');
+  const size_t target_end = method_end == string_view::npos
+                                ? string_view::npos
+                                : line.find(' ', method_end + 1);
+  if (target_end == string_view::npos) {
+    fail(http::StatusCode::BAD_REQUEST, "Malformed request line");
+    return false;
+  }
+
+  const string_view method = line.substr(0, method_end);
+  const string_view target =
+      line.substr(method_end + 1, target_end - method_end - 1);
+  const string_view version = line.substr(target_end + 1);
+
+  if (!http::parse_method(method, this->method)) {
+    fail(http::StatusCode::NOT_IMPLEMENTED, "Unknown method");
+    return false;
+  }
+  if (target.empty() || (target.front() != '/' && target != "*")) {
+    fail(http::StatusCode::BAD_REQUEST, "Invalid request target");
+    return false;
+  }
+  if (version != "HTTP/1.1" && version != "HTTP/1.0") {
+    fail(http::StatusCode::HTTP_VERSION_NOT_SUPPORTED,
+         "HTTP version not supported");
+    return false;
+  }
+  this->version = span(version, data);
+
+  // The query starts at the first question mark among the target's separators
+  const size_t target_begin = target.data() - data;
+  const size_t target_end_offset = target_begin + target.size();
+  size_t question = DelimiterScanner::find(this->separators, target_begin,
+                                           target_end_offset);
+  while (question != string::npos && data[question] != '?')
+    question = DelimiterScanner::find(this->separators, question + 1,
+                                      target_end_offset);
+
+  if (question == string::npos) {
+    this->path = span(target, data);
+    this->query = {};
+  } else {
+    this->path = span(target.substr(0, question - target_begin), data);
+    this->query = span(target.substr(question - target_begin + 1), data);
+  }
+  return true;
+}
+
+bool RequestParser::parse_header(const string_view line, const size_t colon,
+                                 const char *data) {
+  // No whitespace is allowed between the field name and the colon
+  if (colon == string_view::npos || line[colon] != ':' || colon == 0 ||
+      line[colon - 1] == ' ' ||
+      line[colon - 1] == '\t') {
+    fail(http::StatusCode::BAD_REQUEST, "Malformed header field");
+    return false;
+  }
+
+  const string_view name = line.substr(0, colon);
+  const string_view value = trim(line.substr(colon + 1));
+  if (this->field_count == this->fields.size()) {
+    fail(http::StatusCode::REQUEST_HEADER_FIELDS_TOO_LARGE,
+         "Too many header fields");
+    return false;
+  }
+  this->fields[this->field_count++] = {span(name, data), span(value, data)};
+
+  if (http::equals_ignore_case(name, "Content-Length")) {
+    size_t length = 0;
+    const auto [end, ec] =
+        from_chars(value.data(), value.data() + value.size(), length);
+    // Conflicting lengths could be used to smuggle a request
+    if (value.empty() || ec != errc() || end != value.data() + value.size() ||
+        (this->content_length != 0 && this->content_length != length)) {
+      fail(http::StatusCode::BAD_REQUEST, "Invalid Content-Length");
+      return false;
+    }
+    if (length > this->limits.max_body_size) {
+      fail(http::StatusCode::PAYLOAD_TOO_LARGE, "Request body too large");
+      return false;
+    }
+    this->content_length = length;
+  } else if (http::equals_ignore_case(name, "Transfer-Encoding")) {
+    fail(http::StatusCode::NOT_IMPLEMENTED, "Transfer-Encoding not supported");
+    return false;
+  }
+  return true;
+}
+
+RequestParser::Result RequestParser::fail(const http::StatusCode status,
+                                          const string_view message) {
+  this->state = State::ERROR;
+  this->error_status = status;
+  this->reason = message;
+  return Result::ERROR;
+}
+
+http::StatusCode RequestParser::error() const { return this->error_status; }
+
+string_view RequestParser::error_reason() const { return this->reason; }
+
+Request RequestParser::request(const string &buffer) const {
+  const char *base = buffer.data() + this->start;
+  const auto view = [base](const Span part) {
+    return string_view(base + part.offset, part.length);
+  };
+
+  Request request;
+  request.method = this->method;
+  request.path = view(this->path);
+  request.query = view(this->query);
+  request.version = view(this->version);
+  for (size_t i = 0; i < this->field_count; i++)
+    request.add_header(view(this->fields[i].name), view(this->fields[i].value));
+  request.body = string_view(buffer.data() + this->body_start,
+                             this->content_length);
+  return request;
+}
+
+size_t RequestParser::request_start() const { return this->start; }
+
+size_t RequestParser::head_end() const { return this->body_start; }
+
+size_t RequestParser::request_end() const {
+  return this->body_start + this->content_length;
+}
+
+bool RequestParser::reading_body() const {
+  return this->state == State::BODY;
+}
+
+void RequestParser::next() {
+  this->start = this->line_start;
+  this->content_length = 0;
+  this->field_count = 0;
+  this->state = State::REQUEST_LINE;
+}
+
+void RequestParser::discard(const size_t count) {
+  // The bytes left are few (a partial pipelined request), marking them again
+  // is cheaper than shifting the bitmaps
+  this->scanned = 0;
+
+  this->start -= count;
+  this->line_start -= count;
+  // Offsets of the previous request may point before the new start
+  this->headers_start -= min(this->headers_start, count);
+  this->body_start -= min(this->body_start, count);
+}
@@ -4,20 +4,27 @@
 
 #include "response.h"
 #include "http_constants.h"
+#include "validators.h"
+#include <ctime>
 #include <format>
 #include <server.h>
 #include <sstream>
 
 using namespace std;
 
-Response::Response(const string& data, const http::StatusCode status_code, const map<string, string>& headers={}, const bool keep_alive = true) {
-    this->data = data;
+namespace {
+// Rendered body owned by the output queue once sent
+struct OwnedBody {
+    string data;
+    string_view view;
+};
+}
+
+Response::Response(string data, const http::StatusCode status_code, const map<string, string>& headers={}, const bool keep_alive = true) {
+    this->data = std::move(data);
     this->status_code = status_code;
     this->headers = headers;
-    if (keep_alive) {
-        this->headers[http::HTTPHeaders::CONNECTION] = "keep-alive";
-        this->headers[http::HTTPHeaders::KEEP_ALIVE] = "timeout=5, max=200";
-    }
+    this->keep_alive = keep_alive;
 }
 
 Response::Response(const http::StatusCode status_code, const map<string, string>& headers={}) {
@@ -29,25 +36,56 @@ void Response::serialize() {
     // If the status code is not OK, render the error page
     if (status_code >= http::StatusCode::BAD_REQUEST)
         // render error page
-            this->body = format(
+            this->data = format(
                 ERROR_PAGE_TEMPLATE,
                 static_cast<int>(status_code),
                 http::STATUS_CODE_MAP[this->status_code],
                 this->data
             );
-    else this->body = this->data;
+    // An owned body is handed over to the output queue like a referenced one
+    if (!this->body_owner && !this->data.empty()) {
+        const auto owned = make_shared<OwnedBody>();
+        owned->data = std::move(this->data);
+        owned->view = owned->data;
+        this->body = span(&owned->view, 1);
+        this->body_owner = owned;
+    }
+
+    // Headers depending on the content only, unless precomputed
+    if (!this->head_owner) {
+        size_t content_length = this->file ? this->file->size() : 0;
+        for (const string_view part : this->body)
+            content_length += part.size();
+        for (const BodyPart &part : this->parts)
+            content_length += part.size();
+        this->serialized_headers = serialize_head(content_length);
+    }
+
+    // Headers differing between requests, and the blank line ending the head
+    if (this->keep_alive) {
+        this->serialized_headers.append(format(HTTP_HEADER_TEMPLATE, http::HTTPHeaders::CONNECTION, "keep-alive"));
+        this->serialized_headers.append(format(HTTP_HEADER_TEMPLATE, http::HTTPHeaders::KEEP_ALIVE, keep_alive_parameters));
+    } else {
+        this->serialized_headers.append(format(HTTP_HEADER_TEMPLATE, http::HTTPHeaders::CONNECTION, "close"));
+    }
+    this->serialized_headers.append(current_date());
+    this->serialized_headers.append("\r\n");
+}
 
+string Response::serialize_head(const size_t content_length) const {
     // 기본 헤더 설정
+    map<string, string> head_headers = this->headers;
     for (const auto& [key, value] : default_headers)
-        this->headers[key] = value;
+        head_headers[key] = value;
 
-    // Add Content-Length header
-    this->headers["Content-Length"] = to_string(this->data.size());
+    // Add Content-Length header, a 304 has no content to measure
+    if (this->status_code != http::StatusCode::NOT_MODIFIED)
+        head_headers[http::HTTPHeaders::CONTENT_LENGTH] = to_string(content_length);
     string headers_string;
-    for (const auto& [header, value] : this->headers)
+    for (const auto& [header, value] : head_headers)
         headers_string.append(format(HTTP_HEADER_TEMPLATE, header, value));
 
-    this-> serialized_headers = format(
+    return format(
         HTTP_RESPONSE_TEMPLATE,
         static_cast<int>(status_code),
         http::STATUS_CODE_MAP[this->status_code],
@@ -55,19 +93,88 @@ void Response::serialize() {
     );
 }
 
-string Response::get_body() {
+string_view Response::current_date() {
+    // Formatting the date costs more than the rest of a cached response,
+    // every worker thread refreshes its copy once per second
+    thread_local time_t formatted_at = -1;
+    thread_local string date_header;
+    if (const time_t now = time(nullptr); now != formatted_at) {
+        date_header = format(HTTP_HEADER_TEMPLATE, http::HTTPHeaders::DATE, http::format_http_date(now));
+        formatted_at = now;
+    }
+    return date_header;
+}
+
+span<const string_view> Response::get_body() const {
     return this->body;
 }
 
-string Response::get_chunk(const size_t offset, const size_t size) const{
-    // Check if offset is within bounds
-    return {data.c_str() + offset, size};
+const shared_ptr<const void> &Response::get_body_owner() const {
+    return this->body_owner;
+}
+
+string Response::take_headers() {
+    return std::move(this->serialized_headers);
+}
+
+void Response::set_body(const span<const string_view> body, shared_ptr<const void> owner) {
+    this->body = body;
+    this->body_owner = std::move(owner);
+}
+
+void Response::set_file(shared_ptr<const File> file) {
+    this->file = std::move(file);
 }
 
-string Response::get_headers() {
-    return this->serialized_headers;
+const shared_ptr<const File> &Response::get_file() const {
+    return this->file;
+}
+
+void Response::add_part(string data) {
+    BodyPart &part = this->parts.emplace_back();
+    part.data = std::move(data);
+}
+
+void Response::add_part(const string_view view, shared_ptr<const void> owner) {
+    BodyPart &part = this->parts.emplace_back();
+    part.view = view;
+    part.owner = std::move(owner);
+}
+
+void Response::add_part(shared_ptr<const File> file, const off_t offset, const size_t length) {
+    BodyPart &part = this->parts.emplace_back();
+    part.file = std::move(file);
+    part.offset = offset;
+    part.length = length;
+}
+
+const vector<BodyPart> &Response::get_parts() const {
+    return this->parts;
+}
+
+size_t BodyPart::size() const {
+    if (this->file)
+        return this->length;
+    return this->owner ? this->view.size() : this->data.size();
 }
 
 string Response::get_metadata() const {
     return http::STATUS_CODE_MAP[this->status_code];
 }
+
+http::StatusCode Response::get_status() const {
+    return this->status_code;
+}
+
+void Response::set_head(const string_view head, shared_ptr<const void> owner) {
+    this->head = head;
+    this->head_owner = std::move(owner);
+}
+
+string_view Response::get_head() const {
+    return this->head;
+}
+
+const shared_ptr<const void> &Response::get_head_owner() const {
+    return this->head_owner;
+}
@@ -3,7 +3,11 @@
 //
 
 #include "server.h"
+#include "byte_range.h"
+#include "content_coding.h"
+#include "validators.h"
 
+#include "delimiter_scanner.h"
 #include "file.h"
 #include "logger.h"
 #include "request.h"
@@ -11,13 +15,39 @@
 
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <format>
+#include <random>
 #include <sys/socket.h>
+#include <system_error>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+Server::Server(const ServerConfig &config) {
+  this->port = config.port;
+  this->io_backend = config.io_backend;
+  this->request_limits = config.request_limits;
+  this->max_pipelined_requests = config.max_pipelined_requests;
+  this->timeouts = config.timeouts;
+  this->cache = config.cache ? config.cache : make_cache(config, 1);
+  this->files = config.files ? config.files
+                             : make_shared<FileTable>(DEFAULT_ROOT, this->cache);
+  this->access_log = config.access_log;
+  if (this->access_log)
+    this->access_writer = this->access_log->writer();
+  this->metrics = config.metrics;
+  if (this->metrics)
+    this->worker_metrics = &this->metrics->worker();
+  this->metrics_path = config.metrics_path;
+}
 
-Server::Server(const int port, const size_t max_cache_size) {
-  this->port = port;
-  this->cache = new Cache(max_cache_size); // 10 MB cache
-  FD_ZERO(&master);
+shared_ptr<Cache> Server::make_cache(const ServerConfig &config,
+                                     const size_t shards) {
+  const size_t size = config.cache_storage == CacheStorage::MMAP
+                          ? config.max_mapped_size
+                          : config.max_cache_size;
+  return make_shared<Cache>(size, shards, config.cache_storage);
 }
 
 bool Server::init() {
@@ -35,12 +65,23 @@ bool Server::init() {
   fcntl(this->server_socket, F_SETFL, flags | O_NONBLOCK);
 
   // Set socket options
-  if (setsockopt(this->server_socket, SOL_SOCKET, SO_REUSEADDR, &flags,
-                 sizeof(flags)) == -1) {
+  constexpr int enable = 1;
+  if (setsockopt(this->server_socket, SOL_SOCKET, SO_REUSEADDR, &enable,
+                 sizeof(enable)) == -1) {
     Logger::LOG_ERROR("Error setting socket options");
     exit(1);
   }
 
+#ifdef SO_REUSEPORT
+  // Every worker binds its own listening socket to the same port, the kernel
+  // load-balances incoming connections between them
+  if (setsockopt(this->server_socket, SOL_SOCKET, SO_REUSEPORT, &enable,
+                 sizeof(enable)) == -1) {
+    Logger::LOG_ERROR("Error setting SO_REUSEPORT option");
+    exit(1);
+  }
+#endif
+
   // Bind socket to port
   this->server_address.sin_family = AF_INET;
   this->server_address.sin_addr.s_addr = INADDR_ANY;
@@ -54,144 +95,320 @@ bool Server::init() {
   }
 
   // Listen for incoming connections
-  if (listen(this->server_socket, 10) == -1) {
+  if (listen(this->server_socket, SOMAXCONN) == -1) {
     Logger::LOG_ERROR("Error listening on socket");
     exit(1);
   }
 
-  // Add server socket to master set
-  FD_SET(this->server_socket, &master);
-  this->max_fd = this->server_socket;
+#ifdef __linux__
+  if (this->io_backend == IoBackend::IO_URING && !init_uring()) {
+    Logger::LOG_WARNING("io_uring backend unavailable, falling back to epoll");
+    this->io_backend = IoBackend::EPOLL;
+  }
+#endif
 
-  Logger::LOG_INFO("Server running on port " + std::to_string(this->port));
+  string backend_name = "io_uring";
+  if (this->io_backend != IoBackend::IO_URING) {
+    this->poller = this->io_backend == IoBackend::SELECT
+                       ? make_unique<SelectPoller>()
+                       : Poller::create();
+    // Register server socket, it is the only one without a connection context
+    if (!this->poller->add(this->server_socket, Poller::READABLE, nullptr)) {
+      Logger::LOG_ERROR("Error registering server socket");
+      exit(1);
+    }
+    backend_name = this->poller->name();
+  }
+
+  Logger::LOG_INFO("Server running on port " + std::to_string(this->port) +
+                   " (" + backend_name + ")");
+  Logger::LOG_DEBUG("Request delimiter scanner: " +
+                    string(DelimiterScanner::implementation()));
 
   return true;
 }
 
-void Server::wait_for_socket_ready(const int client_socket) {
-  fd_set write_fds;
-  FD_ZERO(&write_fds);
-  FD_SET(client_socket, &write_fds);
-
-  switch (
-      select(client_socket + 1, nullptr, &write_fds, nullptr, &this->timeout)) {
-  case -1:
-    Logger::LOG_ERROR(
-        "Error in select (send retry): " +
-        string(system_error(errno, std::system_category()).what()));
-    break;
-  case 0:
-    Logger::LOG_WARNING("Send retry timeout");
-    break;
-  default:
-    break;
+void Server::run() {
+#ifdef __linux__
+  if (this->ring) {
+    run_uring();
+    return;
   }
+#endif
+  run_reactor();
 }
 
-void Server::run() {
+void Server::run_reactor() {
+  vector<Poller::Event> events;
   while (true) {
-    // Copy master set to read set
-    fd_set read_fds = master;
-
-    // Wait for activity on any socket
-    if (select(this->max_fd + 1, &read_fds, nullptr, nullptr, nullptr) == -1) {
-      Logger::LOG_ERROR("Error in select");
+    // Wait for activity, only ready sockets are reported. Don't block while
+    // connections are still waiting for their next turn, nor past the next
+    // deadline
+    const int timeout_ms =
+        this->turns.empty()
+            ? this->timers.timeout_ms(TimerWheel::Clock::now())
+            : 0;
+    if (this->poller->wait(events, timeout_ms) == -1) {
+      Logger::LOG_ERROR("Error in " + string(this->poller->name()));
       exit(1);
     }
 
-    // Check all sockets for activity
-    for (int i = 0; i <= this->max_fd; i++) {
-      if (FD_ISSET(i, &read_fds)) {
-        // If server socket has activity, accept new connection
-        if (i == this->server_socket) {
-          handle_new_connection();
-        } else {
-          // Handle client socket
-          handle_client(i);
-        }
+    for (const auto &event : events) {
+      // If server socket has activity, accept new connections
+      if (event.context == nullptr) {
+        handle_new_connection();
+        continue;
+      }
+      // Handle client socket, unless it was closed earlier in this batch
+      auto *connection = static_cast<Connection *>(event.context);
+      if (!connection->closed && (event.events & Poller::WRITABLE))
+        flush_output(*connection);
+      if (!connection->closed &&
+          (event.events & (Poller::READABLE | Poller::HANGUP)))
+        handle_client(*connection);
+      refresh_deadline(*connection);
+    }
+
+    // Give the connections waiting for it their next turn
+    vector<Connection *> pending;
+    pending.swap(this->turns);
+    for (Connection *connection : pending) {
+      connection->turn_pending = false;
+      if (connection->closed)
+        continue;
+      if (connection->input_paused &&
+          connection->queued_responses < this->max_pipelined_requests) {
+        // Parse what is buffered, then read what was left in the socket
+        resume_input(*connection);
+        if (!connection->closed && !connection->input_paused)
+          handle_client(*connection);
+      } else {
+        flush_output(*connection);
+        // Then read what was left in the socket at the end of the last turn
+        if (!connection->closed && connection->read_pending)
+          handle_client(*connection);
       }
+      refresh_deadline(*connection);
     }
+
+    expire_deadlines();
+    // Free the connections closed while handling this batch
+    this->closed_connections.clear();
   }
 }
 
 void Server::handle_new_connection() {
-  sockaddr_in client_address{};
-  socklen_t address_len = sizeof(client_address);
+  // Edge-triggered: accept until the backlog is drained
+  while (true) {
+    sockaddr_in client_address{};
+    socklen_t address_len = sizeof(client_address);
 
-  // Accept new connection
-  const int client_socket =
-      accept(this->server_socket, reinterpret_cast<sockaddr *>(&client_address),
-             &address_len);
+    // Accept new connection
+    const int client_socket = accept(
+        this->server_socket, reinterpret_cast<sockaddr *>(&client_address),
+        &address_len);
 
-  // Check for errors
-  if (client_socket == -1) {
-    Logger::LOG_ERROR("Error accepting connection");
-  }
+    // Check for errors
+    if (client_socket == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        Logger::LOG_ERROR("Error accepting connection");
+      return;
+    }
 
-  // Set client socket to non-blocking
-  const int flags = fcntl(client_socket, F_GETFL, 0);
-  fcntl(client_socket, F_SETFL, flags | O_NONBLOCK);
+    // Set client socket to non-blocking
+    const int flags = fcntl(client_socket, F_GETFL, 0);
+    fcntl(client_socket, F_SETFL, flags | O_NONBLOCK);
 
 #ifdef __APPLE__
-  // 새 클라이언트 소켓에 SO_NOSIGPIPE 옵션 설정
-  constexpr int set = 1;
-  if (setsockopt(client_socket, SOL_SOCKET, SO_NOSIGPIPE, &set, sizeof(set)) ==
-      -1) {
-    Logger::LOG_ERROR("Error setting SO_NOSIGPIPE option");
-  }
-
+    // 새 클라이언트 소켓에 SO_NOSIGPIPE 옵션 설정
+    constexpr int set = 1;
+    if (setsockopt(client_socket, SOL_SOCKET, SO_NOSIGPIPE, &set,
+                   sizeof(set)) == -1) {
+      Logger::LOG_ERROR("Error setting SO_NOSIGPIPE option");
+    }
 #endif
 
-  // Add client socket to master set
-  FD_SET(client_socket, &master);
+    // Register client socket with its connection context
+    auto connection = make_unique<Connection>(client_socket, client_address,
+                                           this->request_limits);
+    connection->access_log = this->access_writer.get();
+    connection->metrics = this->worker_metrics;
+    if (!this->poller->add(client_socket, Poller::READABLE,
+                           connection.get())) {
+      Logger::LOG_ERROR("Error registering client socket");
+      close(client_socket);
+      continue;
+    }
+    refresh_deadline(*connection);
+    this->connections[client_socket] = std::move(connection);
+    if (this->worker_metrics)
+      this->worker_metrics->connections_accepted.add();
 
-  // Update max_fd if necessary
-  if (client_socket > this->max_fd) {
-    this->max_fd = client_socket;
+    Logger::LOG_INFO("New connection from " +
+                     std::string(inet_ntoa(client_address.sin_addr)));
   }
-
-  Logger::LOG_INFO("New connection from " +
-                   std::string(inet_ntoa(client_address.sin_addr)));
 }
 
-void Server::handle_client(const int client_socket) {
-  char in_buffer[1024];
-  const long bytes_received =
-      recv(client_socket, in_buffer, sizeof(in_buffer), 0);
+void Server::handle_client(Connection &connection) {
+  const int client_socket = connection.fd;
+  // Leave the data in the socket until the queued responses drain, nothing
+  // follows the end of the stream. Level-triggered select would report the
+  // socket again on every pass, stop watching it meanwhile
+  if (connection.input_paused || connection.peer_closed) {
+    watch_readable(connection, false);
+    return;
+  }
+
+  // Edge-triggered: read until the socket is drained, or the budget is used
+  // up and the other connections get their turn first. Beyond the largest
+  // request allowed, the buffer holds enough for the parser to reject it
+  connection.read_pending = false;
+  const size_t max_input = this->request_limits.max_request_size();
+  size_t budget = READ_BUDGET;
+  while (true) {
+    if (budget == 0 || connection.input.size() > max_input) {
+      connection.read_pending = true;
+      schedule_turn(connection);
+      break;
+    }
 
-  // Check for errors
-  if (bytes_received == -1) {
-    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-      // 비차단 소켓의 일시적 상태, 무시해도 됨
+    // Receive straight into the connection's buffer
+    ssize_t bytes_received = 0;
+    const size_t used = connection.input.size();
+    connection.input.resize_and_overwrite(
+        used + READ_SIZE, [&](char *data, size_t) {
+          bytes_received = recv(client_socket, data + used, READ_SIZE, 0);
+          return used + max<ssize_t>(bytes_received, 0);
+        });
+
+    // Check for errors
+    if (bytes_received == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // 비차단 소켓의 일시적 상태, 무시해도 됨
+        break;
+      }
+      if (errno == EINTR)
+        continue;
+      Logger::LOG_ERROR("Error receiving data");
+      close_session(client_socket);
       return;
     }
-    Logger::LOG_ERROR("Error receiving data");
-    close_session(client_socket);
-    return;
+
+    // The client closed its side, answer what it sent before closing ours
+    if (bytes_received == 0) {
+      Logger::LOG_INFO("Connection closed");
+      connection.peer_closed = true;
+      watch_readable(connection, false);
+      break;
+    }
+    budget -= min(budget, static_cast<size_t>(bytes_received));
   }
 
-  // Check for closed connection
-  if (bytes_received == 0) {
-    Logger::LOG_INFO("Connection closed");
-    close_session(client_socket);
+  if (connection.timed())
+    connection.received_at = AccessRecord::Clock::now();
+  process_input(connection);
+}
+
+void Server::process_input(Connection &connection) {
+  RequestParser &parser = connection.parser;
+  // Nothing after a request answered with Connection: close is served
+  while (!connection.closed && !connection.close_after_write) {
+    // Stop answering pipelined requests the client isn't reading
+    if (connection.queued_responses >= this->max_pipelined_requests) {
+      connection.input_paused = true;
+      break;
+    }
+    // A request starts with the read that brought its first bytes
+    if (connection.timed() &&
+        connection.request_started == AccessRecord::Clock::time_point() &&
+        connection.input.size() > parser.request_start())
+      connection.request_started = connection.received_at;
+    const auto result = parser.parse(connection.input);
+    if (result == RequestParser::Result::INCOMPLETE)
+      break;
+    if (result == RequestParser::Result::ERROR) {
+      reject_request(connection);
+      break;
+    }
+
+    // The request views the input, which stays untouched until it is handled
+    const Request request = parser.request(connection.input);
+    parser.next();
+    handle_request(request, connection);
+  }
+
+  if (connection.closed)
     return;
+  // A request cut short by the end of the stream is never completed
+  if (connection.peer_closed && !connection.input_paused)
+    connection.close_after_write = true;
+  if (connection.close_after_write) {
+    connection.input.clear();
+  } else if (const size_t consumed = parser.request_start(); consumed > 0) {
+    // Drop the handled requests at once rather than after each of them
+    connection.input.erase(0, consumed);
+    parser.discard(consumed);
   }
 
-  // Check for end of request
-  if (auto buffer = string(in_buffer, bytes_received);
-      buffer.find("\r\n\r\n") != string::npos) {
-    // Create request
-    const Request request(buffer);
-    handle_request(request, client_socket);
+  // Send the responses of the whole batch together
+  flush_output(connection);
+}
+
+void Server::reject_request(Connection &connection) {
+  const RequestParser &parser = connection.parser;
+  if (connection.timed())
+    begin_access(connection, nullptr);
+  Logger::LOG_WARNING("Rejecting request: " + string(parser.error_reason()));
+  // The rest of the stream can't be framed after a malformed request
+  Response response(string(parser.error_reason()), parser.error(),
+                    {{http::HTTPHeaders::CONTENT_TYPE, "text/html"}}, false);
+  send_response(response, connection, false);
+}
+
+void Server::begin_access(Connection &connection, const Request *request) {
+  AccessRecord &access = connection.access;
+  access = AccessRecord();
+  access.time = time(nullptr);
+  access.address = connection.address.sin_addr;
+  access.parsed = AccessRecord::Clock::now();
+  access.started =
+      connection.request_started != AccessRecord::Clock::time_point()
+          ? connection.request_started
+          : access.parsed;
+  connection.request_started = AccessRecord::Clock::time_point();
+  if (connection.metrics)
+    connection.metrics->requests.add();
+  if (!connection.access_log)
+    return;
+  // Malformed requests are logged without their fields
+  if (request == nullptr) {
+    access.target = "-";
+    return;
   }
+  access.method = request->method;
+  access.target = request->path;
+  if (!request->query.empty()) {
+    access.target += '?';
+    access.target += request->query;
+  }
+  access.version = request->version;
+  access.referer = request->header(http::HTTPHeaders::REFERER);
+  access.user_agent = request->header(http::HTTPHeaders::USER_AGENT);
 }
 
-void Server::handle_request(const Request &request, const int client_socket) {
-  // Check keep-alive
-  const bool keep_alive =
-      request.headers.find(http::HTTPHeaders::CONNECTION)->second != "close";
+void Server::handle_request(const Request &request, Connection &connection) {
+  if (connection.timed())
+    begin_access(connection, &request);
+  // Check keep-alive, the last request allowed on a connection closes it
+  connection.requests++;
+  const bool keep_alive = request.keep_alive() &&
+                          connection.requests < Response::KEEP_ALIVE_MAX;
+  if (connection.metrics && request.keep_alive() && !keep_alive)
+    connection.metrics->request_limit_closes.add();
   // Handle request
-  Logger::LOG_INFO("Received request: " + request.path);
+  Logger::LOG_INFO("Received request: " + string(request.path));
 
   // Check if request method is GET
   if (request.method != http::Method::GET) {
@@ -199,153 +416,772 @@ void Server::handle_request(const Request &request, const int client_socket) {
     Response response("Method not allowed",
                       http::StatusCode::METHOD_NOT_ALLOWED,
                       {{"Content-Type", "text/html"}}, keep_alive);
-    send_response(response, client_socket, keep_alive);
+    send_response(response, connection, keep_alive);
     return;
   }
 
-  if (request.path == "/") {
+  // One key per file, however its path is spelled
+  const string path = request.normalized_path();
+  if (this->metrics && path == this->metrics_path) {
+    send_metrics(connection, keep_alive);
+    return;
+  }
+
+  if (path == "/") {
     // Redirect to index.html
     Response response("", http::StatusCode::PERMANENT_REDIRECT,
                       {{"Location", +"/" + DEFAULT_INDEX}}, keep_alive);
-    send_response(response, client_socket, keep_alive);
+    send_response(response, connection, keep_alive);
+    return;
   }
 
-  handle_get_request(request, client_socket, keep_alive);
+  handle_get_request(request, path, connection, keep_alive);
 }
 
-void Server::handle_get_request(const Request &request, const int client_socket,
-                                const bool keep_alive) {
-  string path = DEFAULT_ROOT + request.path;
+string Server::content_type(const string_view path) {
+  // Get Content-Type from the extension
+  const size_t pos = path.find_last_of('.');
+  if (pos == string_view::npos)
+    return http::DEFAULT_MIME_TYPE;
+  const auto it = http::EXTENSION_TO_MIME.find(string(path.substr(pos)));
+  return it != http::EXTENSION_TO_MIME.end() ? it->second
+                                             : http::DEFAULT_MIME_TYPE;
+}
+
+void Server::handle_get_request(const Request &request,
+                                const string &request_path,
+                                Connection &connection, const bool keep_alive) {
+  // Check if request uses cache
+  const bool use_cache =
+      !request.header_has_token(http::HTTPHeaders::CACHE_CONTROL, "no-cache");
+  const string_view range = request.header(http::HTTPHeaders::RANGE);
 
-  // Load file
+  // Most requests are answered from the cache with a stored head, without
+  // opening the file or looking up its type. The variants the client
+  // accepts are tried first, preferred first, then the identity copy
+  CacheHandle identity;
+  const bool looked_up = use_cache && range.empty();
+  if (looked_up) {
+    array<http::ContentCoding, 2> codings{};
+    const size_t coding_count = http::preferred_codings(
+        request.header(http::HTTPHeaders::ACCEPT_ENCODING), codings);
+    array<string, 3> keys;
+    for (size_t i = 0; i < coding_count; i++)
+      keys[i] = Cache::variant_key(request_path, http::coding_name(codings[i]));
+    keys[coding_count] = request_path;
+    const CacheHandle cached =
+        cache_lookup(connection, span(keys.data(), coding_count + 1));
+    // Unless a variant the client accepts has yet to be made
+    if (cached && !(cached->encodable && coding_count > 0)) {
+      send_cached(request, cached, connection, keep_alive);
+      return;
+    }
+    identity = cached;
+  }
+
+  // Load file, kept open while it doesn't change. A change noticed once it
+  // is open keeps it out of the cache
+  const uint64_t generation = this->cache->generation(request_path);
   try {
-    const File file(path.c_str());
-    // Check if request uses cache
-    const bool use_cache =
-        request.headers.find(http::HTTPHeaders::CACHE_CONTROL)->second !=
-        "no-cache";
-
-    char *data = nullptr;
-    size_t size = 0;
-
-    if (use_cache && file.size() < cache->get_max_size()) {
-      // Check if file is in cache
-      if (!this->cache->contains(request.path)) {
-        this->cache->set(request.path, file);
-      }
+    const auto file = this->files->open(request_path);
+    const string mime_type = content_type(request_path);
+    const bool compressible = http::is_compressible(mime_type);
+    map<string, string> headers = {
+        {http::HTTPHeaders::CONTENT_TYPE, mime_type},
+        {http::HTTPHeaders::ACCEPT_RANGES, "bytes"},
+        {http::HTTPHeaders::ETAG, file->etag()},
+        {http::HTTPHeaders::LAST_MODIFIED, file->last_modified()}};
 
-      // Get file from cache
-      const auto [cached_data, cached_size] = this->cache->get(request.path);
-      data = cached_data;
-      size = cached_size;
-    } else {
-      // Read file directly
-      size = file.size();
-      data = new char[file.size()];
-      file.read(data);
+    // Responses of compressible files depend on Accept-Encoding, ranges
+    // select bytes of the identity representation
+    if (compressible) {
+      headers[http::HTTPHeaders::VARY] = http::HTTPHeaders::ACCEPT_ENCODING;
+      if (range.empty() &&
+          send_encoded(request, request_path, connection, keep_alive, *file,
+                       headers, looked_up, generation))
+        return;
     }
 
-    // Get Content-Type from path
-    const size_t pos = request.path.find_last_of('.');
-    string content_type = http::DEFAULT_MIME_TYPE;
-    if (pos != string::npos)
-      content_type = http::EXTENSION_TO_MIME[request.path.substr(pos)];
+    // Validators are checked before ranges, a current copy needs neither
+    if (is_not_modified(request, file->etag(), file->last_modified(),
+                        file->modified())) {
+      send_not_modified(connection, keep_alive, headers);
+      return;
+    }
 
-    Response response(string(data, size), http::StatusCode::OK,
-                      {{http::HTTPHeaders::CONTENT_TYPE, content_type}},
-                      keep_alive);
-    send_response(response, client_socket, keep_alive);
-    // Clean up
-    if (!use_cache)
-      delete[] data;
+    vector<http::ByteRange> ranges;
+    if (!range.empty() && if_range_matches(request, *file)) {
+      switch (http::parse_ranges(range, file->size(), ranges)) {
+      case http::RangeResult::UNSATISFIABLE: {
+        Response response("The requested range is not satisfiable",
+                          http::StatusCode::RANGE_NOT_SATISFIABLE,
+                          {{http::HTTPHeaders::CONTENT_TYPE, "text/html"},
+                           {http::HTTPHeaders::CONTENT_RANGE,
+                            "bytes */" + to_string(file->size())}},
+                          keep_alive);
+        send_response(response, connection, keep_alive);
+        return;
+      }
+      case http::RangeResult::IGNORED:
+        ranges.clear();
+        break;
+      default:
+        break;
+      }
+    }
+
+    CacheHandle cached;
+    if (use_cache && file->size() < cache->get_max_entry_size()) {
+      // Get file from cache, or try to add it, its heads serialized once
+      cached = looked_up ? identity
+                         : cache_lookup(connection, span(&request_path, 1));
+      // Marked encodable only if a variant can be sent, otherwise clients
+      // accepting compression take the fast path as well
+      if (!cached)
+        cached = this->cache->set(
+            request_path, *file, cached_heads(headers, file->size(), *file),
+            generation, compressible && has_variants(request_path, *file));
+    }
+
+    if (!ranges.empty()) {
+      send_ranges(connection, keep_alive, headers, ranges, cached, file);
+    } else if (cached) {
+      // The response references the cached bytes
+      send_cached(request, cached, connection, keep_alive);
+    } else {
+      // Stream the file after the headers instead of reading it into memory
+      Response response("", http::StatusCode::OK, headers, keep_alive);
+      response.set_file(file);
+      send_response(response, connection, keep_alive);
+    }
 
   } catch (const std::exception &e) {
     // Create error response
     Response response(e.what(), http::StatusCode::NOT_FOUND,
                       {{http::HTTPHeaders::CONTENT_TYPE, "text/html"}},
                       keep_alive);
-    send_response(response, client_socket, keep_alive);
-  }
-}
-ssize_t Server::send_with_retry(const int client_socket, const string &data) {
-  short retry_count = 0;
-  ssize_t result = 0;
-  do {
-    result = send(client_socket, data.c_str(), data.size(), send_option);
-    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-      // Non-blocking mode, retry
-      wait_for_socket_ready(client_socket);
-      if (FD_ISSET(client_socket, &master) == 0)
-        break;
-    } else
+    send_response(response, connection, keep_alive);
+  }
+}
+
+bool Server::if_range_matches(const Request &request, const File &file) {
+  const string_view validator = request.header(http::HTTPHeaders::IF_RANGE);
+  if (validator.empty())
+    return true;
+  // Compared strongly, weak tags never match
+  if (validator.starts_with('"') || validator.starts_with("W/"))
+    return validator == file.etag();
+  return validator == file.last_modified();
+}
+
+bool Server::is_not_modified(const Request &request, const string_view etag,
+                             const string_view last_modified,
+                             const time_t modified) {
+  // If-Modified-Since is ignored when If-None-Match is present
+  if (const string_view tags =
+          request.header(http::HTTPHeaders::IF_NONE_MATCH);
+      !tags.empty())
+    return http::tag_list_matches(tags, etag);
+  const string_view since =
+      request.header(http::HTTPHeaders::IF_MODIFIED_SINCE);
+  if (since.empty())
+    return false;
+  // Clients usually send back the date they were given
+  if (since == last_modified)
+    return true;
+  time_t time;
+  return http::parse_http_date(since, time) && modified <= time;
+}
+
+map<string, string> Server::not_modified_headers(map<string, string> headers) {
+  // Only the validators and Vary of the response the client has
+  headers.erase(http::HTTPHeaders::CONTENT_TYPE);
+  headers.erase(http::HTTPHeaders::CONTENT_ENCODING);
+  headers.erase(http::HTTPHeaders::ACCEPT_RANGES);
+  return headers;
+}
+
+void Server::send_not_modified(Connection &connection, const bool keep_alive,
+                               map<string, string> headers) {
+  Response response("", http::StatusCode::NOT_MODIFIED,
+                    not_modified_headers(std::move(headers)), keep_alive);
+  send_response(response, connection, keep_alive);
+}
+
+void Server::send_ranges(Connection &connection, const bool keep_alive,
+                         map<string, string> headers,
+                         const vector<http::ByteRange> &ranges,
+                         const CacheHandle &cached,
+                         const shared_ptr<const File> &file) {
+  const string size = to_string(file->size());
+  const auto content_range = [&size](const http::ByteRange &range) {
+    return "bytes " + to_string(range.first) + "-" + to_string(range.last) +
+           "/" + size;
+  };
+  // Bytes of a range from the cached copy, or straight from the file
+  const auto add_range = [&cached, &file](Response &response,
+                                          const http::ByteRange &range) {
+    if (!cached) {
+      response.add_part(file, static_cast<off_t>(range.first), range.length());
+      return;
+    }
+    size_t position = 0;
+    for (const string_view block : cached->data) {
+      if (position + block.size() > range.first && position <= range.last) {
+        const size_t begin = range.first > position ? range.first - position : 0;
+        const size_t end = min(block.size(), range.last + 1 - position);
+        response.add_part(block.substr(begin, end - begin), cached);
+      }
+      position += block.size();
+    }
+  };
+
+  if (ranges.size() == 1) {
+    headers[http::HTTPHeaders::CONTENT_RANGE] = content_range(ranges.front());
+    Response response("", http::StatusCode::PARTIAL_CONTENT, headers,
+                      keep_alive);
+    add_range(response, ranges.front());
+    send_response(response, connection, keep_alive);
+    return;
+  }
+
+  // Several ranges go in a multipart body, each part with its own headers
+  thread_local mt19937_64 random(random_device{}());
+  const string boundary = format("{:016x}{:016x}", random(), random());
+  const string part_type = headers[http::HTTPHeaders::CONTENT_TYPE];
+  headers[http::HTTPHeaders::CONTENT_TYPE] =
+      "multipart/byteranges; boundary=" + boundary;
+  Response response("", http::StatusCode::PARTIAL_CONTENT, headers,
+                    keep_alive);
+  for (const http::ByteRange &range : ranges) {
+    response.add_part(format("\r\n--{}\r\n{}: {}\r\n{}: {}\r\n\r\n",
+                             boundary, http::HTTPHeaders::CONTENT_TYPE,
+                             part_type, http::HTTPHeaders::CONTENT_RANGE,
+                             content_range(range)));
+    add_range(response, range);
+  }
+  response.add_part("\r\n--" + boundary + "--\r\n");
+  send_response(response, connection, keep_alive);
+}
+
+bool Server::has_variants(const string &request_path, const File &file) {
+  for (const auto coding :
+       {http::ContentCoding::BROTLI, http::ContentCoding::GZIP}) {
+    if (http::can_compress(coding) && file.size() >= MIN_COMPRESS_SIZE &&
+        file.size() <= MAX_COMPRESS_SIZE)
+      return true;
+    if (this->files->find(request_path +
+                          string(http::sidecar_extension(coding))))
+      return true;
+  }
+  return false;
+}
+
+bool Server::send_encoded(const Request &request, const string &request_path,
+                          Connection &connection, const bool keep_alive,
+                          const File &file,
+                          const map<string, string> &identity_headers,
+                          const bool looked_up, const uint64_t generation) {
+  array<http::ContentCoding, 2> codings{};
+  const size_t coding_count = http::preferred_codings(
+      request.header(http::HTTPHeaders::ACCEPT_ENCODING), codings);
+
+  for (const auto coding : span(codings.data(), coding_count)) {
+    map<string, string> headers = identity_headers;
+    headers[http::HTTPHeaders::CONTENT_ENCODING] = http::coding_name(coding);
+    // The variant is validated by the file its bytes come from, the sidecar
+    // changes independently of the file. Checked once the coding is known
+    // to be available
+    const auto not_modified = [&](const File &source) {
+      headers[http::HTTPHeaders::ETAG] =
+          http::entity_tag(source.etag(), http::coding_name(coding));
+      headers[http::HTTPHeaders::LAST_MODIFIED] = source.last_modified();
+      if (!is_not_modified(request, headers[http::HTTPHeaders::ETAG],
+                           source.last_modified(), source.modified()))
+        return false;
+      send_not_modified(connection, keep_alive, headers);
+      return true;
+    };
+
+    // Variants are cached beside the identity copy of the file. Made by the
+    // server, they are used despite a client's no-cache
+    const string key =
+        Cache::variant_key(request_path, http::coding_name(coding));
+    // Missed already if looked up with the identity copy
+    if (!looked_up) {
+      if (const auto cached = cache_lookup(connection, span(&key, 1))) {
+        send_cached(request, cached, connection, keep_alive);
+        return true;
+      }
+    }
+
+    // Precompressed sidecar next to the file, such as index.html.br
+    if (const auto sidecar = this->files->find(
+            request_path + string(http::sidecar_extension(coding)))) {
+      if (not_modified(*sidecar))
+        return true;
+      if (sidecar->size() < cache->get_max_entry_size()) {
+        if (const auto cached = this->cache->set(
+                key, *sidecar, cached_heads(headers, sidecar->size(), *sidecar),
+                generation)) {
+          send_cached(request, cached, connection, keep_alive);
+          return true;
+        }
+      }
+      Response response("", http::StatusCode::OK, headers, keep_alive);
+      response.set_file(sidecar);
+      send_response(response, connection, keep_alive);
+      return true;
+    }
+
+    // Otherwise compress on the fly, if the file is worth it
+    if (!http::can_compress(coding) || file.size() < MIN_COMPRESS_SIZE ||
+        file.size() > MAX_COMPRESS_SIZE)
+      continue;
+    if (not_modified(file))
+      return true;
+    // Compressed before, when the cache didn't take it
+    const string encoded_key = key + file.etag();
+    for (const auto &[stored_key, encoded] : this->encoded_responses) {
+      if (encoded && stored_key == encoded_key) {
+        send_cached(request, encoded, connection, keep_alive);
+        return true;
+      }
+    }
+    string content(file.size(), '\0');
+    for (size_t offset = 0; offset < content.size();) {
+      const ssize_t bytes_read =
+          file.read_at(content.data() + offset, content.size() - offset,
+                       static_cast<off_t>(offset));
+      if (bytes_read <= 0)
+        return false;
+      offset += bytes_read;
+    }
+    string body;
+    if (!http::compress(coding, content, body))
+      continue;
+    // Content that doesn't shrink is stored as is, so it isn't compressed
+    // again on the next request
+    if (body.size() >= content.size()) {
+      headers = identity_headers;
+      body = std::move(content);
+    }
+
+    CachedHeads heads = cached_heads(headers, body.size(), file);
+    if (body.size() < cache->get_max_entry_size()) {
+      if (const auto cached = this->cache->set(key, body, heads, generation)) {
+        send_cached(request, cached, connection, keep_alive);
+        return true;
+      }
+    }
+    // Declined by the cache, kept by the worker instead, oldest replaced
+    const auto encoded = make_shared<CachedFile>(nullptr);
+    encoded->owned = std::move(body);
+    encoded->data.emplace_back(encoded->owned);
+    encoded->size = encoded->owned.size();
+    encoded->heads = std::move(heads);
+    this->encoded_responses[this->next_encoded_response++ %
+                            this->encoded_responses.size()] = {encoded_key,
+                                                               encoded};
+    send_cached(request, encoded, connection, keep_alive);
+    return true;
+  }
+  return false;
+}
+
+CacheHandle Server::cache_lookup(Connection &connection,
+                                 const span<const string> keys) {
+  if (!connection.access_log)
+    return this->cache->get_first(keys);
+  const auto start = AccessRecord::Clock::now();
+  CacheHandle cached = this->cache->get_first(keys);
+  connection.access.cache_lookup += AccessRecord::Clock::now() - start;
+  return cached;
+}
+
+CachedHeads Server::cached_heads(const map<string, string> &headers,
+                                 const size_t content_length,
+                                 const File &file) {
+  const Response ok(http::StatusCode::OK, headers);
+  const Response not_modified(http::StatusCode::NOT_MODIFIED,
+                              not_modified_headers(headers));
+  return {ok.serialize_head(content_length), not_modified.serialize_head(0),
+          headers.at(http::HTTPHeaders::ETAG), file.last_modified(),
+          file.modified()};
+}
+
+void Server::send_cached(const Request &request, const CacheHandle &cached,
+                         Connection &connection, const bool keep_alive) {
+  const CachedHeads &heads = cached->heads;
+  if (is_not_modified(request, heads.etag, heads.last_modified,
+                      heads.modified)) {
+    Response response("", http::StatusCode::NOT_MODIFIED, {}, keep_alive);
+    response.set_head(heads.not_modified, cached);
+    send_response(response, connection, keep_alive);
+    return;
+  }
+  Response response("", http::StatusCode::OK, {}, keep_alive);
+  response.set_head(heads.ok, cached);
+  response.set_body(cached->data, cached);
+  send_response(response, connection, keep_alive);
+}
+
+void Server::send_metrics(Connection &connection, const bool keep_alive) {
+  string body;
+  this->metrics->write(body);
+
+  const Cache::Stats cache = this->cache->stats();
+  Metrics::write_counter(body, "webserver_cache_hits_total",
+                         "Cache lookups finding the file", cache.hits);
+  Metrics::write_counter(body, "webserver_cache_misses_total",
+                         "Cache lookups missing the file", cache.misses);
+  Metrics::write_counter(body, "webserver_cache_evictions_total",
+                         "Cache entries evicted to make room",
+                         cache.evictions);
+  Metrics::write_counter(body, "webserver_cache_rejections_total",
+                         "Files refused by the cache admission policy",
+                         cache.rejections);
+  Metrics::write_counter(body, "webserver_cache_copied_bytes_total",
+                         "Bytes copied into the cache", cache.bytes_copied);
+  Metrics::write_gauge(body, "webserver_cache_entries", "Cached files",
+                       static_cast<double>(cache.entries));
+  Metrics::write_gauge(body, "webserver_cache_resident_bytes",
+                       "Bytes of the cached files",
+                       static_cast<double>(cache.size));
+  Metrics::write_gauge(body, "webserver_cache_allocated_bytes",
+                       "Cache memory backing live entries, pinned ones "
+                       "included",
+                       static_cast<double>(cache.storage.bytes_allocated));
+
+  const Logger::Stats log = Logger::stats();
+  Metrics::write_counter(body, "webserver_log_records_total",
+                         "Log records written", log.written);
+  Metrics::write_counter(body, "webserver_log_dropped_total",
+                         "Log records dropped on a full ring", log.dropped);
+  if (this->access_log)
+    Metrics::write_counter(body, "webserver_access_log_dropped_total",
+                           "Access log records dropped on a full ring",
+                           this->access_log->dropped());
+
+  Response response(std::move(body), http::StatusCode::OK,
+                    {{http::HTTPHeaders::CONTENT_TYPE,
+                      "text/plain; version=0.0.4; charset=utf-8"},
+                     {http::HTTPHeaders::CACHE_CONTROL, "no-store"}},
+                    keep_alive);
+  send_response(response, connection, keep_alive);
+}
+
+ssize_t Server::send_gathered(Connection &connection) {
+  // Gather the consecutive in-memory segments at the front of the output
+  connection.iov.clear();
+  bool more = false;
+  for (const auto &segment : connection.output) {
+    if (segment.file || connection.iov.size() == MAX_IOV) {
+      more = true;
       break;
-  } while (result < 0 && ++retry_count < max_retries);
+    }
+    connection.iov.push_back(
+        {const_cast<char *>(segment.bytes().data()) + segment.offset,
+         segment.remaining()});
+  }
 
-  if (retry_count == max_retries)
-    Logger::LOG_WARNING("Max retries reached for sending data");
+  msghdr message{};
+  message.msg_iov = connection.iov.data();
+  message.msg_iovlen = connection.iov.size();
+  int flags = send_option;
+#ifdef MSG_MORE
+  // More data follows, let the kernel pack it into the same TCP segments
+  if (more)
+    flags |= MSG_MORE;
+#endif
+  return sendmsg(connection.fd, &message, flags);
+}
 
-  if (result <= 0) {
-    if (errno != EPIPE)
-      Logger::LOG_WARNING(
-          "Error sending data: " +
-          string(system_error(errno, std::system_category()).what()));
-    close_session(client_socket);
+ssize_t Server::send_file(Connection &connection,
+                          const OutputSegment &segment) {
+#ifdef __linux__
+  // Once a connection fell back to splicing, bytes may be left in its pipe
+  if (connection.pipe_fds[0] == -1) {
+    // Straight from the page cache to the socket, no user-space copy
+    off_t offset = segment.offset;
+    const ssize_t sent = sendfile(connection.fd, segment.file->descriptor(),
+                                  &offset, segment.length);
+    if (sent != -1 || (errno != EINVAL && errno != ENOSYS))
+      return sent;
   }
+  // File system without sendfile support
+  return splice_file(connection, segment);
+#else
+  // Copy the next chunk through the staging buffer
+  connection.staging.resize(min(FILE_CHUNK_SIZE, segment.length));
+  const ssize_t bytes_read = segment.file->read_at(
+      connection.staging.data(), connection.staging.size(), segment.offset);
+  if (bytes_read <= 0)
+    return -1;
+  return send(connection.fd, connection.staging.data(), bytes_read,
+              send_option);
+#endif
+}
 
-  return result;
+#ifdef __linux__
+ssize_t Server::splice_file(Connection &connection,
+                            const OutputSegment &segment) {
+  int *pipe_fds = connection.pipe_fds;
+  if (pipe_fds[0] == -1 && pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1)
+    return -1;
+
+  // Top the pipe up with file pages, it is full when this returns EAGAIN
+  if (connection.piped < segment.length) {
+    loff_t offset = segment.offset + static_cast<loff_t>(connection.piped);
+    const ssize_t filled =
+        splice(segment.file->descriptor(), &offset, pipe_fds[1], nullptr,
+               min(FILE_CHUNK_SIZE, segment.length - connection.piped),
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (filled > 0)
+      connection.piped += filled;
+    else if (filled == 0 || errno != EAGAIN)
+      return -1;
+  }
+
+  // Move the pages on to the socket
+  const ssize_t sent =
+      splice(pipe_fds[0], nullptr, connection.fd, nullptr, connection.piped,
+             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (sent > 0)
+    connection.piped -= sent;
+  return sent;
 }
+#endif
 
-void Server::send_response(Response &response, const int client_socket,
+void Server::send_response(Response &response, Connection &connection,
                            const bool keep_alive) {
   Logger::LOG_INFO("Sending response: " + response.get_metadata());
   // Serialize response
   response.serialize();
-  const string headers = response.get_headers();
-  const string &body = response.get_body();
+  const size_t body_bytes = connection.queue_response(response);
+
+  // The record is logged once the last byte is sent
+  if (connection.timed()) {
+    AccessRecord &access = connection.access_records.emplace_back(
+        std::move(connection.access));
+    access.status = response.get_status();
+    access.bytes = body_bytes;
+  }
 
-  if (body.size() < DEFAULT_BUFFER_SIZE - headers.size()) {
-    const string serialized_response = headers + "\r\n\r\n" + body;
-    send_with_retry(client_socket, serialized_response);
+  // Sent once the whole batch of requests is handled
+  if (!keep_alive)
+    connection.close_after_write = true;
+}
+
+void Server::flush_output(Connection &connection) {
+#ifdef __linux__
+  if (this->ring) {
+    submit_output(connection);
     return;
   }
+#endif
+  // A connection waiting for its next turn must not jump the queue
+  if (connection.turn_pending)
+    return;
 
-  // Send headers
-  if (send_with_retry(client_socket, headers) <= 0) {
-    Logger::LOG_WARNING("Failed to send response headers");
-  };
+  size_t budget = WRITE_BUDGET;
+  while (!connection.output.empty()) {
+    if (budget == 0) {
+      // The socket may still be writable, continue after the other
+      // connections had their turn
+      schedule_turn(connection);
+      return;
+    }
 
-  // Send data in chunks
-  size_t offset = 0;
-  while (offset < body.size()) {
-    // Calculate the size of the chunk
-    const size_t chunk_size =
-        min(Server::DEFAULT_BUFFER_SIZE, body.size() - offset);
-    // Create the chunk & Send it
-    string chunk = response.get_chunk(offset, chunk_size);
-    const ssize_t send_size = send_with_retry(client_socket, chunk);
-    if (send_size <= 0)
+    const ssize_t sent = connection.output.front().file
+                             ? send_file(connection, connection.output.front())
+                             : send_gathered(connection);
+    if (sent == -1) {
+      if (errno == EINTR)
+        continue;
+      // Socket buffer full, resume once the poller reports it writable
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        watch_writable(connection, true);
+        return;
+      }
+      if (errno != EPIPE && errno != ECONNRESET)
+        Logger::LOG_WARNING(
+            "Error sending data: " +
+            string(system_error(errno, std::system_category()).what()));
+      close_session(connection.fd);
+      return;
+    }
+    if (sent == 0) {
+      // Only a file that shrank while being sent ends early
+      Logger::LOG_WARNING("File truncated while sending");
+      close_session(connection.fd);
       return;
-    // Update offset
-    offset += send_size;
+    }
+
+    connection.consume_output(sent);
+    budget -= min(budget, static_cast<size_t>(sent));
   }
-  if (!keep_alive)
-    close_session(client_socket);
+
+  // Everything sent
+  watch_writable(connection, false);
+  if (!connection.closed && connection.close_after_write)
+    close_session(connection.fd);
+  if (connection.input_paused)
+    schedule_turn(connection);
+}
+
+void Server::schedule_turn(Connection &connection) {
+  if (connection.turn_pending)
+    return;
+  connection.turn_pending = true;
+  this->turns.push_back(&connection);
+}
+
+void Server::refresh_deadline(Connection &connection) {
+  if (connection.closed)
+    return;
+  // What the connection waits for, and the progress restarting its clock
+  Deadline deadline = Deadline::IDLE;
+  size_t mark = connection.requests;
+  if (!connection.output.empty()) {
+    deadline = Deadline::WRITE;
+    mark = connection.bytes_sent;
+  } else if (connection.input.size() > connection.parser.request_start()) {
+    deadline = connection.parser.reading_body() ? Deadline::BODY
+                                                : Deadline::HEADER;
+  }
+  if (deadline == connection.deadline && mark == connection.deadline_mark)
+    return;
+
+  chrono::seconds limit = Response::KEEP_ALIVE_TIMEOUT;
+  if (deadline == Deadline::HEADER)
+    limit = this->timeouts.header;
+  else if (deadline == Deadline::BODY)
+    limit = this->timeouts.body;
+  else if (deadline == Deadline::WRITE)
+    limit = this->timeouts.write;
+  connection.deadline = deadline;
+  connection.deadline_mark = mark;
+  connection.timer.context = &connection;
+  this->timers.arm(connection.timer, TimerWheel::Clock::now() + limit);
+}
+
+void Server::expire_deadlines() {
+  this->timers.advance(TimerWheel::Clock::now(),
+                       [this](const TimerWheel::Timer &timer) {
+                         handle_timeout(
+                             *static_cast<Connection *>(timer.context));
+                       });
+}
+
+void Server::handle_timeout(Connection &connection) {
+  const Deadline deadline = connection.deadline;
+  connection.deadline = Deadline::NONE;
+  if (connection.metrics)
+    connection.metrics->timeouts[static_cast<size_t>(deadline) - 1].add();
+
+  // Idle clients and clients not reading are simply dropped
+  if (deadline != Deadline::HEADER && deadline != Deadline::BODY) {
+    Logger::LOG_INFO("Connection timed out");
+    close_session(connection.fd);
+    return;
+  }
+
+  // A request too slow to arrive is answered, then the connection closes
+  Logger::LOG_WARNING("Request timed out");
+  if (connection.timed())
+    begin_access(connection, nullptr);
+  Response response("Request timeout", http::StatusCode::REQUEST_TIMEOUT,
+                    {{http::HTTPHeaders::CONTENT_TYPE, "text/html"}}, false);
+  send_response(response, connection, false);
+  flush_output(connection);
+  refresh_deadline(connection);
+}
+
+void Server::resume_input(Connection &connection) {
+  // io_uring keeps receiving while paused, only parsing has to resume. A
+  // poller watches the socket again, it never stopped with io_uring
+  if (connection.input_paused &&
+      connection.queued_responses < this->max_pipelined_requests) {
+    connection.input_paused = false;
+    if (!connection.peer_closed)
+      watch_readable(connection, true);
+    process_input(connection);
+  }
+}
+
+void Server::watch_readable(Connection &connection, const bool enable) {
+  if (connection.watching_readable != enable)
+    watch(connection, enable, connection.watching_writable);
+}
+
+void Server::watch_writable(Connection &connection, const bool enable) {
+  if (connection.watching_writable != enable)
+    watch(connection, connection.watching_readable, enable);
+}
+
+void Server::watch(Connection &connection, const bool readable,
+                   const bool writable) {
+  if (connection.closed)
+    return;
+  if (!this->poller->modify(connection.fd,
+                            (readable ? Poller::READABLE : 0) |
+                                (writable ? Poller::WRITABLE : 0),
+                            &connection)) {
+    Logger::LOG_ERROR("Error updating client socket registration");
+    close_session(connection.fd);
+    return;
+  }
+  connection.watching_readable = readable;
+  connection.watching_writable = writable;
 }
 
 void Server::close_session(const int fd) {
-  close(fd);
-  FD_CLR(fd, &master);
+  const auto it = this->connections.find(fd);
+  if (it == this->connections.end() || it->second->closed)
+    return;
+  Connection &connection = *it->second;
+  connection.closed = true;
+  this->timers.cancel(connection.timer);
+
+#ifdef __linux__
+  // Operations in flight still reference the connection: shutting the socket
+  // down completes them, the last completion releases it
+  if (this->ring) {
+    shutdown(fd, SHUT_RDWR);
+    if (connection.pending_operations > 0)
+      return;
+  }
+#endif
+  release_connection(connection);
+}
+
+void Server::release_connection(Connection &connection) {
+  const auto it = this->connections.find(connection.fd);
+  if (it == this->connections.end() || it->second.get() != &connection)
+    return;
+
+  // Deregister before closing, the descriptor number may be reused right away
+  if (this->poller)
+    this->poller->remove(connection.fd);
+  close(connection.fd);
+  if (connection.metrics)
+    connection.metrics->connections_closed.add();
+  // Keep the context alive until the current batch of events is processed
+  this->closed_connections.push_back(std::move(it->second));
+  this->connections.erase(it);
 }
 
 Server::~Server() {
+#ifdef __linux__
+  // Tear down the ring first, it may still reference connection buffers
+  this->ring.reset();
+#endif
   // Close server socket
   close(this->server_socket);
-  // Delete cache
-  delete this->cache;
-  // Clear master set
-  for (int i = 0; i <= this->max_fd; i++)
-    if (FD_ISSET(i, &master))
-      close(i);
+  // Close client sockets
+  for (const auto &[fd, connection] : this->connections)
+    close(fd);
 
   Logger::LOG_INFO("Server shutdown");
 }
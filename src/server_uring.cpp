@@ -0,0 +1,364 @@
+#ifdef __linux__
+
+#include "server.h"
+
+#include "logger.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <sys/socket.h>
+#include <system_error>
+
+// Operation stored in the low bits of the SQE user data, next to the
+// connection pointer (heap allocations are at least 8-byte aligned)
+enum Operation : uint64_t {
+  ACCEPT = 0,
+  RECV = 1,
+  SENDMSG = 2,
+  SEND_FILE = 3,
+  READ_FILE = 4,
+  TIMER = 5,
+  ACCEPT_RETRY = 6
+};
+static constexpr uint64_t OPERATION_MASK = 7;
+
+static uint64_t encode(const Connection *connection, const Operation operation) {
+  return reinterpret_cast<uint64_t>(connection) | operation;
+}
+
+static string error_string(const int error) {
+  return system_error(error, system_category()).what();
+}
+
+bool Server::init_uring() {
+  this->ring = make_unique<IoUring>(ring_entries);
+  // Multishot accept and receive are flags the probe doesn't report, they
+  // came with Linux 6.0 like IORING_OP_SEND_ZC. Without them every accept
+  // would fail
+  constexpr unsigned features = IORING_FEAT_NODROP | IORING_FEAT_CQE_SKIP;
+  if (!this->ring->ready() ||
+      (this->ring->features() & features) != features ||
+      !this->ring->supports({IORING_OP_ACCEPT, IORING_OP_RECV,
+                             IORING_OP_SENDMSG, IORING_OP_SEND,
+                             IORING_OP_READ, IORING_OP_PROVIDE_BUFFERS,
+                             IORING_OP_TIMEOUT, IORING_OP_ASYNC_CANCEL,
+                             IORING_OP_SEND_ZC})) {
+    this->ring.reset();
+    return false;
+  }
+
+  // Receives pick a buffer from this pool, no buffer is pinned per connection
+  this->ring->setup_buffers(recv_buffer_group, recv_buffer_count,
+                            recv_buffer_size);
+
+  // A single multishot accept serves every incoming connection
+  this->ring->prep_multishot_accept(this->server_socket,
+                                    encode(nullptr, ACCEPT));
+  return true;
+}
+
+void Server::run_uring() {
+  while (true) {
+    arm_timer_operation();
+    // One syscall submits everything queued while handling the previous
+    // batch (sends, reads, re-armed receives) and waits for completions
+    if (this->ring->submit_and_wait(1) == -1) {
+      Logger::LOG_ERROR("Error in io_uring_enter: " + error_string(errno));
+      exit(1);
+    }
+
+    this->ring->for_each_completion(
+        [this](const io_uring_cqe &cqe) { handle_completion(cqe); });
+
+    expire_deadlines();
+    // Free the connections released while handling this batch
+    this->closed_connections.clear();
+  }
+}
+
+void Server::handle_completion(const io_uring_cqe &cqe) {
+  const auto operation = static_cast<Operation>(cqe.user_data & OPERATION_MASK);
+  if (operation == ACCEPT) {
+    handle_accept_completion(cqe);
+    return;
+  }
+  if (operation == ACCEPT_RETRY) {
+    this->ring->prep_multishot_accept(this->server_socket,
+                                      encode(nullptr, ACCEPT));
+    return;
+  }
+  if (operation == TIMER) {
+    // Armed again for the next deadline before the next submit
+    this->timer_expiry = TimerWheel::Clock::time_point::max();
+    return;
+  }
+
+  auto &connection =
+      *reinterpret_cast<Connection *>(cqe.user_data & ~OPERATION_MASK);
+  // Multishot receives stay armed as long as F_MORE is set
+  if (!(cqe.flags & IORING_CQE_F_MORE))
+    connection.pending_operations--;
+
+  switch (operation) {
+  case RECV:
+    handle_recv_completion(connection, cqe);
+    break;
+  case SENDMSG:
+    handle_send_completion(connection, cqe);
+    break;
+  case SEND_FILE:
+    handle_file_send_completion(connection, cqe);
+    break;
+  case READ_FILE:
+    handle_read_completion(connection, cqe);
+    break;
+  default:
+    break;
+  }
+  update_receive(connection);
+  refresh_deadline(connection);
+
+  // The last completion of a closed connection releases it
+  if (connection.closed && connection.pending_operations == 0)
+    release_connection(connection);
+}
+
+void Server::handle_accept_completion(const io_uring_cqe &cqe) {
+  if (cqe.res < 0) {
+    Logger::LOG_ERROR("Error accepting connection: " + error_string(-cqe.res));
+    // Multishot accept was terminated. Re-arm it after a growing delay, an
+    // error such as running out of descriptors would repeat at once
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+      this->accept_backoff =
+          clamp(this->accept_backoff * 2, MIN_ACCEPT_BACKOFF,
+                MAX_ACCEPT_BACKOFF);
+      this->accept_timeout.tv_sec =
+          chrono::floor<chrono::seconds>(this->accept_backoff).count();
+      this->accept_timeout.tv_nsec = chrono::nanoseconds(
+          this->accept_backoff % chrono::seconds(1)).count();
+      this->ring->prep_timeout(&this->accept_timeout,
+                               encode(nullptr, ACCEPT_RETRY));
+    }
+    return;
+  }
+  this->accept_backoff = chrono::milliseconds(0);
+
+  // Multishot accept was terminated, re-arm it
+  if (!(cqe.flags & IORING_CQE_F_MORE))
+    this->ring->prep_multishot_accept(this->server_socket,
+                                      encode(nullptr, ACCEPT));
+
+  const int client_socket = cqe.res;
+  sockaddr_in client_address{};
+  socklen_t address_len = sizeof(client_address);
+  getpeername(client_socket, reinterpret_cast<sockaddr *>(&client_address),
+              &address_len);
+
+  // Keep one multishot receive armed for the lifetime of the connection
+  auto connection = make_unique<Connection>(client_socket, client_address,
+                                           this->request_limits);
+  connection->access_log = this->access_writer.get();
+  connection->metrics = this->worker_metrics;
+  update_receive(*connection);
+  refresh_deadline(*connection);
+  this->connections[client_socket] = std::move(connection);
+  if (this->worker_metrics)
+    this->worker_metrics->connections_accepted.add();
+
+  Logger::LOG_INFO("New connection from " +
+                   std::string(inet_ntoa(client_address.sin_addr)));
+}
+
+void Server::handle_recv_completion(Connection &connection,
+                                    const io_uring_cqe &cqe) {
+  // Re-armed by update_receive unless input is paused
+  if (!(cqe.flags & IORING_CQE_F_MORE)) {
+    connection.receiving = false;
+    connection.cancelling_receive = false;
+  }
+
+  // Copy the data out of the provided buffer and hand the buffer back
+  if (cqe.flags & IORING_CQE_F_BUFFER) {
+    const auto id = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+    if (cqe.res > 0 && !connection.closed)
+      connection.input.append(this->ring->buffer(id), cqe.res);
+    this->ring->recycle_buffer(id);
+  }
+
+  if (connection.closed)
+    return;
+
+  // The client closed its side: answer what it sent before, the connection
+  // closes once the output is sent
+  if (cqe.res == 0) {
+    Logger::LOG_INFO("Connection closed");
+    connection.peer_closed = true;
+    process_input(connection);
+    return;
+  }
+
+  // Check for errors, running out of provided buffers only needs a re-arm
+  if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED) {
+    Logger::LOG_ERROR("Error receiving data: " + error_string(-cqe.res));
+    close_session(connection.fd);
+    return;
+  }
+
+  // Completions may still arrive after pausing, until the cancel lands.
+  // Past that, the client keeps pipelining without reading the responses
+  if (connection.input_paused &&
+      connection.input.size() > this->request_limits.max_request_size()) {
+    Logger::LOG_WARNING("Too much input buffered, closing connection");
+    close_session(connection.fd);
+    return;
+  }
+
+  if (cqe.res > 0) {
+    if (connection.timed())
+      connection.received_at = AccessRecord::Clock::now();
+    process_input(connection);
+  }
+}
+
+void Server::arm_timer_operation() {
+  // Only a deadline earlier than the pending timer operation needs another,
+  // a later one is armed once that completes
+  const auto expiry = this->timers.next_expiry();
+  if (expiry >= this->timer_expiry)
+    return;
+  const auto wait = max(chrono::ceil<chrono::nanoseconds>(
+                            expiry - TimerWheel::Clock::now()),
+                        chrono::nanoseconds(0));
+  this->timer_timeout.tv_sec = chrono::floor<chrono::seconds>(wait).count();
+  this->timer_timeout.tv_nsec = (wait % chrono::seconds(1)).count();
+  this->ring->prep_timeout(&this->timer_timeout, encode(nullptr, TIMER));
+  this->timer_expiry = expiry;
+}
+
+void Server::update_receive(Connection &connection) {
+  // Nothing is received after the end of the stream
+  if (connection.closed || connection.peer_closed)
+    return;
+  if (!connection.input_paused && !connection.receiving) {
+    this->ring->prep_multishot_recv(connection.fd, recv_buffer_group,
+                                    encode(&connection, RECV));
+    connection.receiving = true;
+    connection.pending_operations++;
+  } else if (connection.input_paused && connection.receiving &&
+             !connection.cancelling_receive) {
+    // Re-armed once input resumes and the cancelled receive completed
+    this->ring->prep_cancel(encode(&connection, RECV));
+    connection.cancelling_receive = true;
+  }
+}
+
+void Server::submit_output(Connection &connection) {
+  if (connection.sending || connection.closed)
+    return;
+
+  if (connection.output.empty()) {
+    if (connection.close_after_write)
+      close_session(connection.fd);
+    return;
+  }
+
+  const OutputSegment &front = connection.output.front();
+  if (front.file) {
+    // Read the next chunk of the file without blocking, sent on completion
+    connection.staging.resize(min(FILE_CHUNK_SIZE, front.length));
+    this->ring->prep_read(front.file->descriptor(), connection.staging.data(),
+                          static_cast<unsigned>(connection.staging.size()),
+                          front.offset, encode(&connection, READ_FILE));
+  } else {
+    // Gather the consecutive in-memory segments into one sendmsg
+    connection.iov.clear();
+    for (const auto &segment : connection.output) {
+      if (segment.file || connection.iov.size() == MAX_IOV)
+        break;
+      connection.iov.push_back(
+          {const_cast<char *>(segment.bytes().data()) + segment.offset,
+           segment.remaining()});
+    }
+    connection.message = {};
+    connection.message.msg_iov = connection.iov.data();
+    connection.message.msg_iovlen = connection.iov.size();
+    this->ring->prep_sendmsg(connection.fd, &connection.message,
+                             encode(&connection, SENDMSG));
+  }
+  connection.sending = true;
+  connection.pending_operations++;
+}
+
+void Server::handle_send_completion(Connection &connection,
+                                    const io_uring_cqe &cqe) {
+  connection.sending = false;
+  if (connection.closed)
+    return;
+
+  if (cqe.res < 0) {
+    if (cqe.res != -EPIPE && cqe.res != -ECONNRESET)
+      Logger::LOG_WARNING("Error sending data: " + error_string(-cqe.res));
+    close_session(connection.fd);
+    return;
+  }
+
+  // Drop fully sent segments, remember progress in a partially sent one
+  connection.consume_output(cqe.res);
+  resume_input(connection);
+  submit_output(connection);
+}
+
+void Server::handle_read_completion(Connection &connection,
+                                    const io_uring_cqe &cqe) {
+  connection.sending = false;
+  if (connection.closed)
+    return;
+
+  if (cqe.res <= 0) {
+    Logger::LOG_ERROR("Error reading file: " + error_string(-cqe.res));
+    close_session(connection.fd);
+    return;
+  }
+
+  // Send what was read, a short read simply yields a smaller chunk
+  connection.staging.resize(cqe.res);
+  connection.staging_sent = 0;
+  this->ring->prep_send(connection.fd, connection.staging.data(),
+                        connection.staging.size(),
+                        encode(&connection, SEND_FILE));
+  connection.sending = true;
+  connection.pending_operations++;
+}
+
+void Server::handle_file_send_completion(Connection &connection,
+                                         const io_uring_cqe &cqe) {
+  connection.sending = false;
+  if (connection.closed)
+    return;
+
+  if (cqe.res < 0) {
+    if (cqe.res != -EPIPE && cqe.res != -ECONNRESET)
+      Logger::LOG_WARNING("Error sending data: " + error_string(-cqe.res));
+    close_session(connection.fd);
+    return;
+  }
+
+  // Push the rest of a partially sent chunk
+  connection.staging_sent += cqe.res;
+  if (connection.staging_sent < connection.staging.size()) {
+    this->ring->prep_send(
+        connection.fd, connection.staging.data() + connection.staging_sent,
+        connection.staging.size() - connection.staging_sent,
+        encode(&connection, SEND_FILE));
+    connection.sending = true;
+    connection.pending_operations++;
+    return;
+  }
+
+  connection.consume_output(connection.staging.size());
+  resume_input(connection);
+  submit_output(connection);
+}
+
+#endif // __linux__
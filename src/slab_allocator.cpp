@@ -0,0 +1,181 @@
+#include "slab_allocator.h"
+
+#include <algorithm>
+#include <cstring>
+
+SlabAllocator::SlabAllocator(const size_t capacity) {
+  const size_t count =
+      max<size_t>(1, (capacity + SEGMENT_SIZE - 1) / SEGMENT_SIZE);
+  // Pages are only backed by the kernel once written
+  this->memory = make_unique_for_overwrite<char[]>(count * SEGMENT_SIZE);
+  this->segments.resize(count);
+  this->free_list.reserve(count);
+  for (size_t i = count; i > 0; i--)
+    this->free_list.push_back(static_cast<uint32_t>(i - 1));
+
+  // Classes grow by a quarter, so a slot wastes at most a fifth of itself.
+  // Blocks above half a segment would not share one anyway.
+  for (size_t size = MIN_SLOT_SIZE; size <= SEGMENT_SIZE / 2;) {
+    this->classes.push_back(
+        {size, static_cast<uint32_t>(SEGMENT_SIZE / size), NONE});
+    // Slots stay 16-byte aligned
+    size = max(size + 16, (size + size / 4 + 15) & ~size_t{15});
+  }
+}
+
+size_t SlabAllocator::class_of(const size_t size) const {
+  const auto it = lower_bound(
+      this->classes.begin(), this->classes.end(), size,
+      [](const SizeClass &size_class, const size_t value) {
+        return size_class.slot_size < value;
+      });
+  return it - this->classes.begin();
+}
+
+size_t SlabAllocator::segments_needed(const size_t size) const {
+  const lock_guard guard(this->lock);
+  const size_t size_class = class_of(size);
+  return size_class < this->classes.size() &&
+                 this->classes[size_class].partial != NONE
+             ? 0
+             : 1;
+}
+
+size_t SlabAllocator::free_segments() const {
+  const lock_guard guard(this->lock);
+  return this->free_list.size();
+}
+
+char *SlabAllocator::allocate(const size_t size) {
+  const lock_guard guard(this->lock);
+  if (size == 0 || size > SEGMENT_SIZE)
+    return nullptr;
+
+  char *block;
+  size_t allocated;
+  if (const size_t size_class = class_of(size);
+      size_class < this->classes.size()) {
+    block = allocate_slot(size_class);
+    allocated = this->classes[size_class].slot_size;
+  } else {
+    if (this->free_list.empty())
+      return nullptr;
+    const uint32_t index = this->free_list.back();
+    this->free_list.pop_back();
+    this->segments[index] = Segment{};
+    block = this->memory.get() + index * SEGMENT_SIZE;
+    allocated = SEGMENT_SIZE;
+  }
+  if (block) {
+    this->bytes_requested += size;
+    this->bytes_allocated += allocated;
+  }
+  return block;
+}
+
+char *SlabAllocator::allocate_slot(const size_t size_class) {
+  SizeClass &slab = this->classes[size_class];
+  if (slab.partial == NONE) {
+    // Give the class a fresh segment
+    if (this->free_list.empty())
+      return nullptr;
+    const uint32_t index = this->free_list.back();
+    this->free_list.pop_back();
+    this->segments[index] = Segment{static_cast<int32_t>(size_class)};
+    link(slab, index);
+  }
+
+  const uint32_t index = slab.partial;
+  Segment &segment = this->segments[index];
+  char *slot;
+  if (segment.free_slots) {
+    slot = segment.free_slots;
+    memcpy(&segment.free_slots, slot, sizeof(char *));
+  } else {
+    slot = this->memory.get() + index * SEGMENT_SIZE +
+           segment.carved * slab.slot_size;
+    segment.carved++;
+  }
+  if (++segment.used == slab.slots_per_segment)
+    unlink(slab, index);
+  return slot;
+}
+
+void SlabAllocator::release(char *block, const size_t size) {
+  const lock_guard guard(this->lock);
+  const auto index = static_cast<uint32_t>((block - this->memory.get()) /
+                                           SEGMENT_SIZE);
+  const Segment &segment = this->segments[index];
+  this->bytes_requested -= size;
+  if (segment.size_class == WHOLE) {
+    this->bytes_allocated -= SEGMENT_SIZE;
+    this->free_list.push_back(index);
+    return;
+  }
+  this->bytes_allocated -= this->classes[segment.size_class].slot_size;
+  release_slot(index, block);
+}
+
+void SlabAllocator::release_slot(const uint32_t index, char *slot) {
+  Segment &segment = this->segments[index];
+  SizeClass &slab = this->classes[segment.size_class];
+  if (segment.used == slab.slots_per_segment)
+    link(slab, index);
+
+  memcpy(slot, &segment.free_slots, sizeof(char *));
+  segment.free_slots = slot;
+  // An empty segment can serve any class again
+  if (--segment.used == 0) {
+    unlink(slab, index);
+    this->free_list.push_back(index);
+  }
+}
+
+void SlabAllocator::link(SizeClass &size_class, const uint32_t index) {
+  Segment &segment = this->segments[index];
+  segment.previous = NONE;
+  segment.next = size_class.partial;
+  if (size_class.partial != NONE)
+    this->segments[size_class.partial].previous = index;
+  size_class.partial = index;
+}
+
+void SlabAllocator::unlink(SizeClass &size_class, const uint32_t index) {
+  Segment &segment = this->segments[index];
+  if (segment.previous != NONE)
+    this->segments[segment.previous].next = segment.next;
+  else
+    size_class.partial = segment.next;
+  if (segment.next != NONE)
+    this->segments[segment.next].previous = segment.previous;
+  segment.previous = segment.next = NONE;
+}
+
+SlabAllocator::Stats SlabAllocator::stats() const {
+  const lock_guard guard(this->lock);
+  Stats stats;
+  stats.capacity = this->segments.size() * SEGMENT_SIZE;
+  stats.segments_used = this->segments.size() - this->free_list.size();
+  stats.bytes_requested = this->bytes_requested;
+  stats.bytes_allocated = this->bytes_allocated;
+  for (const SizeClass &slab : this->classes)
+    for (uint32_t index = slab.partial; index != NONE;
+         index = this->segments[index].next)
+      stats.bytes_stranded +=
+          SEGMENT_SIZE - this->segments[index].used * slab.slot_size;
+  return stats;
+}
+
+double SlabAllocator::Stats::internal_fragmentation() const {
+  if (this->bytes_allocated == 0)
+    return 0;
+  return 1.0 - static_cast<double>(this->bytes_requested) /
+                   static_cast<double>(this->bytes_allocated);
+}
+
+double SlabAllocator::Stats::external_fragmentation() const {
+  if (this->segments_used == 0)
+    return 0;
+  return static_cast<double>(this->bytes_stranded) /
+         static_cast<double>(this->segments_used * SEGMENT_SIZE);
+}
@@ -0,0 +1,115 @@
+#include "timer_wheel.h"
+
+#include <algorithm>
+
+TimerWheel::TimerWheel() : origin(Clock::now()) {
+  for (auto &level : this->slots) {
+    for (Timer &slot : level)
+      slot.previous = slot.next = &slot;
+  }
+}
+
+void TimerWheel::arm(Timer &timer, const Clock::time_point deadline) {
+  cancel(timer);
+  // Rounded up, a timer never expires early
+  const int64_t elapsed =
+      max<int64_t>(chrono::ceil<chrono::milliseconds>(deadline - this->origin)
+                       .count(),
+                   0);
+  const uint64_t ticks = (elapsed + TICK.count() - 1) / TICK.count();
+  timer.expires = max(ticks, this->current + 1);
+  place(timer);
+  this->count++;
+}
+
+void TimerWheel::cancel(Timer &timer) {
+  if (!timer.armed())
+    return;
+  unlink(timer);
+  this->count--;
+}
+
+TimerWheel::Clock::time_point TimerWheel::next_expiry() const {
+  if (this->count == 0)
+    return Clock::time_point::max();
+  // The next tick with timers to expire, or to move down from the level
+  // above once the lowest level comes round
+  uint64_t next = this->current + 1;
+  while (next % SLOTS != 0) {
+    const Timer &slot = this->slots[0][next % SLOTS];
+    if (slot.next != &slot)
+      break;
+    next++;
+  }
+  return this->origin + next * TICK;
+}
+
+int TimerWheel::timeout_ms(const Clock::time_point now) const {
+  if (this->count == 0)
+    return -1;
+  const auto wait = chrono::ceil<chrono::milliseconds>(next_expiry() - now);
+  return static_cast<int>(max<int64_t>(wait.count(), 0));
+}
+
+void TimerWheel::place(Timer &timer) {
+  // Timers beyond the top level wait in its last slot and are placed again
+  constexpr uint64_t span = uint64_t{1} << (SLOT_BITS * LEVELS);
+  const uint64_t expires = min(timer.expires, this->current + span - 1);
+  const uint64_t delta = expires - min(expires, this->current);
+  unsigned level = 0;
+  while (level + 1 < LEVELS &&
+         delta >= uint64_t{1} << (SLOT_BITS * (level + 1)))
+    level++;
+  link(this->slots[level][(expires >> (SLOT_BITS * level)) % SLOTS], timer);
+}
+
+void TimerWheel::tick(Timer &expired) {
+  this->current++;
+  // From the top, timers moved down may have to move on at the same tick
+  for (unsigned level = LEVELS - 1; level > 0; level--) {
+    if (this->current % (uint64_t{1} << (SLOT_BITS * level)) != 0)
+      continue;
+    Timer moving;
+    moving.previous = moving.next = &moving;
+    splice(this->slots[level][(this->current >> (SLOT_BITS * level)) % SLOTS],
+           moving);
+    while (moving.next != &moving) {
+      Timer &timer = *moving.next;
+      unlink(timer);
+      place(timer);
+    }
+  }
+
+  Timer &slot = this->slots[0][this->current % SLOTS];
+  while (slot.next != &slot) {
+    Timer &timer = *slot.next;
+    unlink(timer);
+    if (timer.expires <= this->current)
+      link(expired, timer);
+    else
+      place(timer);
+  }
+}
+
+void TimerWheel::link(Timer &list, Timer &timer) {
+  timer.previous = list.previous;
+  timer.next = &list;
+  list.previous->next = &timer;
+  list.previous = &timer;
+}
+
+void TimerWheel::unlink(Timer &timer) {
+  timer.previous->next = timer.next;
+  timer.next->previous = timer.previous;
+  timer.previous = timer.next = nullptr;
+}
+
+void TimerWheel::splice(Timer &from, Timer &to) {
+  if (from.next == &from)
+    return;
+  to.previous->next = from.next;
+  from.next->previous = to.previous;
+  from.previous->next = &to;
+  to.previous = from.previous;
+  from.previous = from.next = &from;
+}
@@ -0,0 +1,283 @@
+#ifdef __linux__
+
+#include "uring.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <system_error>
+#include <unistd.h>
+
+// Kernel ring indices are shared with the kernel, access them atomically
+static unsigned load_acquire(unsigned *value) {
+  return atomic_ref(*value).load(memory_order_acquire);
+}
+
+static void store_release(unsigned *value, const unsigned new_value) {
+  atomic_ref(*value).store(new_value, memory_order_release);
+}
+
+IoUring::IoUring(const unsigned entries) {
+  io_uring_params params{};
+  // Defer task work to our own io_uring_enter calls, we are single threaded
+  params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+  this->ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+  if (this->ring_fd == -1 && errno == EINVAL) {
+    // Older kernel without the optional setup flags
+    params = {};
+    this->ring_fd =
+        static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+  }
+  if (this->ring_fd == -1) {
+    Logger::LOG_WARNING("io_uring unavailable: " +
+                        string(system_error(errno, system_category()).what()));
+    return;
+  }
+  this->entries = params.sq_entries;
+  this->kernel_features = params.features;
+
+  // Map submission and completion rings
+  this->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  this->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap)
+    this->sq_ring_size = this->cq_ring_size =
+        max(this->sq_ring_size, this->cq_ring_size);
+
+  this->sq_ring = mmap(nullptr, this->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, this->ring_fd,
+                       IORING_OFF_SQ_RING);
+  if (this->sq_ring == MAP_FAILED) {
+    this->sq_ring = nullptr;
+    close(this->ring_fd);
+    this->ring_fd = -1;
+    return;
+  }
+  if (single_mmap) {
+    this->cq_ring = this->sq_ring;
+  } else {
+    this->cq_ring = mmap(nullptr, this->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, this->ring_fd,
+                         IORING_OFF_CQ_RING);
+    if (this->cq_ring == MAP_FAILED) {
+      this->cq_ring = nullptr;
+      close(this->ring_fd);
+      this->ring_fd = -1;
+      return;
+    }
+  }
+  this->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+  void *sqes_memory =
+      mmap(nullptr, this->sqes_size, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, this->ring_fd, IORING_OFF_SQES);
+  if (sqes_memory == MAP_FAILED) {
+    close(this->ring_fd);
+    this->ring_fd = -1;
+    return;
+  }
+  this->sqes = static_cast<io_uring_sqe *>(sqes_memory);
+
+  auto *sq = static_cast<char *>(this->sq_ring);
+  this->sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+  this->sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  this->sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  // SQ slots map one to one onto SQEs
+  auto *sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  for (unsigned i = 0; i < params.sq_entries; i++)
+    sq_array[i] = i;
+  this->sqe_tail = *this->sq_tail;
+
+  auto *cq = static_cast<char *>(this->cq_ring);
+  this->cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  this->cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  this->cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  this->cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+}
+
+IoUring::~IoUring() {
+  delete[] this->buffer_memory;
+  if (this->sqes)
+    munmap(this->sqes, this->sqes_size);
+  if (this->cq_ring && this->cq_ring != this->sq_ring)
+    munmap(this->cq_ring, this->cq_ring_size);
+  if (this->sq_ring)
+    munmap(this->sq_ring, this->sq_ring_size);
+  if (this->ring_fd != -1)
+    close(this->ring_fd);
+}
+
+bool IoUring::ready() const { return this->ring_fd != -1; }
+
+bool IoUring::supports(const initializer_list<uint8_t> opcodes) const {
+  // Room for every possible opcode, the kernel fills in up to its last one
+  constexpr unsigned max_ops = 256;
+  alignas(io_uring_probe) char
+      memory[sizeof(io_uring_probe) + max_ops * sizeof(io_uring_probe_op)] = {};
+  auto *probe = reinterpret_cast<io_uring_probe *>(memory);
+  if (syscall(__NR_io_uring_register, this->ring_fd, IORING_REGISTER_PROBE,
+              probe, max_ops) == -1)
+    return false;
+  return all_of(opcodes.begin(), opcodes.end(), [probe](const uint8_t op) {
+    return op <= probe->last_op &&
+           (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+  });
+}
+
+void IoUring::setup_buffers(const uint16_t group, const unsigned count,
+                            const unsigned size) {
+  this->buffer_group = group;
+  this->buffer_size = size;
+  this->buffer_memory = new char[static_cast<size_t>(count) * size];
+  prep_provide_buffers(0, count);
+}
+
+char *IoUring::buffer(const uint16_t id) const {
+  return this->buffer_memory + static_cast<size_t>(id) * this->buffer_size;
+}
+
+void IoUring::recycle_buffer(const uint16_t id) { prep_provide_buffers(id, 1); }
+
+void IoUring::prep_provide_buffers(const uint16_t id, const unsigned count) {
+  // Goes out with the next submission, no completion unless it fails
+  io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+  sqe->fd = static_cast<int>(count);
+  sqe->addr = reinterpret_cast<uint64_t>(buffer(id));
+  sqe->len = this->buffer_size;
+  sqe->off = id;
+  sqe->buf_group = this->buffer_group;
+  sqe->user_data = INTERNAL;
+}
+
+io_uring_sqe *IoUring::get_sqe() {
+  // Submission queue full: hand what we have to the kernel first
+  while (this->sqe_tail - load_acquire(this->sq_head) >= this->entries) {
+    if (submit_and_wait(0) == -1) {
+      Logger::LOG_ERROR("Error in io_uring_enter: " +
+                        string(system_error(errno, system_category()).what()));
+      exit(1);
+    }
+    if (this->sqe_tail - load_acquire(this->sq_head) < this->entries)
+      break;
+    // Refused while the completion queue is backed up, make room in it
+    io_uring_cqe cqe{};
+    while (pop_completion(cqe))
+      this->deferred.push_back(cqe);
+  }
+
+  io_uring_sqe *sqe = &this->sqes[this->sqe_tail & this->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  this->sqe_tail++;
+  this->to_submit++;
+  return sqe;
+}
+
+void IoUring::prep_multishot_accept(const int fd, const uint64_t user_data) {
+  io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = user_data;
+}
+
+void IoUring::prep_multishot_recv(const int fd, const uint16_t group,
+                                  const uint64_t user_data) {
+  io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = group;
+  sqe->user_data = user_data;
+}
+
+void IoUring::prep_sendmsg(const int fd, const msghdr *message,
+                           const uint64_t user_data) {
+  io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uint64_t>(message);
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = user_data;
+}
+
+void IoUring::prep_send(const int fd, const void *buffer, const size_t size,
+                        const uint64_t user_data) {
+  io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uint64_t>(buffer);
+  sqe->len = static_cast<uint32_t>(size);
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = user_data;
+}
+
+void IoUring::prep_read(const int fd, void *buffer, const unsigned size,
+                        const off_t offset, const uint64_t user_data) {
+  io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uint64_t>(buffer);
+  sqe->len = size;
+  sqe->off = static_cast<uint64_t>(offset);
+  sqe->user_data = user_data;
+}
+
+void IoUring::prep_timeout(const __kernel_timespec *timeout,
+                           const uint64_t user_data) {
+  io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->fd = -1;
+  sqe->addr = reinterpret_cast<uint64_t>(timeout);
+  sqe->len = 1;
+  sqe->user_data = user_data;
+}
+
+void IoUring::prep_cancel(const uint64_t target) {
+  io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = target;
+  sqe->user_data = INTERNAL;
+}
+
+int IoUring::submit_and_wait(const unsigned wait_count) {
+  // Publish prepared SQEs
+  store_release(this->sq_tail, this->sqe_tail);
+
+  const unsigned flags = wait_count > 0 ? IORING_ENTER_GETEVENTS : 0;
+  while (true) {
+    const long submitted = syscall(__NR_io_uring_enter, this->ring_fd,
+                                   this->to_submit, wait_count, flags, nullptr, 0);
+    if (submitted >= 0) {
+      this->to_submit -= static_cast<unsigned>(submitted);
+      return static_cast<int>(submitted);
+    }
+    if (errno == EINTR)
+      continue;
+    // Completion queue backed up, the caller will reap and retry
+    if (errno == EBUSY || errno == EAGAIN)
+      return 0;
+    return -1;
+  }
+}
+
+bool IoUring::pop_completion(io_uring_cqe &cqe) {
+  const unsigned head = *this->cq_head;
+  if (head == load_acquire(this->cq_tail))
+    return false;
+  cqe = this->cqes[head & this->cq_mask];
+  store_release(this->cq_head, head + 1);
+  return true;
+}
+
+#endif // __linux__
@@ -0,0 +1,82 @@
+#include "validators.h"
+
+#include <cstdio>
+
+namespace http {
+
+std::string format_http_date(const time_t time) {
+  tm utc{};
+  gmtime_r(&time, &utc);
+  char date[64];
+  const size_t length =
+      strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &utc);
+  return {date, length};
+}
+
+bool parse_http_date(const std::string_view date, time_t &time) {
+  // strptime needs a terminated string, dates are 29 characters
+  char buffer[64];
+  if (date.size() >= sizeof(buffer))
+    return false;
+  date.copy(buffer, date.size());
+  buffer[date.size()] = '\0';
+
+  tm utc{};
+  const char *end = strptime(buffer, "%a, %d %b %Y %H:%M:%S GMT", &utc);
+  if (end == nullptr || *end != '\0')
+    return false;
+  time = timegm(&utc);
+  return true;
+}
+
+std::string entity_tag(const struct stat &file_stat) {
+#ifdef __APPLE__
+  const timespec modified = file_stat.st_mtimespec;
+#else
+  const timespec modified = file_stat.st_mtim;
+#endif
+  const auto nanoseconds =
+      static_cast<unsigned long long>(modified.tv_sec) * 1000000000ULL +
+      static_cast<unsigned long long>(modified.tv_nsec);
+  char tag[64];
+  const int length =
+      snprintf(tag, sizeof(tag), "\"%llx-%llx-%llx\"",
+               static_cast<unsigned long long>(file_stat.st_ino),
+               static_cast<unsigned long long>(file_stat.st_size), nanoseconds);
+  return {tag, static_cast<size_t>(length)};
+}
+
+std::string entity_tag(const std::string_view identity_tag,
+                       const std::string_view coding) {
+  // "tag" becomes "tag-gzip"
+  std::string tag(identity_tag.substr(0, identity_tag.size() - 1));
+  tag += '-';
+  tag += coding;
+  tag += '"';
+  return tag;
+}
+
+// Opaque part of a tag, without the weakness indicator
+static std::string_view opaque_tag(std::string_view tag) {
+  if (tag.starts_with("W/"))
+    tag.remove_prefix(2);
+  return tag;
+}
+
+bool tag_list_matches(std::string_view tags, const std::string_view tag) {
+  while (!tags.empty()) {
+    const size_t comma = tags.find(',');
+    std::string_view element = tags.substr(0, comma);
+    tags = comma == std::string_view::npos ? std::string_view()
+                                           : tags.substr(comma + 1);
+    while (!element.empty() && (element.front() == ' ' || element.front() == '\t'))
+      element.remove_prefix(1);
+    while (!element.empty() && (element.back() == ' ' || element.back() == '\t'))
+      element.remove_suffix(1);
+    if (element == "*" || opaque_tag(element) == opaque_tag(tag))
+      return true;
+  }
+  return false;
+}
+
+} // namespace http